@@ -0,0 +1,140 @@
+/*
+ *   serial-pl011-trace.h
+ *   Tracepoints for the PL011 MIDI driver.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   The header is included from the driver's own directory, so the module
+ *   has to be built with -I$(src); Kbuild sets CFLAGS_serial-pl011.o.
+ *
+ *   Every event carries the UART base address, the bytes waiting in
+ *   tx_buff ("ring") and the bytes believed to be in the TX FIFO.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM snd_serial_pl011
+
+#if !defined(_SERIAL_PL011_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SERIAL_PL011_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(snd_serial_pl011_irq,
+	TP_PROTO(unsigned long base, int work, int ring, int fifo),
+	TP_ARGS(base, work, ring, fifo),
+	TP_STRUCT__entry(
+		__field(unsigned long, base)
+		__field(int, work)
+		__field(int, ring)
+		__field(int, fifo)
+	),
+	TP_fast_assign(
+		__entry->base = base;
+		__entry->work = work;
+		__entry->ring = ring;
+		__entry->fifo = fifo;
+	),
+	TP_printk("%#lx work=%d ring=%d fifo=%d",
+		  __entry->base, __entry->work, __entry->ring, __entry->fifo)
+);
+
+TRACE_EVENT(snd_serial_pl011_tx_byte,
+	TP_PROTO(unsigned long base, unsigned char byte, int ring, int fifo),
+	TP_ARGS(base, byte, ring, fifo),
+	TP_STRUCT__entry(
+		__field(unsigned long, base)
+		__field(unsigned char, byte)
+		__field(int, ring)
+		__field(int, fifo)
+	),
+	TP_fast_assign(
+		__entry->base = base;
+		__entry->byte = byte;
+		__entry->ring = ring;
+		__entry->fifo = fifo;
+	),
+	TP_printk("%#lx byte=%02x ring=%d fifo=%d",
+		  __entry->base, __entry->byte, __entry->ring, __entry->fifo)
+);
+
+/* tx_state values of struct snd_uart_pl011 */
+#define show_tx_state(state)				\
+	__print_symbolic(state,				\
+			 { 0, "TX_IDLE" },		\
+			 { 1, "TX_BLOCK_RX" },		\
+			 { 2, "TX_BUSY" })
+
+TRACE_EVENT(snd_serial_pl011_timer,
+	TP_PROTO(unsigned long base, int from, int to, int ring, int fifo),
+	TP_ARGS(base, from, to, ring, fifo),
+	TP_STRUCT__entry(
+		__field(unsigned long, base)
+		__field(int, from)
+		__field(int, to)
+		__field(int, ring)
+		__field(int, fifo)
+	),
+	TP_fast_assign(
+		__entry->base = base;
+		__entry->from = from;
+		__entry->to = to;
+		__entry->ring = ring;
+		__entry->fifo = fifo;
+	),
+	TP_printk("%#lx %s -> %s ring=%d fifo=%d", __entry->base,
+		  show_tx_state(__entry->from), show_tx_state(__entry->to),
+		  __entry->ring, __entry->fifo)
+);
+
+TRACE_EVENT(snd_serial_pl011_output_write,
+	TP_PROTO(unsigned long base, int port, int queued, int ring, int fifo),
+	TP_ARGS(base, port, queued, ring, fifo),
+	TP_STRUCT__entry(
+		__field(unsigned long, base)
+		__field(int, port)
+		__field(int, queued)
+		__field(int, ring)
+		__field(int, fifo)
+	),
+	TP_fast_assign(
+		__entry->base = base;
+		__entry->port = port;
+		__entry->queued = queued;
+		__entry->ring = ring;
+		__entry->fifo = fifo;
+	),
+	TP_printk("%#lx port=%d queued=%d ring=%d fifo=%d",
+		  __entry->base, __entry->port, __entry->queued,
+		  __entry->ring, __entry->fifo)
+);
+
+TRACE_EVENT(snd_serial_pl011_drain,
+	TP_PROTO(unsigned long base, int done, int ring, int fifo),
+	TP_ARGS(base, done, ring, fifo),
+	TP_STRUCT__entry(
+		__field(unsigned long, base)
+		__field(int, done)
+		__field(int, ring)
+		__field(int, fifo)
+	),
+	TP_fast_assign(
+		__entry->base = base;
+		__entry->done = done;
+		__entry->ring = ring;
+		__entry->fifo = fifo;
+	),
+	TP_printk("%#lx %s ring=%d fifo=%d", __entry->base,
+		  __entry->done ? "end" : "begin",
+		  __entry->ring, __entry->fifo)
+);
+
+#endif /* _SERIAL_PL011_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE serial-pl011-trace
+#include <trace/define_trace.h>
@@ -38,8 +38,12 @@
 #include <linux/ioport.h>
 #include <linux/io.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/bitops.h>
+#include <linux/of.h>
 #include <sound/core.h>
 #include <sound/rawmidi.h>
+#include <sound/info.h>
 #include <sound/initval.h>
 
 #include <linux/amba/bus.h>
@@ -47,9 +51,16 @@
 #include <linux/pinctrl/consumer.h>
 #include <linux/clk.h>
 #include <linux/jiffies.h>
+#include <linux/circ_buf.h>
+#include <linux/log2.h>
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
 
 #include <asm/io.h>
 
+#define CREATE_TRACE_POINTS
+#include "serial-pl011-trace.h"
+
 MODULE_DESCRIPTION("MIDI serial pl011");
 MODULE_LICENSE("GPL");
 MODULE_SUPPORTED_DEVICE("{{ALSA, MIDI serial pl011}}");
@@ -73,7 +84,25 @@ static char *adaptor_names[] = {
 #define SNDRV_SERIAL_NOTHROTTLE 0
 #define SNDRV_SERIAL_NORTSCTS 0
 #define SNDRV_SERIAL_DEFAULT_FIFO 16
+#define SNDRV_SERIAL_DEFAULT_QUANTUM 32
 #define TIMER_ATTEMPTS_LIMIT 255
+#define ADAPT_INIT_NS	320000		/* a byte at 31250 baud */
+#define ADAPT_MAX_NS	10000000
+#define ADAPT_STEP_NS	1000
+
+/* FIFO trigger level policy */
+#define SNDRV_SERIAL_FIFO_FIXED		0	/* RX 1/4, TX 1/8 as always */
+#define SNDRV_SERIAL_FIFO_LATENCY	1	/* low levels, IRQ early */
+#define SNDRV_SERIAL_FIFO_THROUGHPUT	2	/* high levels, fewer IRQs */
+#define SNDRV_SERIAL_FIFO_ADAPTIVE	3	/* RX level follows traffic */
+#define SNDRV_SERIAL_FIFO_MODES		4
+static char *fifo_mode_names[] = {
+	"fixed",
+	"latency",
+	"throughput",
+	"adaptive"
+};
+#define FIFO_ADAPT_STREAK	4	/* full level IRQs before going up */
 
 static int speed = 115200; /* 9600,19200,38400,57600,115200 */
 static int outs = 1;	 /* 1 to 16 */
@@ -85,6 +114,14 @@ static int throttle_delay = 1000;
 static int dynamic_throttle = 0;
 static int fifo_limit = SNDRV_SERIAL_DEFAULT_FIFO;
 static bool flow_control = SNDRV_SERIAL_NORTSCTS;
+static bool use_dma = 0;
+static int tx_quantum = SNDRV_SERIAL_DEFAULT_QUANTUM;
+static bool running_status = 0;
+static bool threaded_irq = 0;
+static bool tx_sched = 0;
+static bool rx_tstamp = 0;
+static bool adaptive_throttle = 0;
+static int fifo_mode = SNDRV_SERIAL_FIFO_FIXED;
 
 module_param(speed, int, 0444);
 MODULE_PARM_DESC(speed, "Speed in bauds.");
@@ -104,6 +141,22 @@ module_param(flow_control, bool, 0444);
 MODULE_PARM_DESC(flow_control, "Use RTS/CTS flow control");
 module_param(fifo_limit, int, 0444);
 MODULE_PARM_DESC(fifo_limit, "Maximum TX bytes per write");
+module_param(use_dma, bool, 0444);
+MODULE_PARM_DESC(use_dma, "Use DMA for TX/RX if channels are available");
+module_param(tx_quantum, int, 0444);
+MODULE_PARM_DESC(tx_quantum, "TX bytes per output before switching at the next message boundary");
+module_param(running_status, bool, 0444);
+MODULE_PARM_DESC(running_status, "Leave out repeated status bytes on output");
+module_param(threaded_irq, bool, 0444);
+MODULE_PARM_DESC(threaded_irq, "Service the UART from an IRQ thread, polling under load");
+module_param(tx_sched, bool, 0444);
+MODULE_PARM_DESC(tx_sched, "Take output as frames stamped with the time they are due");
+module_param(rx_tstamp, bool, 0444);
+MODULE_PARM_DESC(rx_tstamp, "Add an input device giving frames stamped with the arrival time");
+module_param(adaptive_throttle, bool, 0444);
+MODULE_PARM_DESC(adaptive_throttle, "Learn each output's drain rate from CTS (needs throttle_tx and flow_control)");
+module_param(fifo_mode, int, 0444);
+MODULE_PARM_DESC(fifo_mode, "FIFO trigger levels: 0 fixed, 1 latency, 2 throughput, 3 adaptive");
 
 module_param(adaptor, int, 0444);
 MODULE_PARM_DESC(adaptor, "Type of adaptor.");
@@ -112,273 +165,2020 @@ MODULE_PARM_DESC(adaptor, "Type of adaptor.");
 
 #define SNDRV_SERIAL_MAX_OUTS	16		/* max 64, min 16 */
 #define SNDRV_SERIAL_MAX_INS	16		/* max 64, min 16 */
+#define SNDRV_SERIAL_MAX_UARTS	8		/* rawmidi devices per card */
+#define SNDRV_SERIAL_TSTAMP_DEV	(SNDRV_SERIAL_MAX_UARTS / 2) /* rx_tstamp */
+
+#define TX_BUFF_MAX		(1<<15)		/* TX ring size limits */
+#define TX_BUFF_MIN		64
+
+#define PORT_BUFF_SIZE		(1<<11)		/* Must be 2^n */
+#define PORT_BUFF_MASK		(PORT_BUFF_SIZE - 1)
+
+#define RT_BUFF_SIZE		16		/* Must be 2^n */
+#define RT_BUFF_MASK		(RT_BUFF_SIZE - 1)
+
+#define RX_BUFF_SIZE		32		/* RX staging, >= FIFO depth */
+#define FRAME_DATA		16
+#define SCHED_QUEUE_SIZE	64		/* Scheduled events per port */
+
+#define DMA_BUFF_SIZE		(1<<10)		/* Bounce buffer per direction */
+
+#define AMBA_ISR_PASS_LIMIT	256
+
+#define HIST_BUCKETS		16	/* log2 of microseconds */
+
+#define POLL_FIFO_BYTES		8	/* Poll when half the FIFO could fill */
+#define POLL_BUSY_BYTES		4	/* Keep polling while a pass moves this */
+
+#define SERIAL_MODE_NOT_OPENED 		(0)
+#define SERIAL_MODE_INPUT_OPEN		(1 << 0)
+#define SERIAL_MODE_OUTPUT_OPEN		(1 << 1)
+#define SERIAL_MODE_INPUT_TRIGGERED	(1 << 2)
+#define SERIAL_MODE_OUTPUT_TRIGGERED	(1 << 3)
+
+/* What the IRQ thread is woken for, in irq_events */
+#define SERIAL_EV_IO		0	/* the UART, or the poll timer */
+#define SERIAL_EV_THROTTLE	1	/* buffer_timer expired */
+
+/* Timestamped frame, same layout as struct snd_rawmidi_framing_tstamp
+ * of later kernels. Read from the rx_tstamp device, stamped with the
+ * CLOCK_MONOTONIC arrival of the first byte, and written with tx_sched,
+ * stamped with the time the data is due. */
+struct snd_uart_pl011_frame {
+	u8 frame_type;
+	u8 length;
+	u8 reserved[2];
+	u32 tv_nsec;
+	u64 tv_sec;
+	u8 data[FRAME_DATA];
+} __packed;
+
+/* Output queue for one substream. Single producer (port_fill, under
+ * fill_lock) and single consumer (tx_schedule, under open_lock): buff_in
+ * is only written by the producer and buff_out only by the consumer. */
+struct snd_uart_pl011_port {
+	unsigned char buff[PORT_BUFF_SIZE];
+	int buff_in;
+	int buff_out;
+	int triggered;
+	unsigned char status;	/* running status of this port's stream */
+	unsigned char tx_left;	/* data bytes of the message being sent */
+	unsigned char tx_sysex;	/* a SysEx is being sent */
+	/* events waiting for their time, producer side only */
+	struct snd_uart_pl011_frame sched[SCHED_QUEUE_SIZE];
+	int sched_in;
+	int sched_out;
+	int sched_count;
+	/* latency sample: the byte at mark_pos was queued at mark_time */
+	int mark_pos;
+	ktime_t mark_time;
+	unsigned long tx_bytes;
+	unsigned long queue_full;	/* rawmidi held back, queue full */
+	unsigned long drops;		/* droponfull */
+};
+
+/* Where an input stream is in the MIDI grammar */
+struct snd_uart_pl011_rx_parser {
+	unsigned char status;	/* running status, 0 if none */
+	unsigned char left;	/* data bytes still to come */
+	unsigned char sysex;
+};
+
+struct snd_uart_pl011_dmabuf {
+	struct dma_chan *chan;
+	unsigned char *buf;
+	dma_addr_t dma;
+	dma_cookie_t cookie;
+	unsigned int len;	/* bytes in flight (TX only) */
+	int queued;
+};
+
+struct snd_uart_pl011 {
+	struct amba_device *dev;
+	struct snd_card *card;
+	struct snd_rawmidi *rmidi;
+	struct snd_rawmidi_substream *midi_output[SNDRV_SERIAL_MAX_OUTS];
+	struct snd_rawmidi_substream *midi_input[SNDRV_SERIAL_MAX_INS];
+	struct snd_rawmidi *rmidi_tstamp;	/* rx_tstamp */
+	struct snd_rawmidi_substream *midi_tstamp[SNDRV_SERIAL_MAX_INS];
+
+	int filemode;		/* open status of file */
+
+	spinlock_t open_lock;
+	spinlock_t fill_lock;	/* producer side of the port queues */
+	struct tasklet_struct fill_tasklet;
+	wait_queue_head_t drain_wait;
+	int draining;
+
+	int irq;
+
+	void __iomem *membase;
+	unsigned long mapbase;
+	struct resource *res_base;
+
+	struct clk *clk;
+	unsigned long clk_rate;
+	unsigned int speed;
+
+	/* parameter for using of write loop */
+	short int fifo_limit;
+        short int fifo_count;
+
+	/* type of adaptor */
+	int adaptor;
+
+	/* inputs */
+	int prev_in;
+	int rx_switch;		/* 0xf5 received, port number next */
+	struct snd_uart_pl011_rx_parser rx_parse[SNDRV_SERIAL_MAX_INS];
+	unsigned char rx_buff[RX_BUFF_SIZE];
+	unsigned char rx_start[RX_BUFF_SIZE];	/* byte begins a message */
+	int rx_count;
+	int rx_done;		/* staged bytes up to the last whole message */
+	int rx_tstamp;		/* timestamp inputs open */
+	ktime_t rx_stamp[RX_BUFF_SIZE];	/* arrival of each staged byte */
+	ktime_t rx_time;		/* arrival of the byte being received */
+	ktime_t irq_time;		/* taken on interrupt entry */
+	int irq_stamped;
+	u32 rx_byte_ns;
+	unsigned long rx_frames_dropped;
+
+	/* scheduled output */
+	int tx_sched;
+	struct hrtimer sched_timer;
+	unsigned long sched_events;
+
+	/* outputs */
+	int prev_out;
+	unsigned char prev_status[SNDRV_SERIAL_MAX_OUTS];
+
+	/* per output queues, scheduled round robin into tx_buff */
+	struct snd_uart_pl011_port *tx_port[SNDRV_SERIAL_MAX_OUTS];
+	int tx_next;		/* next port to be scheduled */
+	int tx_hold;		/* port with a message half sent, or -1 */
+	int tx_quantum;
+	int enq_prev_out;	/* last port filled from rawmidi */
+	int running_status;
+	unsigned char tx_status;	/* running status on the wire */
+	unsigned long running_status_saved;
+
+	/* realtime bytes, sent ahead of tx_buff; filled like the ports */
+	struct {
+		unsigned char port;
+		unsigned char byte;
+	} rt_buff[RT_BUFF_SIZE];
+	int rt_in;
+	int rt_out;
+	unsigned long rt_bytes;
+
+	/* what the bytes leaving tx_buff are addressing */
+	int wire_port;
+	int wire_switch;	/* 0xf5 sent, port number next */
+	int wire_mb_data;	/* M/B address sent, data byte next */
+	unsigned long switch_bytes;
+	unsigned long switch_bytes_unbatched;
+
+	/* write buffer and its writing/reading position, allocated while
+	 * an output is open */
+	unsigned char *tx_buff;
+	unsigned int tx_buff_mask;
+	int buff_in_count;
+        int buff_in;
+        int buff_out;
+        int drop_on_full;
+	int throttle_tx;
+	int dynamic_throttle;
+	int adaptive_throttle;
+	u32 drain_ns[SNDRV_SERIAL_MAX_OUTS];	/* learnt time per byte */
+	int flow_control;
+	ktime_t throttle_delay;
+	ktime_t fixed_delay;	/* throttle_delay without dynamic_throttle */
+
+	/* FIFO trigger levels */
+	int fifo_mode;
+	int rx_level;		/* index into snd_uart_pl011_rx_levels */
+	int tx_level;		/* index into snd_uart_pl011_tx_levels */
+	int rx_streak;		/* RX interrupts at the full level in a row */
+	u16 ifls;
+	unsigned long mode_irqs[SNDRV_SERIAL_FIFO_MODES];
+	unsigned long mode_bytes[SNDRV_SERIAL_FIFO_MODES];
+
+	/* set from sysfs, applied once TX is quiescent */
+	int reconfig;
+	unsigned int new_speed;
+	int new_flow_control;
+
+	int timer_running;
+	u16 control_reg;
+	u16 im;			/* interrupt mask */
+	int irq_masked;		/* IMSC held at 0 by the IRQ thread */
+	int threaded_irq;
+	unsigned long irq_events;	/* SERIAL_EV_*, for the IRQ thread */
+	atomic64_t irq_stamp;	/* ns, from the lockless hard handler */
+	struct hrtimer poll_timer;
+	ktime_t poll_period;
+	u16 dmacr;		/* DMA control register */
+	struct snd_uart_pl011_dmabuf dmatx;
+	struct snd_uart_pl011_dmabuf dmarx;
+	enum {
+		TX_IDLE,
+		TX_BLOCK_RX,
+		TX_BUSY,
+	} tx_state;
+	int tx_attempts;
+	struct hrtimer buffer_timer;
+	unsigned char bytes_pending[SNDRV_SERIAL_MAX_OUTS];
+	int current_output;	/* port of the byte going out, for the delay */
+	unsigned long lasttime;	/* jiffies of the last burst */
+
+	int device;		/* rawmidi device number on the card */
+	struct snd_info_entry *proc_entry;
+
+	/* statistics, shown in the proc file */
+	unsigned long tx_bytes;
+	unsigned long rx_bytes[SNDRV_SERIAL_MAX_INS];
+	unsigned long rx_overruns;	/* RX FIFO ran full */
+	unsigned long rx_ring_overruns;	/* rawmidi input buffer full */
+	unsigned long timer_fires;
+	unsigned long cts_timeouts;
+	unsigned long irq_hist[HIST_BUCKETS];
+	unsigned long latency_hist[HIST_BUCKETS];
+	/* latency sample on its way through tx_buff */
+	int tx_mark_pending;
+	int tx_mark_valid;
+	int tx_mark_pos;
+	ktime_t tx_mark_time;
+};
+
+enum {	CUR_OUTPUT_INIT = -2,
+	CUR_OUTPUT_CHANGE = -1,
+	CUR_OUTPUT_VALID = 0
+};
+
+/* All register access goes through here, so that a register model can
+ * stand in for the hardware when the driver is built outside the kernel */
+static inline u16 snd_uart_pl011_read(struct snd_uart_pl011 *uart,
+				      unsigned int reg)
+{
+	return readw(uart->membase + reg);
+}
+
+static inline void snd_uart_pl011_write(struct snd_uart_pl011 *uart,
+					u16 val, unsigned int reg)
+{
+	writew(val, uart->membase + reg);
+}
+
+static inline unsigned char snd_uart_pl011_getc(struct snd_uart_pl011 *uart)
+{
+	return readb(uart->membase + UART01x_DR);
+}
+
+static inline void snd_uart_pl011_putc(struct snd_uart_pl011 *uart,
+				       unsigned char c)
+{
+	writeb(c, uart->membase + UART01x_DR);
+}
+
+static inline void snd_uart_pl011_stop_rx(struct snd_uart_pl011 *uart)
+{
+	snd_uart_pl011_write(uart, uart->control_reg & ~UART011_CR_RTS,
+			     UART011_CR);
+}
+
+static inline void snd_uart_pl011_start_rx(struct snd_uart_pl011 *uart)
+{
+	snd_uart_pl011_write(uart, uart->control_reg | UART011_CR_RTS,
+			     UART011_CR);
+}
+
+/* Program the interrupt mask, unless the IRQ thread has the UART
+ * quiet while it or the poll timer is servicing it */
+static inline void snd_uart_pl011_write_im(struct snd_uart_pl011 *uart)
+{
+	snd_uart_pl011_write(uart, uart->irq_masked ? 0 : uart->im,
+			     UART011_IMSC);
+}
+
+/* Pending interrupts we asked for, also while IMSC is held at 0 */
+static inline u16 snd_uart_pl011_irq_status(struct snd_uart_pl011 *uart)
+{
+	return snd_uart_pl011_read(uart, UART011_RIS) & uart->im;
+}
+
+static inline void snd_uart_pl011_hist_add(unsigned long *hist,
+					   ktime_t delta)
+{
+	s64 us = ktime_to_us(delta);
+	int bucket = us > 0 ? fls64(us) : 0;
+
+	hist[min(bucket, HIST_BUCKETS - 1)]++;
+}
+
+/* The sampled byte has reached the FIFO */
+static inline void snd_uart_pl011_tx_mark_done(struct snd_uart_pl011 *uart)
+{
+	snd_uart_pl011_hist_add(uart->latency_hist,
+				ktime_sub(ktime_get(), uart->tx_mark_time));
+	uart->tx_mark_valid = 0;
+}
+
+/* Bytes per output are counted for the dynamic and adaptive throttle */
+static inline int snd_uart_pl011_delay_tracking(struct snd_uart_pl011 *uart)
+{
+	return uart->dynamic_throttle || uart->adaptive_throttle;
+}
+
+static inline void snd_uart_pl011_reset_delay_times(struct snd_uart_pl011 *uart)
+{
+	if (!snd_uart_pl011_delay_tracking(uart)) return;
+
+	memset(uart->bytes_pending, 0, 
+			sizeof(unsigned char) * SNDRV_SERIAL_MAX_OUTS);
+}
+
+static inline void snd_uart_pl011_update_delay_time(struct snd_uart_pl011 *uart)
+{
+	if (!snd_uart_pl011_delay_tracking(uart)) return;
+
+	if (uart->tx_buff[uart->buff_out] == 0xf5) {
+		uart->current_output = CUR_OUTPUT_CHANGE;
+		return;
+	}
+
+	if (uart->current_output == CUR_OUTPUT_CHANGE) {
+		uart->current_output = uart->tx_buff[uart->buff_out] - 1;
+	}
+
+	if (uart->current_output >= CUR_OUTPUT_VALID) {
+		uart->bytes_pending[uart->current_output]++;
+	}
+}
+
+static inline void snd_uart_pl011_update_write_delay(
+		struct snd_uart_pl011 *uart)
+{
+	/* Delay based on MIDI baud rate of 31250 and maximum number of bytes
+	 * to send for any channel. A MIDI byte is 10 bits, so the delay time
+	 * per byte is (10/31250) = 320 us */
+	unsigned char i, max_bytes;
+	u64 delay, max_delay;
+
+	if (uart->adaptive_throttle) {
+		/* Wait for the slowest output to drain what it was sent */
+		max_delay = 0;
+		for (i = 0; i < SNDRV_SERIAL_MAX_OUTS; i++) {
+			delay = (u64)uart->bytes_pending[i] * uart->drain_ns[i];
+			if (delay > max_delay)
+				max_delay = delay;
+		}
+		/* Nothing may be counted per output (realtime bytes, adaptors
+		 * without part changes); never wait less than the write takes
+		 * on our own wire, or spin the timer with no delay at all */
+		delay = (u64)uart->fifo_count * uart->rx_byte_ns;
+		if (delay > max_delay)
+			max_delay = delay;
+		uart->throttle_delay = max_delay ? ns_to_ktime(max_delay) :
+						   uart->fixed_delay;
+		return;
+	}
+
+	if (uart->dynamic_throttle == 0) return;
+
+	max_bytes = 0;
+	for (i = 0; i < SNDRV_SERIAL_MAX_OUTS; i++) {
+		if (uart->bytes_pending[i] > max_bytes)
+			max_bytes = uart->bytes_pending[i];
+	}
+	uart->throttle_delay = ns_to_ktime(uart->dynamic_throttle * 
+			(max_bytes * 320 * (1000/100)));
+}
+
+/* AIMD on the outputs of the last write. CTS still held after the delay
+ * means the interface was not done, so back off by half; CTS ready
+ * straight away lets the drain time come down by a step. An output can't
+ * drain faster than our own link feeds it. */
+static void snd_uart_pl011_adapt_throttle(struct snd_uart_pl011 *uart,
+					  int held)
+{
+	u32 ns;
+	int i;
+
+	for (i = 0; i < SNDRV_SERIAL_MAX_OUTS; i++) {
+		if (!uart->bytes_pending[i])
+			continue;
+		ns = uart->drain_ns[i];
+		if (held)
+			ns = min_t(u32, ns + ns / 2, ADAPT_MAX_NS);
+		else if (ns > uart->rx_byte_ns + ADAPT_STEP_NS)
+			ns -= ADAPT_STEP_NS;
+		else
+			ns = uart->rx_byte_ns;
+		uart->drain_ns[i] = ns;
+	}
+}
+
+#ifdef CONFIG_DMA_ENGINE
+static inline int snd_uart_pl011_dma_tx_busy(struct snd_uart_pl011 *uart)
+{
+	return uart->dmatx.queued;
+}
+#else
+static inline int snd_uart_pl011_dma_tx_busy(struct snd_uart_pl011 *uart)
+{
+	return 0;
+}
+#endif
+
+static inline unsigned char snd_uart_pl011_mb_addr(int port)
+{
+	unsigned char addr_byte;
+
+#ifdef SNDRV_SERIAL_MS124W_MB_NOCOMBO
+	/* select exactly one of the four ports */
+	addr_byte = (1 << (port + 4)) | 0x08;
+#else
+	/* select any combination of the four ports */
+	addr_byte = (port << 4) | 0x08;
+	/* ...except none */
+	if (addr_byte == 0x08)
+		addr_byte = 0xf8;
+#endif
+	return addr_byte;
+}
+
+/* Follow the stream as it leaves tx_buff, so that the realtime lane
+ * knows which port the wire is addressing */
+static inline void snd_uart_pl011_wire_track(struct snd_uart_pl011 *uart,
+					     unsigned char byte)
+{
+	switch (uart->adaptor) {
+	case SNDRV_SERIAL_MS124W_MB:
+		uart->wire_mb_data = !uart->wire_mb_data;
+		break;
+	case SNDRV_SERIAL_SOUNDCANVAS:
+	case SNDRV_SERIAL_GENERIC:
+		if (uart->wire_switch) {
+			uart->wire_port = byte - 1;
+			uart->wire_switch = 0;
+		} else if (byte == 0xf5)
+			uart->wire_switch = 1;
+		break;
+	}
+}
+
+/* Can a part change go out before the next byte of tx_buff? Only ahead
+ * of a status byte or a part change, or with tx_buff empty */
+static inline int snd_uart_pl011_wire_boundary(struct snd_uart_pl011 *uart)
+{
+	unsigned char next;
+
+	if (uart->wire_switch || uart->wire_mb_data)
+		return 0;
+	if (uart->buff_in_count == 0)
+		return 1;
+	if (uart->adaptor == SNDRV_SERIAL_MS124W_MB)
+		return 1;
+
+	next = uart->tx_buff[uart->buff_out];
+	if (next == 0xf5)
+		return 1;
+	/* we have to switch back afterwards */
+	if (uart->wire_port < 0)
+		return 0;
+	return next >= 0x80 && next < 0xf8 && next != 0xf7;
+}
+
+/* The acquire on the other side's index pairs with its release, so the
+ * slots are seen filled (consumer) or done with (producer). */
+static inline int snd_uart_pl011_rt_pending(struct snd_uart_pl011 *uart)
+{
+	return CIRC_CNT(smp_load_acquire(&uart->rt_in), uart->rt_out,
+			RT_BUFF_SIZE);
+}
+
+static inline int snd_uart_pl011_rt_write(struct snd_uart_pl011 *uart,
+					  int port, unsigned char byte)
+{
+	int rt_in = uart->rt_in;
+
+	if (!CIRC_SPACE(rt_in, smp_load_acquire(&uart->rt_out), RT_BUFF_SIZE))
+		return 0;
+
+	uart->rt_buff[rt_in].port = port;
+	uart->rt_buff[rt_in].byte = byte;
+	smp_store_release(&uart->rt_in, (rt_in + 1) & RT_BUFF_MASK);
+	return 1;
+}
+
+/* Send pending realtime bytes straight to the FIFO, ahead of tx_buff.
+ * MIDI allows them anywhere in their own port's stream. Reaching another
+ * port takes a part change, which waits for a message boundary. */
+static void snd_uart_pl011_rt_output(struct snd_uart_pl011 *uart)
+{
+	unsigned char byte;
+	int port, need;
+
+	if (snd_uart_pl011_dma_tx_busy(uart))
+		return;
+
+	if (snd_uart_pl011_read(uart, UART01x_FR) & UART011_FR_TXFE)
+		uart->fifo_count = 0;
+
+	while (snd_uart_pl011_rt_pending(uart) > 0) {
+		port = uart->rt_buff[uart->rt_out].port;
+		byte = uart->rt_buff[uart->rt_out].byte;
+
+		switch (uart->adaptor) {
+		case SNDRV_SERIAL_MS124W_MB:
+			if (!snd_uart_pl011_wire_boundary(uart))
+				return;
+			need = 2;
+			break;
+		case SNDRV_SERIAL_SOUNDCANVAS:
+		case SNDRV_SERIAL_GENERIC:
+			if (port == uart->wire_port && !uart->wire_switch) {
+				need = 1;
+				break;
+			}
+			if (!snd_uart_pl011_wire_boundary(uart))
+				return;
+			need = 3;
+			if (uart->buff_in_count > 0 &&
+			    uart->tx_buff[uart->buff_out] != 0xf5)
+				need = 5;
+			break;
+		default:
+			need = 1;
+			break;
+		}
+
+		/* Leave room for the byte from tx_buff that follows */
+		if (uart->fifo_count + need >= SNDRV_SERIAL_DEFAULT_FIFO)
+			return;
+
+		if (need == 2) {
+			snd_uart_pl011_putc(uart, snd_uart_pl011_mb_addr(port));
+		} else if (need > 2) {
+			snd_uart_pl011_putc(uart, 0xf5);
+			snd_uart_pl011_putc(uart, port + 1);
+			uart->switch_bytes += 2;
+		}
+
+		snd_uart_pl011_putc(uart, byte);
+
+		if (need == 5) {
+			/* back to the port tx_buff is addressing */
+			snd_uart_pl011_putc(uart, 0xf5);
+			snd_uart_pl011_putc(uart, uart->wire_port + 1);
+			uart->switch_bytes += 2;
+		} else if (need == 3) {
+			uart->wire_port = port;
+			/* F5 cancelled running status, so the next burst
+			 * has to set its port up again */
+			if (uart->buff_in_count == 0)
+				uart->prev_out = -1;
+		}
+
+		uart->fifo_count += need;
+		uart->tx_bytes += need;
+		smp_store_release(&uart->rt_out,
+				  (uart->rt_out + 1) & RT_BUFF_MASK);
+		uart->rt_bytes++;
+	}
+}
+
+static inline void snd_uart_pl011_buffer_output(struct snd_uart_pl011 *uart)
+{
+	unsigned short buff_out;
+	unsigned char byte;
+
+	/* Realtime bytes go ahead of tx_buff */
+	if (unlikely(snd_uart_pl011_rt_pending(uart)))
+		snd_uart_pl011_rt_output(uart);
+
+	buff_out = uart->buff_out;
+	if (unlikely(uart->tx_mark_valid) && buff_out == uart->tx_mark_pos)
+		snd_uart_pl011_tx_mark_done(uart);
+	byte = uart->tx_buff[buff_out];
+	snd_uart_pl011_putc(uart, byte);
+	snd_uart_pl011_wire_track(uart, byte);
+	uart->fifo_count++;
+	uart->tx_bytes++;
+	buff_out++;
+	buff_out &= uart->tx_buff_mask;
+	uart->buff_out = buff_out;
+	uart->buff_in_count--;
+	trace_snd_serial_pl011_tx_byte(uart->mapbase, byte,
+				       uart->buff_in_count, uart->fifo_count);
+}
+
+static inline int snd_uart_pl011_buffer_can_write(struct snd_uart_pl011 *uart,
+						 int Num)
+{
+	if (uart->buff_in_count + Num <= uart->tx_buff_mask)
+		return 1;
+	else
+		return 0;
+}
+
+static inline int snd_uart_pl011_write_buffer(struct snd_uart_pl011 *uart,
+					     unsigned char byte)
+{
+	unsigned short buff_in = uart->buff_in;
+	if (uart->buff_in_count <= uart->tx_buff_mask) {
+		if (unlikely(uart->tx_mark_pending)) {
+			uart->tx_mark_pending = 0;
+			uart->tx_mark_valid = 1;
+			uart->tx_mark_pos = buff_in;
+		}
+		uart->tx_buff[buff_in] = byte;
+		buff_in++;
+		buff_in &= uart->tx_buff_mask;
+		uart->buff_in = buff_in;
+		uart->buff_in_count++;
+		return 1;
+	} else
+		return 0;
+}
+
+/* Bytes the consumer may read from a port */
+static inline int snd_uart_pl011_port_count(struct snd_uart_pl011_port *port)
+{
+	return CIRC_CNT(smp_load_acquire(&port->buff_in), port->buff_out,
+			PORT_BUFF_SIZE);
+}
+
+/* Bytes waiting in all ports */
+static int snd_uart_pl011_tx_pending(struct snd_uart_pl011 *uart)
+{
+	int i, count = 0;
+
+	for (i = 0; i < SNDRV_SERIAL_MAX_OUTS; i++)
+		if (uart->tx_port[i])
+			count += snd_uart_pl011_port_count(uart->tx_port[i]);
+	return count;
+}
+
+/* Scheduled events not yet released into their ports, and when the last
+ * of them is due */
+static int snd_uart_pl011_sched_pending(struct snd_uart_pl011 *uart,
+					ktime_t *last)
+{
+	struct snd_uart_pl011_port *port;
+	struct snd_uart_pl011_frame *frame;
+	ktime_t due;
+	int i, j, count = 0;
+
+	for (i = 0; i < SNDRV_SERIAL_MAX_OUTS; i++) {
+		port = uart->tx_port[i];
+		if (!port)
+			continue;
+		for (j = 0; j < port->sched_count; j++) {
+			frame = &port->sched[(port->sched_out + j) %
+					     SCHED_QUEUE_SIZE];
+			due = ktime_set(frame->tv_sec, frame->tv_nsec);
+			if (!count || ktime_after(due, *last))
+				*last = due;
+			count++;
+		}
+	}
+	return count;
+}
+
+static inline int snd_uart_pl011_port_write(struct snd_uart_pl011 *uart,
+					    struct snd_uart_pl011_port *port,
+					    unsigned char byte)
+{
+	int buff_in = port->buff_in;
+
+	if (!CIRC_SPACE(buff_in, smp_load_acquire(&port->buff_out),
+			PORT_BUFF_SIZE))
+		return 0;
+
+	port->buff[buff_in] = byte;
+	smp_store_release(&port->buff_in, (buff_in + 1) & PORT_BUFF_MASK);
+	return 1;
+}
+
+static inline unsigned char snd_uart_pl011_port_read(
+		struct snd_uart_pl011 *uart, struct snd_uart_pl011_port *port)
+{
+	unsigned char byte = port->buff[port->buff_out];
+
+	/* Follow the sampled byte into tx_buff, one sample at a time */
+	if (unlikely(port->buff_out == smp_load_acquire(&port->mark_pos))) {
+		if (!uart->tx_mark_pending && !uart->tx_mark_valid) {
+			uart->tx_mark_pending = 1;
+			uart->tx_mark_time = port->mark_time;
+		}
+		smp_store_release(&port->mark_pos, -1);
+	}
+
+	smp_store_release(&port->buff_out,
+			  (port->buff_out + 1) & PORT_BUFF_MASK);
+	port->tx_bytes++;
+	return byte;
+}
+
+/* Queue the events rawmidi has for this substream. Each one is a whole
+ * frame; a frame we can't make sense of is skipped. */
+static void snd_uart_pl011_sched_fill(struct snd_uart_pl011 *uart,
+				      struct snd_rawmidi_substream *substream)
+{
+	struct snd_uart_pl011_port *port = uart->tx_port[substream->number];
+	struct snd_uart_pl011_frame *frame;
+
+	while (port->sched_count < SCHED_QUEUE_SIZE) {
+		frame = &port->sched[port->sched_in];
+		if (snd_rawmidi_transmit_peek(substream, (unsigned char *)frame,
+					      sizeof(*frame)) < sizeof(*frame))
+			break;
+		snd_rawmidi_transmit_ack(substream, sizeof(*frame));
+		if (frame->frame_type || !frame->length ||
+		    frame->length > FRAME_DATA)
+			continue;
+		port->sched_in = (port->sched_in + 1) % SCHED_QUEUE_SIZE;
+		port->sched_count++;
+	}
+}
+
+/* Move the events that are due into their port queues, and arm
+ * sched_timer for the earliest one still waiting. Events of a port go
+ * out in the order they were written. */
+static void snd_uart_pl011_sched_release(struct snd_uart_pl011 *uart)
+{
+	struct snd_uart_pl011_port *port;
+	struct snd_uart_pl011_frame *frame;
+	ktime_t now = ktime_get();
+	ktime_t due, next = now;
+	int i, j, waiting = 0;
+
+	for (i = 0; i < SNDRV_SERIAL_MAX_OUTS; i++) {
+		port = uart->tx_port[i];
+		if (!port)
+			continue;
+		while (port->sched_count) {
+			frame = &port->sched[port->sched_out];
+			due = ktime_set(frame->tv_sec, frame->tv_nsec);
+			if (ktime_after(due, now)) {
+				if (!waiting || ktime_before(due, next))
+					next = due;
+				waiting = 1;
+				break;
+			}
+			/* No room, the scheduler calls us back as it
+			 * drains the port */
+			if (CIRC_SPACE(port->buff_in,
+				       smp_load_acquire(&port->buff_out),
+				       PORT_BUFF_SIZE) < frame->length)
+				break;
+			for (j = 0; j < frame->length; j++)
+				snd_uart_pl011_port_write(uart, port,
+							  frame->data[j]);
+			port->sched_out = (port->sched_out + 1) %
+					  SCHED_QUEUE_SIZE;
+			port->sched_count--;
+			uart->sched_events++;
+		}
+	}
+
+	if (waiting)
+		hrtimer_start(&uart->sched_timer, next, HRTIMER_MODE_ABS);
+}
+
+#define REP_BYTE(b)	(~0UL / 0xff * (b))
+
+/* Index of the first realtime byte (0xf8-0xff) in buf, or len if there
+ * is none. A byte is realtime when (byte & 0xf8) ^ 0xf8 is zero, so
+ * aligned words are checked with the usual has-zero-byte test. */
+static int snd_uart_pl011_find_rt(const unsigned char *buf, int len)
+{
+	const int wsize = sizeof(unsigned long);
+	unsigned long w;
+	int i = 0;
+
+	while (i < len && ((unsigned long)(buf + i) & (wsize - 1))) {
+		if (buf[i] >= 0xf8)
+			return i;
+		i++;
+	}
+	for (; len - i >= wsize; i += wsize) {
+		w = (*(const unsigned long *)(buf + i) & REP_BYTE(0xf8)) ^
+		    REP_BYTE(0xf8);
+		if ((w - REP_BYTE(0x01)) & ~w & REP_BYTE(0x80))
+			break;
+	}
+	for (; i < len; i++)
+		if (buf[i] >= 0xf8)
+			return i;
+	return len;
+}
+
+/* Peek rawmidi straight into the free span of the port queue and
+ * publish it with one ack. A realtime byte ends the span so that it can
+ * take the priority lane. Returns the bytes taken from rawmidi, 0 when
+ * there is nothing to send or no room. */
+static int snd_uart_pl011_port_bulk(struct snd_uart_pl011 *uart,
+				    struct snd_rawmidi_substream *substream,
+				    struct snd_uart_pl011_port *port,
+				    int *queued)
+{
+	int buff_in = port->buff_in;
+	unsigned char *span = &port->buff[buff_in];
+	int len, n, kept;
+
+	len = CIRC_SPACE_TO_END(buff_in, smp_load_acquire(&port->buff_out),
+				PORT_BUFF_SIZE);
+	if (!len)
+		return 0;
+	len = snd_rawmidi_transmit_peek(substream, span, len);
+	if (len <= 0)
+		return 0;
+
+	n = kept = snd_uart_pl011_find_rt(span, len);
+	if (n < len) {
+		/* the realtime byte stays queued if its lane is full */
+		if (!snd_uart_pl011_rt_write(uart, substream->number, span[n]))
+			kept++;
+		len = n + 1;
+	}
+
+	smp_store_release(&port->buff_in, (buff_in + kept) & PORT_BUFF_MASK);
+	*queued = kept;
+	snd_rawmidi_transmit_ack(substream, len);
+	return len;
+}
+
+/* Move what rawmidi has for this substream into its port queue.
+ * This is the producer side and runs under fill_lock only; the
+ * consumer never waits for it. */
+static void snd_uart_pl011_port_fill(struct snd_uart_pl011 *uart,
+				     struct snd_rawmidi_substream *substream)
+{
+	struct snd_uart_pl011_port *port = uart->tx_port[substream->number];
+	unsigned char midi_byte;
+	int count = 0, marked = 0;
+	int queued;
+
+	if (uart->tx_sched) {
+		snd_uart_pl011_sched_fill(uart, substream);
+		snd_uart_pl011_sched_release(uart);
+		return;
+	}
+
+	while (snd_rawmidi_transmit_peek(substream, &midi_byte, 1) == 1) {
+		/* Sample the latency of the first byte, unless the last
+		 * sample is still on its way */
+		if (!marked && smp_load_acquire(&port->mark_pos) < 0) {
+			port->mark_time = ktime_get();
+			smp_store_release(&port->mark_pos, port->buff_in);
+		}
+		marked = 1;
+
+		if (snd_uart_pl011_port_bulk(uart, substream, port, &queued)) {
+			count += queued;
+			continue;
+		}
+
+		/* Queue full */
+		if (midi_byte >= 0xf8 &&
+		    snd_uart_pl011_rt_write(uart, substream->number, midi_byte))
+			/* realtime takes the priority lane */;
+		else if (!uart->drop_on_full) {
+			port->queue_full++;
+			break;
+		} else {
+			port->drops++;
+			if (printk_ratelimit())
+				snd_printk(KERN_WARNING
+					   "%s: Buffer overrun on device at 0x%lx\n",
+					   uart->rmidi->name, uart->mapbase);
+		}
+		snd_rawmidi_transmit_ack(substream, 1);
+	}
+
+	/* Writing straight into tx_buff would have needed a part change
+	 * here, count it to show what bursting saves */
+	if (count && (uart->adaptor == SNDRV_SERIAL_SOUNDCANVAS ||
+		      uart->adaptor == SNDRV_SERIAL_GENERIC) &&
+	    uart->enq_prev_out != substream->number) {
+		uart->enq_prev_out = substream->number;
+		uart->switch_bytes_unbatched += 2;
+	}
+}
+
+#define MIDI_LEN_SYSEX	0xff	/* data up to 0xf7 */
+#define MIDI_LEN_RT	0xfe	/* one byte, anywhere */
+
+/* Data bytes after each status byte, indexed by status & 0x7f */
+static const unsigned char snd_uart_pl011_midi_len[128] = {
+	[0x00 ... 0x3f] = 2,		/* note off/on, poly AT, control */
+	[0x40 ... 0x5f] = 1,		/* program change, channel AT */
+	[0x60 ... 0x6f] = 2,		/* pitch bend */
+	[0x70] = MIDI_LEN_SYSEX,
+	[0x71] = 1,			/* MTC quarter frame */
+	[0x72] = 2,			/* song position */
+	[0x73] = 1,			/* song select */
+	[0x74 ... 0x77] = 0,		/* undefined, tune request, EOX */
+	[0x78 ... 0x7f] = MIDI_LEN_RT,
+};
+
+/* Follow the MIDI grammar of a port's stream as it is sent. Returns 1
+ * when the byte leaves the port at a message boundary, where another
+ * port may take the wire. port->status must not have been updated for
+ * this byte yet. */
+static inline int snd_uart_pl011_tx_parse(struct snd_uart_pl011_port *port,
+					  unsigned char byte)
+{
+	unsigned char len = snd_uart_pl011_midi_len[byte & 0x7f];
+
+	if (byte & 0x80) {
+		/* realtime bytes can go anywhere, a status byte ends any
+		 * SysEx */
+		if (len != MIDI_LEN_RT) {
+			port->tx_sysex = len == MIDI_LEN_SYSEX;
+			port->tx_left = port->tx_sysex ? 0 : len;
+		}
+	} else if (port->tx_left) {
+		port->tx_left--;
+	} else if (port->status) {
+		/* running status, a new message */
+		port->tx_left = snd_uart_pl011_midi_len[port->status & 0x7f] - 1;
+	}
+	return !port->tx_left && !port->tx_sysex;
+}
+
+/* Running status encoder, returns 0 if the byte can be left out.
+ * Status is tracked for the port and for the wire; only the wire status
+ * is cleared by a part change. */
+static inline int snd_uart_pl011_tx_status(struct snd_uart_pl011 *uart,
+					   struct snd_uart_pl011_port *port,
+					   unsigned char byte)
+{
+	/* data and realtime bytes leave running status alone */
+	if (byte < 0x80 || byte >= 0xf8)
+		return 1;
+
+	/* SysEx and system common cancel it */
+	if (byte >= 0xf0) {
+		port->status = 0;
+		uart->tx_status = 0;
+		return 1;
+	}
+
+	port->status = byte;
+	if (uart->running_status && byte == uart->tx_status) {
+		uart->running_status_saved++;
+		return 0;
+	}
+	uart->tx_status = byte;
+	return 1;
+}
+
+/* Move queued output from the ports into tx_buff. Ports are served round
+ * robin with bursts of whole messages, ending at the first boundary after
+ * tx_quantum bytes, so a part change is paid once per burst and one busy
+ * port cannot hold up the others. A message cut short by a full tx_buff
+ * or an empty port keeps the wire until it is finished: a part change
+ * inside it would end a SysEx, or lose the data bytes already sent.
+ * tx_buff is only topped up to a burst, the backlog stays in the ports. */
+static void snd_uart_pl011_tx_schedule(struct snd_uart_pl011 *uart)
+{
+	struct snd_uart_pl011_port *port;
+	unsigned char midi_byte, addr_byte;
+	int i, n, burst, sent, boundary, count = 0;
+
+	/* no output open */
+	if (!uart->tx_buff)
+		return;
+
+	while (uart->buff_in_count < uart->tx_quantum) {
+		if (uart->tx_hold >= 0) {
+			n = uart->tx_hold;
+			port = uart->tx_port[n];
+			count = port ? snd_uart_pl011_port_count(port) : 0;
+			if (!count) {
+				/* the rest is still to come */
+				if (uart->midi_output[n])
+					break;
+				/* closed in the middle, give the wire up */
+				if (port)
+					port->tx_left = port->tx_sysex = 0;
+				uart->tx_hold = -1;
+				continue;
+			}
+		} else {
+			for (i = 0; i < SNDRV_SERIAL_MAX_OUTS; i++) {
+				n = (uart->tx_next + i) % SNDRV_SERIAL_MAX_OUTS;
+				if (uart->tx_port[n] &&
+				    (count = snd_uart_pl011_port_count(uart->tx_port[n])))
+					break;
+			}
+			if (i == SNDRV_SERIAL_MAX_OUTS)
+				break;
+			port = uart->tx_port[n];
+			uart->tx_next = (n + 1) % SNDRV_SERIAL_MAX_OUTS;
+		}
+
+		if (uart->adaptor == SNDRV_SERIAL_MS124W_MB) {
+			addr_byte = snd_uart_pl011_mb_addr(n);
+			burst = min(count, uart->tx_quantum);
+			/* in this mode every byte is addressed */
+			while (burst-- && snd_uart_pl011_buffer_can_write(uart, 2)) {
+				snd_uart_pl011_write_buffer(uart, addr_byte);
+				snd_uart_pl011_write_buffer(uart,
+					snd_uart_pl011_port_read(uart, port));
+			}
+		} else {
+			/* Only at a message boundary: a device plugged in
+			 * since then missed the status */
+			if (uart->tx_hold < 0 &&
+			    time_after(jiffies, uart->lasttime + 3*HZ))
+				uart->tx_status = 0;
+
+			/* Also send F5 after 3 seconds with no data
+			 * to handle device disconnect */
+			if ((uart->adaptor == SNDRV_SERIAL_SOUNDCANVAS ||
+			     uart->adaptor == SNDRV_SERIAL_GENERIC) &&
+			    uart->tx_hold < 0 &&
+			    (uart->prev_out != n ||
+			     time_after(jiffies, uart->lasttime + 3*HZ))) {
+				if (!snd_uart_pl011_buffer_can_write(uart, 3))
+					break;
+
+				/* Roland Soundcanvas part selection */
+				uart->prev_out = n;
+				/* change part */
+				snd_uart_pl011_write_buffer(uart, 0xf5);
+				/* data */
+				snd_uart_pl011_write_buffer(uart, n + 1);
+				uart->switch_bytes += 2;
+				/* F5 is system common, the interface has
+				 * forgotten the running status */
+				uart->tx_status = 0;
+				/* If the burst starts with a data byte,
+				 * send the previous status byte */
+				if (port->buff[port->buff_out] < 0x80) {
+					if (uart->adaptor == SNDRV_SERIAL_SOUNDCANVAS)
+						uart->tx_status = uart->prev_status[n];
+					else if (uart->running_status)
+						/* we may have left it out */
+						uart->tx_status = port->status;
+					if (uart->tx_status)
+						snd_uart_pl011_write_buffer(uart,
+							uart->tx_status);
+				}
+			}
+
+			sent = 0;
+			while (count-- && snd_uart_pl011_buffer_can_write(uart, 1)) {
+				midi_byte = snd_uart_pl011_port_read(uart, port);
+				if (midi_byte >= 0x80 && midi_byte < 0xf0)
+					uart->prev_status[n] = midi_byte;
+				boundary = snd_uart_pl011_tx_parse(port, midi_byte);
+				if (snd_uart_pl011_tx_status(uart, port, midi_byte))
+					snd_uart_pl011_write_buffer(uart, midi_byte);
+				if (++sent >= uart->tx_quantum && boundary)
+					break;
+			}
+			uart->tx_hold = port->tx_left || port->tx_sysex ? n : -1;
+			uart->lasttime = jiffies;
+		}
+
+		/* Have the port topped up again if rawmidi has more for it */
+		if ((port->triggered || port->sched_count) &&
+		    snd_uart_pl011_port_count(port) < PORT_BUFF_SIZE / 2)
+			tasklet_schedule(&uart->fill_tasklet);
+	}
+}
+
+/* Bytes ready for the FIFO, scheduling the next burst once tx_buff is dry */
+static inline int snd_uart_pl011_tx_ready(struct snd_uart_pl011 *uart)
+{
+	if (uart->buff_in_count == 0)
+		snd_uart_pl011_tx_schedule(uart);
+	return uart->buff_in_count > 0;
+}
+
+static inline int snd_uart_pl011_write_fifo_timer(struct snd_uart_pl011 * uart)
+{
+	/* Only the first look at CTS after the delay tells us whether
+	 * the delay was long enough */
+	int first = uart->adaptive_throttle && uart->flow_control &&
+		    uart->tx_attempts == TIMER_ATTEMPTS_LIMIT;
+
+	/* Check CTS - FIFO is empty */
+	if (!uart->flow_control ||
+			snd_uart_pl011_read(uart, UART01x_FR) & UART01x_FR_CTS) {
+		if (first)
+			snd_uart_pl011_adapt_throttle(uart, 0);
+		snd_uart_pl011_reset_delay_times(uart);
+		snd_uart_pl011_rt_output(uart);
+		while (uart->fifo_count < uart->fifo_limit
+			&& snd_uart_pl011_tx_ready(uart)) {
+			snd_uart_pl011_buffer_output(uart);
+			snd_uart_pl011_update_delay_time(uart);
+		}
+		snd_uart_pl011_update_write_delay(uart);
+	
+		uart->tx_state = TX_BUSY;
+		if (unlikely(uart->draining))
+			wake_up(&uart->drain_wait);
+		return 1;
+	}
+	if (first)
+		snd_uart_pl011_adapt_throttle(uart, 1);
+	return 0;
+}
+
+static inline void snd_uart_pl011_start_timer(struct snd_uart_pl011 *uart)
+{
+        if (!uart->timer_running) {
+		if (uart->flow_control) {
+			snd_uart_pl011_stop_rx(uart);
+			uart->tx_state = TX_BLOCK_RX;
+			uart->tx_attempts = TIMER_ATTEMPTS_LIMIT;
+		} else {
+			snd_uart_pl011_write_fifo_timer(uart);
+		}
+		hrtimer_start(&uart->buffer_timer, uart->throttle_delay,
+				HRTIMER_MODE_REL);
+		uart->timer_running = 1;
+        }
+}
+
+static inline void snd_uart_pl011_del_timer(struct snd_uart_pl011 *uart)
+{
+        hrtimer_cancel(&uart->buffer_timer);
+        uart->timer_running = 0;
+	clear_bit(SERIAL_EV_THROTTLE, &uart->irq_events);
+}
+
+/* A partial frame would misalign every frame after it, so a frame
+ * only goes in whole. We are the only producer and the reader only
+ * makes room, so the room seen here is there for the receive. */
+static void snd_uart_pl011_receive_frame(struct snd_uart_pl011 *uart,
+				struct snd_rawmidi_substream *substream,
+				struct snd_uart_pl011_frame *frame)
+{
+	struct snd_rawmidi_runtime *runtime = substream->runtime;
+
+	if (READ_ONCE(runtime->buffer_size) - READ_ONCE(runtime->avail) <
+	    sizeof(*frame)) {
+		uart->rx_frames_dropped++;
+		return;
+	}
+	snd_rawmidi_receive(substream, (unsigned char *)frame, sizeof(*frame));
+}
+
+/* Pack the staged bytes into frames. Every message starts a frame, so
+ * each one carries the arrival time of its first byte. */
+static void snd_uart_pl011_flush_frames(struct snd_uart_pl011 *uart,
+				struct snd_rawmidi_substream *substream,
+				int count)
+{
+	struct snd_uart_pl011_frame frame;
+	struct timespec64 ts;
+	unsigned char c;
+	int i;
+
+	frame.length = 0;
+	for (i = 0; i < count; i++) {
+		c = uart->rx_buff[i];
+		if (frame.length == FRAME_DATA ||
+		    (frame.length && uart->rx_start[i])) {
+			snd_uart_pl011_receive_frame(uart, substream, &frame);
+			frame.length = 0;
+		}
+		if (frame.length == 0) {
+			memset(&frame, 0, sizeof(frame));
+			ts = ktime_to_timespec64(uart->rx_stamp[i]);
+			frame.tv_sec = ts.tv_sec;
+			frame.tv_nsec = ts.tv_nsec;
+		}
+		frame.data[frame.length++] = c;
+	}
+	if (frame.length)
+		snd_uart_pl011_receive_frame(uart, substream, &frame);
+}
+
+/* Hand the whole messages staged for this substream to the rawmidi
+ * layer in a single call, rather than taking the runtime lock once per
+ * byte. A message still coming in is kept back, so that a reader is not
+ * woken for half of it, unless all is set. */
+static void snd_uart_pl011_flush_input(struct snd_uart_pl011 *uart,
+				       int substream, int all)
+{
+	struct snd_rawmidi_substream *input = uart->midi_input[substream];
+	struct snd_rawmidi_substream *tstamp = uart->midi_tstamp[substream];
+	int count = all ? uart->rx_count : uart->rx_done;
+
+	if (count == 0) return;
+
+	if ((uart->filemode & SERIAL_MODE_INPUT_OPEN) && input &&
+	    snd_rawmidi_receive(input, uart->rx_buff, count) < count)
+		uart->rx_ring_overruns++;
+	/* the same messages in frames, for a reader of the rx_tstamp
+	 * device */
+	if (uart->rx_tstamp && tstamp)
+		snd_uart_pl011_flush_frames(uart, tstamp, count);
+
+	/* move the partial message to the front */
+	uart->rx_count -= count;
+	memmove(uart->rx_buff, uart->rx_buff + count, uart->rx_count);
+	memmove(uart->rx_start, uart->rx_start + count, uart->rx_count);
+	if (uart->rx_tstamp)
+		memmove(uart->rx_stamp, uart->rx_stamp + count,
+			uart->rx_count * sizeof(ktime_t));
+	uart->rx_done = 0;
+}
+
+/* Add a byte to the staging buffer at pos, which is the end or, for a
+ * realtime byte, the end of the last whole message */
+static void snd_uart_pl011_stage_input(struct snd_uart_pl011 *uart,
+				       int substream, unsigned char c,
+				       int start, int pos)
+{
+	int tail;
+
+	if (uart->rx_count == RX_BUFF_SIZE) {
+		snd_uart_pl011_flush_input(uart, substream, 1);
+		pos = 0;
+	}
+
+	tail = uart->rx_count - pos;
+	if (tail) {
+		memmove(uart->rx_buff + pos + 1, uart->rx_buff + pos, tail);
+		memmove(uart->rx_start + pos + 1, uart->rx_start + pos, tail);
+		if (uart->rx_tstamp)
+			memmove(uart->rx_stamp + pos + 1, uart->rx_stamp + pos,
+				tail * sizeof(ktime_t));
+	}
+	if (uart->rx_tstamp)
+		uart->rx_stamp[pos] = uart->rx_time;
+	uart->rx_buff[pos] = c;
+	uart->rx_start[pos] = start;
+	uart->rx_count++;
+	uart->rx_bytes[substream]++;
+}
+
+/* Route one received byte to the current input substream, following
+ * the MIDI grammar of that input so that only whole messages are
+ * delivered. Realtime bytes are delivered ahead of a message still
+ * coming in, and may sit inside a part change. */
+static void snd_uart_pl011_receive_char(struct snd_uart_pl011 *uart,
+					unsigned char c)
+{
+	struct snd_uart_pl011_rx_parser *p;
+	unsigned char len = snd_uart_pl011_midi_len[c & 0x7f];
+	int in = uart->prev_in;
+
+	if ((c & 0x80) && len == MIDI_LEN_RT) {
+		snd_uart_pl011_stage_input(uart, in, c, 1, uart->rx_done);
+		uart->rx_done++;
+		return;
+	}
+
+	/* handle stream switch */
+	if (uart->adaptor == SNDRV_SERIAL_GENERIC) {
+		if (c == 0xf5) {
+			/* deliver the run for the previous stream */
+			snd_uart_pl011_flush_input(uart, in, 1);
+			uart->rx_switch = 1;
+			return;
+		}
+		if (uart->rx_switch) {
+			uart->rx_switch = 0;
+			if (!(c & 0x80)) {
+				/* realtime bytes that came in between */
+				snd_uart_pl011_flush_input(uart, in, 1);
+				if (c <= SNDRV_SERIAL_MAX_INS && c > 0)
+					uart->prev_in = c - 1;
+				return;
+			}
+		}
+	}
+
+	p = &uart->rx_parse[in];
+	if (c & 0x80) {
+		/* a status byte ends any SysEx, and system common
+		 * messages cancel running status */
+		p->sysex = len == MIDI_LEN_SYSEX;
+		p->status = c < 0xf0 ? c : 0;
+		p->left = p->sysex ? 0 : len;
+		snd_uart_pl011_stage_input(uart, in, c, 1, uart->rx_count);
+	} else if (p->left) {
+		snd_uart_pl011_stage_input(uart, in, c, 0, uart->rx_count);
+		p->left--;
+	} else if (p->status) {
+		/* running status, a new message */
+		snd_uart_pl011_stage_input(uart, in, c, 1, uart->rx_count);
+		p->left = snd_uart_pl011_midi_len[p->status & 0x7f] - 1;
+	} else {
+		/* SysEx data goes out as it comes, so do stray bytes */
+		snd_uart_pl011_stage_input(uart, in, c, !p->sysex,
+					   uart->rx_count);
+	}
+	if (!p->left)
+		uart->rx_done = uart->rx_count;
+}
+
+/* The RX FIFO ran full, bytes may have been lost */
+static void snd_uart_pl011_rx_overrun(struct snd_uart_pl011 *uart)
+{
+	uart->rx_overruns++;
+	if (printk_ratelimit())
+		snd_printk(KERN_WARNING "%s: Overrun on device at 0x%lx\n",
+			   uart->rmidi->name, uart->mapbase);
+}
+
+/* Receive a run of bytes whose last one arrived at 'last'. The ones
+ * before it came in a character time apart on the wire. */
+static void snd_uart_pl011_receive_run(struct snd_uart_pl011 *uart,
+				       const unsigned char *data, int count,
+				       ktime_t last)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (uart->rx_tstamp)
+			uart->rx_time = ktime_sub_ns(last,
+				(u64)(count - 1 - i) * uart->rx_byte_ns);
+		snd_uart_pl011_receive_char(uart, data[i]);
+	}
+}
+
+/* Time of the interrupt being serviced, or now when polling */
+static inline ktime_t snd_uart_pl011_rx_now(struct snd_uart_pl011 *uart)
+{
+	if (uart->irq_stamped) {
+		uart->irq_stamped = 0;
+		return uart->irq_time;
+	}
+	return ktime_get();
+}
+
+/* Timestamped RX reads the FIFO out before receiving it, since the
+ * arrival times are worked back from the newest byte. Returns the
+ * number of bytes read. */
+static int snd_uart_pl011_rx_fifo_tstamp(struct snd_uart_pl011 *uart,
+					 int rx_timeout)
+{
+	unsigned char fifo[RX_BUFF_SIZE];
+	ktime_t last;
+	int count = 0;
+
+	while (count < RX_BUFF_SIZE &&
+	       !(snd_uart_pl011_read(uart, UART01x_FR) & UART01x_FR_RXFE))
+		fifo[count++] = snd_uart_pl011_getc(uart);
+	if (!count)
+		return 0;
+
+	last = snd_uart_pl011_rx_now(uart);
+	/* The RX timeout fires 32 bit times after the last byte */
+	if (rx_timeout)
+		last = ktime_sub_ns(last, (u64)uart->rx_byte_ns * 32 / 10);
+	snd_uart_pl011_receive_run(uart, fifo, count, last);
+	return count;
+}
+
+#ifdef CONFIG_DMA_ENGINE
+/* DMA support, modelled on the amba-pl011 tty driver. Both directions
+ * bounce through a coherent buffer; TX copies a contiguous run out of
+ * tx_buff, RX is flushed on completion or on the RX timeout interrupt.
+ * All of this is called with open_lock held. */
+static int snd_uart_pl011_dma_rx_start(struct snd_uart_pl011 *uart);
+
+static void snd_uart_pl011_dma_rx_chars(struct snd_uart_pl011 *uart,
+					unsigned int pending)
+{
+	snd_uart_pl011_receive_run(uart, uart->dmarx.buf, pending,
+				   snd_uart_pl011_rx_now(uart));
+	snd_uart_pl011_flush_input(uart, uart->prev_in, 0);
+}
+
+/* Fall back to interrupt driven RX for good */
+static void snd_uart_pl011_dma_rx_disable(struct snd_uart_pl011 *uart)
+{
+	uart->dmacr &= ~UART011_RXDMAE;
+	snd_uart_pl011_write(uart, uart->dmacr, UART011_DMACR);
+	uart->im |= UART011_RXIM;
+	snd_uart_pl011_write_im(uart);
+	uart->dmarx.queued = 0;
+}
+
+static void snd_uart_pl011_dma_rx_callback(void *data)
+{
+	struct snd_uart_pl011 *uart = data;
+	struct snd_uart_pl011_dmabuf *dmarx = &uart->dmarx;
+	unsigned long flags;
+
+	spin_lock_irqsave(&uart->open_lock, flags);
+
+	/* The RX timeout path may already have collected and restarted
+	 * this transfer */
+	if (!dmarx->queued || dmaengine_tx_status(dmarx->chan, dmarx->cookie,
+						 NULL) != DMA_COMPLETE) {
+		spin_unlock_irqrestore(&uart->open_lock, flags);
+		return;
+	}
+
+	dmarx->queued = 0;
+	snd_uart_pl011_dma_rx_chars(uart, DMA_BUFF_SIZE);
+	if (snd_uart_pl011_dma_rx_start(uart))
+		snd_uart_pl011_dma_rx_disable(uart);
+
+	spin_unlock_irqrestore(&uart->open_lock, flags);
+}
+
+static int snd_uart_pl011_dma_rx_start(struct snd_uart_pl011 *uart)
+{
+	struct snd_uart_pl011_dmabuf *dmarx = &uart->dmarx;
+	struct dma_async_tx_descriptor *desc;
+
+	desc = dmaengine_prep_slave_single(dmarx->chan, dmarx->dma,
+					   DMA_BUFF_SIZE, DMA_DEV_TO_MEM,
+					   DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+	if (!desc)
+		return -EBUSY;
+
+	desc->callback = snd_uart_pl011_dma_rx_callback;
+	desc->callback_param = uart;
+	dmarx->cookie = dmaengine_submit(desc);
+	dma_async_issue_pending(dmarx->chan);
+	dmarx->queued = 1;
+
+	uart->dmacr |= UART011_RXDMAE;
+	snd_uart_pl011_write(uart, uart->dmacr, UART011_DMACR);
+	return 0;
+}
+
+/* RX timeout: stop the transfer, deliver what arrived and restart.
+ * Anything still in the FIFO is picked up by the read loop. */
+static void snd_uart_pl011_dma_rx_flush(struct snd_uart_pl011 *uart)
+{
+	struct snd_uart_pl011_dmabuf *dmarx = &uart->dmarx;
+	struct dma_tx_state state;
+
+	if (!dmarx->queued)
+		return;
+
+	dmaengine_pause(dmarx->chan);
+	dmaengine_tx_status(dmarx->chan, dmarx->cookie, &state);
+
+	/* Incoming data waits in the FIFO while we sort this out */
+	uart->dmacr &= ~UART011_RXDMAE;
+	snd_uart_pl011_write(uart, uart->dmacr, UART011_DMACR);
+	dmaengine_terminate_all(dmarx->chan);
+	dmarx->queued = 0;
+
+	snd_uart_pl011_dma_rx_chars(uart, DMA_BUFF_SIZE - state.residue);
+	if (snd_uart_pl011_dma_rx_start(uart))
+		snd_uart_pl011_dma_rx_disable(uart);
+}
+
+static int snd_uart_pl011_dma_tx_start(struct snd_uart_pl011 *uart);
+
+static void snd_uart_pl011_dma_tx_callback(void *data)
+{
+	struct snd_uart_pl011 *uart = data;
+	struct snd_uart_pl011_dmabuf *dmatx = &uart->dmatx;
+	unsigned long flags;
+
+	spin_lock_irqsave(&uart->open_lock, flags);
+
+	if (dmatx->queued) {
+		uart->buff_out = (uart->buff_out + dmatx->len) &
+				 uart->tx_buff_mask;
+		uart->buff_in_count -= dmatx->len;
+		dmatx->queued = 0;
+
+		/* The tail of the transfer is still in the FIFO */
+		uart->fifo_count = uart->fifo_limit;
+		uart->dmacr &= ~UART011_TXDMAE;
+		snd_uart_pl011_write(uart, uart->dmacr, UART011_DMACR);
+	}
+
+	if (!snd_uart_pl011_dma_tx_start(uart)) {
+		/* Let the TX interrupt tell us when the FIFO drains */
+		uart->im |= UART011_TXIM;
+		snd_uart_pl011_write_im(uart);
+	}
+
+	if (unlikely(uart->draining))
+		wake_up(&uart->drain_wait);
+
+	spin_unlock_irqrestore(&uart->open_lock, flags);
+}
+
+/* Returns 1 while a TX transfer owns the FIFO */
+static int snd_uart_pl011_dma_tx_start(struct snd_uart_pl011 *uart)
+{
+	struct snd_uart_pl011_dmabuf *dmatx = &uart->dmatx;
+	struct dma_async_tx_descriptor *desc;
+	unsigned int count, i;
+
+	/* Only once snd_uart_pl011_dma_startup has enabled DMA */
+	if (!dmatx->chan || !uart->dmacr)
+		return 0;
+	if (dmatx->queued)
+		return 1;
+
+	/* Realtime bytes first; if they have to wait for FIFO space or a
+	 * boundary, let the interrupt driven path take it from here */
+	snd_uart_pl011_rt_output(uart);
+	if (snd_uart_pl011_rt_pending(uart) > 0)
+		return 0;
+
+	if (!snd_uart_pl011_tx_ready(uart))
+		return 0;
+
+	count = min_t(int, uart->buff_in_count,
+		      uart->tx_buff_mask + 1 - uart->buff_out);
+	count = min(count, (unsigned int)DMA_BUFF_SIZE);
+	memcpy(dmatx->buf, uart->tx_buff + uart->buff_out, count);
+	for (i = 0; i < count; i++)
+		snd_uart_pl011_wire_track(uart, dmatx->buf[i]);
+
+	desc = dmaengine_prep_slave_single(dmatx->chan, dmatx->dma, count,
+					   DMA_MEM_TO_DEV,
+					   DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+	if (!desc)
+		/* No descriptor - the write loop will handle it */
+		return 0;
+
+	desc->callback = snd_uart_pl011_dma_tx_callback;
+	desc->callback_param = uart;
+	dmatx->cookie = dmaengine_submit(desc);
+	dma_async_issue_pending(dmatx->chan);
+	dmatx->len = count;
+	uart->tx_bytes += count;
+	if (uart->tx_mark_valid &&
+	    (unsigned int)(uart->tx_mark_pos - uart->buff_out) < count)
+		snd_uart_pl011_tx_mark_done(uart);
+	dmatx->queued = 1;
+
+	/* The DMA engine keeps the FIFO topped up from here on */
+	uart->im &= ~UART011_TXIM;
+	snd_uart_pl011_write_im(uart);
+	uart->dmacr |= UART011_TXDMAE;
+	snd_uart_pl011_write(uart, uart->dmacr, UART011_DMACR);
+	return 1;
+}
+
+/* The last output has closed while input goes on. Stop TX DMA before
+ * the ring goes, so that the transfer is not accounted against the next
+ * one; returns 1 if dma_tx_sync must be called once unlocked. */
+static int snd_uart_pl011_dma_tx_stop(struct snd_uart_pl011 *uart)
+{
+	if (!uart->dmatx.chan)
+		return 0;
+
+	uart->dmacr &= ~UART011_TXDMAE;
+	snd_uart_pl011_write(uart, uart->dmacr, UART011_DMACR);
+	dmaengine_terminate_async(uart->dmatx.chan);
+	uart->dmatx.queued = 0;
+	uart->dmatx.len = 0;
+	return 1;
+}
+
+static void snd_uart_pl011_dma_tx_sync(struct snd_uart_pl011 *uart)
+{
+	dmaengine_synchronize(uart->dmatx.chan);
+}
+
+static void snd_uart_pl011_dma_startup(struct snd_uart_pl011 *uart)
+{
+	uart->dmacr = 0;
+	if (!uart->dmarx.chan && !uart->dmatx.chan)
+		return;
+
+	uart->dmacr = UART011_DMAONERR;
+	snd_uart_pl011_write(uart, uart->dmacr, UART011_DMACR);
+
+	if (uart->dmarx.chan && snd_uart_pl011_dma_rx_start(uart) == 0)
+		/* RX FIFO level is handled by DMA, keep the timeout */
+		uart->im &= ~UART011_RXIM;
+}
+
+static void snd_uart_pl011_dma_shutdown(struct snd_uart_pl011 *uart)
+{
+	if (!uart->dmarx.chan && !uart->dmatx.chan)
+		return;
 
-#define TX_BUFF_SIZE		(1<<15)		/* Must be 2^n */
-#define TX_BUFF_MASK		(TX_BUFF_SIZE - 1)
+	uart->dmacr = 0;
+	snd_uart_pl011_write(uart, uart->dmacr, UART011_DMACR);
 
-#define AMBA_ISR_PASS_LIMIT	256
+	if (uart->dmatx.chan) {
+		dmaengine_terminate_all(uart->dmatx.chan);
+		uart->dmatx.queued = 0;
+	}
+	if (uart->dmarx.chan) {
+		dmaengine_terminate_all(uart->dmarx.chan);
+		uart->dmarx.queued = 0;
+	}
+}
 
-#define SERIAL_MODE_NOT_OPENED 		(0)
-#define SERIAL_MODE_INPUT_OPEN		(1 << 0)
-#define SERIAL_MODE_OUTPUT_OPEN		(1 << 1)
-#define SERIAL_MODE_INPUT_TRIGGERED	(1 << 2)
-#define SERIAL_MODE_OUTPUT_TRIGGERED	(1 << 3)
+static int snd_uart_pl011_dma_chan_init(struct snd_uart_pl011_dmabuf *dbuf,
+					struct device *dev, const char *name,
+					struct dma_slave_config *conf)
+{
+	dbuf->chan = dma_request_slave_channel(dev, name);
+	if (!dbuf->chan)
+		return -ENODEV;
 
-struct snd_uart_pl011 {
-	struct amba_device *dev;
-	struct snd_card *card;
-	struct snd_rawmidi *rmidi;
-	struct snd_rawmidi_substream *midi_output[SNDRV_SERIAL_MAX_OUTS];
-	struct snd_rawmidi_substream *midi_input[SNDRV_SERIAL_MAX_INS];
+	dmaengine_slave_config(dbuf->chan, conf);
+	dbuf->buf = dma_alloc_coherent(dbuf->chan->device->dev, DMA_BUFF_SIZE,
+				       &dbuf->dma, GFP_KERNEL);
+	if (!dbuf->buf) {
+		dma_release_channel(dbuf->chan);
+		dbuf->chan = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
 
-	int filemode;		/* open status of file */
+static void snd_uart_pl011_dma_chan_free(struct snd_uart_pl011_dmabuf *dbuf)
+{
+	if (!dbuf->chan)
+		return;
 
-	spinlock_t open_lock;
-	wait_queue_head_t drain_wait;
-	int draining;
+	dmaengine_terminate_all(dbuf->chan);
+	dma_free_coherent(dbuf->chan->device->dev, DMA_BUFF_SIZE,
+			  dbuf->buf, dbuf->dma);
+	dma_release_channel(dbuf->chan);
+	dbuf->chan = NULL;
+}
 
-	int irq;
+/* Grab whatever channels the platform gives us. Anything missing simply
+ * leaves that direction on the interrupt driven path. */
+static void snd_uart_pl011_dma_probe(struct snd_uart_pl011 *uart,
+				     struct device *dev)
+{
+	struct dma_slave_config tx_conf = {
+		.dst_addr = uart->mapbase + UART01x_DR,
+		.dst_addr_width = DMA_SLAVE_BUSWIDTH_1_BYTE,
+		.direction = DMA_MEM_TO_DEV,
+		.dst_maxburst = SNDRV_SERIAL_DEFAULT_FIFO >> 1,
+		.device_fc = false,
+	};
+	struct dma_slave_config rx_conf = {
+		.src_addr = uart->mapbase + UART01x_DR,
+		.src_addr_width = DMA_SLAVE_BUSWIDTH_1_BYTE,
+		.direction = DMA_DEV_TO_MEM,
+		.src_maxburst = SNDRV_SERIAL_DEFAULT_FIFO >> 2,
+		.device_fc = false,
+	};
 
-	void __iomem *membase;
-	unsigned long mapbase;
-	struct resource *res_base;
+	/* Throttled TX writes a timed number of bytes, DMA can't do that */
+	if (!uart->throttle_tx &&
+	    snd_uart_pl011_dma_chan_init(&uart->dmatx, dev, "tx",
+					 &tx_conf) == 0)
+		snd_printk(KERN_INFO "pl011: using DMA for TX\n");
 
-	struct clk *clk;
-	unsigned long clk_rate;
-	unsigned int speed;
+	if (snd_uart_pl011_dma_chan_init(&uart->dmarx, dev, "rx",
+					 &rx_conf) == 0)
+		snd_printk(KERN_INFO "pl011: using DMA for RX\n");
+}
 
-	/* parameter for using of write loop */
-	short int fifo_limit;
-        short int fifo_count;
+static void snd_uart_pl011_dma_remove(struct snd_uart_pl011 *uart)
+{
+	snd_uart_pl011_dma_chan_free(&uart->dmatx);
+	snd_uart_pl011_dma_chan_free(&uart->dmarx);
+}
+#else
+static inline void snd_uart_pl011_dma_rx_flush(struct snd_uart_pl011 *uart)
+{
+}
 
-	/* type of adaptor */
-	int adaptor;
+static inline int snd_uart_pl011_dma_tx_start(struct snd_uart_pl011 *uart)
+{
+	return 0;
+}
 
-	/* inputs */
-	int prev_in;
-	unsigned char rstatus;
+static inline int snd_uart_pl011_dma_tx_stop(struct snd_uart_pl011 *uart)
+{
+	return 0;
+}
 
-	/* outputs */
-	int prev_out;
-	unsigned char prev_status[SNDRV_SERIAL_MAX_OUTS];
+static inline void snd_uart_pl011_dma_tx_sync(struct snd_uart_pl011 *uart)
+{
+}
 
-	/* write buffer and its writing/reading position */
-	unsigned char tx_buff[TX_BUFF_SIZE];
-	int buff_in_count;
-        int buff_in;
-        int buff_out;
-        int drop_on_full;
-	int throttle_tx;
-	int dynamic_throttle;
-	int flow_control;
-	ktime_t throttle_delay;
+static inline void snd_uart_pl011_dma_startup(struct snd_uart_pl011 *uart)
+{
+}
 
-	int timer_running;
-	u16 control_reg;
-	enum {
-		TX_IDLE,
-		TX_BLOCK_RX,
-		TX_BUSY,
-	} tx_state;
-	int tx_attempts;
-	struct hrtimer buffer_timer;
-	unsigned char bytes_pending[SNDRV_SERIAL_MAX_OUTS];
-};
+static inline void snd_uart_pl011_dma_shutdown(struct snd_uart_pl011 *uart)
+{
+}
 
-static inline void snd_uart_pl011_stop_rx(struct snd_uart_pl011 *uart)
+static inline void snd_uart_pl011_dma_probe(struct snd_uart_pl011 *uart,
+					    struct device *dev)
 {
-	writew(uart->control_reg & ~UART011_CR_RTS, uart->membase + UART011_CR);
 }
 
-static inline void snd_uart_pl011_start_rx(struct snd_uart_pl011 *uart)
+static inline void snd_uart_pl011_dma_remove(struct snd_uart_pl011 *uart)
 {
-	writew(uart->control_reg | UART011_CR_RTS, uart->membase + UART011_CR);
 }
+#endif
 
-static inline void snd_uart_pl011_reset_delay_times(struct snd_uart_pl011 *uart)
+/* Trigger levels and how many bytes each means in the 16 byte FIFO */
+static const struct {
+	u16 ifls;
+	unsigned char bytes;
+} snd_uart_pl011_rx_levels[] = {
+	{ UART011_IFLS_RX1_8, 2 },
+	{ UART011_IFLS_RX2_8, 4 },
+	{ UART011_IFLS_RX4_8, 8 },
+	{ UART011_IFLS_RX6_8, 12 },
+}, snd_uart_pl011_tx_levels[] = {
+	{ UART011_IFLS_TX1_8, 2 },
+	{ UART011_IFLS_TX2_8, 4 },
+	{ UART011_IFLS_TX4_8, 8 },
+};
+
+/* RX DMA bursts are 4 bytes, the level must not be below that */
+static inline int snd_uart_pl011_rx_level_min(struct snd_uart_pl011 *uart)
 {
-	if (uart->dynamic_throttle == 0) return;
+	return uart->dmarx.chan ? 1 : 0;
+}
 
-	memset(uart->bytes_pending, 0, 
-			sizeof(unsigned char) * SNDRV_SERIAL_MAX_OUTS);
+/* Program IFLS for the current mode. Fixed mode keeps the levels the
+ * driver has always used. The TX level is the refill point of the write
+ * loop: in latency mode the highest one leaving at least half of
+ * fifo_limit to be written per interrupt, so the wire does not go idle;
+ * in the others the lowest, for the most bytes per interrupt. */
+static void snd_uart_pl011_set_ifls(struct snd_uart_pl011 *uart)
+{
+	int tx = 0;
+
+	switch (uart->fifo_mode) {
+	case SNDRV_SERIAL_FIFO_FIXED:
+		uart->rx_level = 1;
+		break;
+	case SNDRV_SERIAL_FIFO_LATENCY:
+		uart->rx_level = 0;
+		while (tx + 1 < ARRAY_SIZE(snd_uart_pl011_tx_levels) &&
+		       snd_uart_pl011_tx_levels[tx + 1].bytes * 2 <=
+		       uart->fifo_limit)
+			tx++;
+		break;
+	case SNDRV_SERIAL_FIFO_THROUGHPUT:
+		uart->rx_level = ARRAY_SIZE(snd_uart_pl011_rx_levels) - 1;
+		break;
+	default:
+		/* adaptive keeps the level it has reached */
+		break;
+	}
+	if (uart->rx_level < snd_uart_pl011_rx_level_min(uart))
+		uart->rx_level = snd_uart_pl011_rx_level_min(uart);
+	uart->rx_streak = 0;
+
+	uart->tx_level = tx;
+
+	uart->ifls = snd_uart_pl011_rx_levels[uart->rx_level].ifls |
+		     snd_uart_pl011_tx_levels[tx].ifls;
+	snd_uart_pl011_write(uart, uart->ifls, UART011_IFLS);
 }
 
-static inline void snd_uart_pl011_update_delay_time(struct snd_uart_pl011 *uart)
+/* Bytes left in the TX FIFO when its interrupt fires */
+static inline int snd_uart_pl011_tx_level(struct snd_uart_pl011 *uart)
 {
-	enum {	CUR_OUTPUT_INIT = -2,
-		CUR_OUTPUT_CHANGE = -1,
-		CUR_OUTPUT_VALID = 0
-	};
-	static int current_output = CUR_OUTPUT_INIT;
+	return snd_uart_pl011_tx_levels[uart->tx_level].bytes;
+}
 
-	if (uart->dynamic_throttle == 0) return;
+/* Adaptive mode: go up a level while the RX interrupt keeps finding the
+ * FIFO at its level (bulk data such as SysEx), and back down when the
+ * timeout has to pick up a few bytes (single messages). */
+static void snd_uart_pl011_rx_adapt(struct snd_uart_pl011 *uart, int rx,
+				    int timed_out)
+{
+	int bytes = snd_uart_pl011_rx_levels[uart->rx_level].bytes;
+	int level = uart->rx_level;
 
-	if (uart->tx_buff[uart->buff_out] == 0xf5) {
-		current_output = CUR_OUTPUT_CHANGE;
+	if (uart->fifo_mode != SNDRV_SERIAL_FIFO_ADAPTIVE || !rx)
 		return;
-	}
 
-	if (current_output == CUR_OUTPUT_CHANGE) {
-		current_output = uart->tx_buff[uart->buff_out] - 1;
+	if (timed_out && rx < bytes) {
+		uart->rx_streak = 0;
+		if (level > snd_uart_pl011_rx_level_min(uart))
+			level--;
+	} else if (rx >= bytes &&
+		   ++uart->rx_streak >= FIFO_ADAPT_STREAK) {
+		uart->rx_streak = 0;
+		if (level + 1 < ARRAY_SIZE(snd_uart_pl011_rx_levels))
+			level++;
 	}
 
-	if (current_output >= CUR_OUTPUT_VALID) {
-		uart->bytes_pending[current_output]++;
+	if (level != uart->rx_level) {
+		uart->rx_level = level;
+		uart->ifls = snd_uart_pl011_rx_levels[level].ifls |
+			     snd_uart_pl011_tx_levels[uart->tx_level].ifls;
+		snd_uart_pl011_write(uart, uart->ifls, UART011_IFLS);
 	}
 }
 
-static inline void snd_uart_pl011_update_write_delay(
-		struct snd_uart_pl011 *uart)
+/* Interrupts and the bytes they moved, per FIFO mode */
+static inline void snd_uart_pl011_mode_stat(struct snd_uart_pl011 *uart,
+					    int work)
 {
-	/* Delay based on MIDI baud rate of 31250 and maximum number of bytes
-	 * to send for any channel. A MIDI byte is 10 bits, so the delay time
-	 * per byte is (10/31250) = 320 us */
-	unsigned char i, max_bytes;
+	uart->mode_irqs[uart->fifo_mode]++;
+	uart->mode_bytes[uart->fifo_mode] += work;
+}
 
-	if (uart->dynamic_throttle == 0) return;
+/* Baud rate and what depends on it. Only with the TX FIFO empty.
+ * The divisors and LCRH must not be written with the UART enabled, so
+ * it is turned off once the byte on the wire is done, as amba-pl011
+ * does in set_termios. */
+static void snd_uart_pl011_set_speed(struct snd_uart_pl011 *uart)
+{
+	unsigned int quot;
+	int timeout = 1000;
+	u16 cr;
 
-	max_bytes = 0;
-	for (i = 0; i < SNDRV_SERIAL_MAX_OUTS; i++) {
-		if (uart->bytes_pending[i] > max_bytes)
-			max_bytes = uart->bytes_pending[i];
+	uart->clk_rate = clk_get_rate(uart->clk);
+	quot = DIV_ROUND_CLOSEST(uart->clk_rate * 4, uart->speed);
+
+	/* 10 bits per byte on the wire */
+	uart->poll_period = ns_to_ktime(div_u64(POLL_FIFO_BYTES * 10ULL *
+						NSEC_PER_SEC, uart->speed));
+	uart->rx_byte_ns = div_u64(10ULL * NSEC_PER_SEC, uart->speed);
+
+	cr = snd_uart_pl011_read(uart, UART011_CR);
+	snd_uart_pl011_write(uart, 0, UART011_CR);
+	while (timeout &&
+	       (snd_uart_pl011_read(uart, UART01x_FR) & UART01x_FR_BUSY)) {
+		timeout--;
+		barrier();
 	}
-	uart->throttle_delay = ns_to_ktime(uart->dynamic_throttle * 
-			(max_bytes * 320 * (1000/100)));
+
+	snd_uart_pl011_write(uart, quot & 0x3f, UART011_FBRD);
+	snd_uart_pl011_write(uart, quot >> 6, UART011_IBRD);
+
+	/* The divisor only takes effect with the LCRH write */
+	snd_uart_pl011_write(uart,
+	       UART01x_LCRH_FEN		/* Enable FIFOs */
+	     | UART01x_LCRH_WLEN_8	/* 8 Bit words, 1 Stop, No Parity */
+	     , UART011_LCRH);	/* FIFO Control Register */
+
+	snd_uart_pl011_write(uart, cr, UART011_CR);
 }
 
-/* This macro is only used in snd_uart_pl011_io_loop */
-static inline void snd_uart_pl011_buffer_output(struct snd_uart_pl011 *uart)
+/* Nothing queued, scheduled, in flight or on the wire */
+static int snd_uart_pl011_tx_quiescent(struct snd_uart_pl011 *uart)
 {
-	unsigned short buff_out = uart->buff_out;
-	writeb(uart->tx_buff[buff_out], uart->membase + UART01x_DR);
-	uart->fifo_count++;
-	buff_out++;
-	buff_out &= TX_BUFF_MASK;
-	uart->buff_out = buff_out;
-	uart->buff_in_count--;
+	ktime_t last;
+
+	return !uart->timer_running &&
+	       snd_uart_pl011_sched_pending(uart, &last) == 0 &&
+	       uart->buff_in_count == 0 &&
+	       snd_uart_pl011_tx_pending(uart) == 0 &&
+	       snd_uart_pl011_rt_pending(uart) == 0 &&
+	       !snd_uart_pl011_dma_tx_busy(uart) &&
+	       !(snd_uart_pl011_read(uart, UART01x_FR) & UART01x_FR_BUSY);
 }
 
-static inline int snd_uart_pl011_write_fifo_timer(struct snd_uart_pl011 * uart)
+/* Apply a speed or flow control change from sysfs once the output has
+ * gone quiet, so no byte is sent half at one rate. Called with
+ * open_lock held. */
+static void snd_uart_pl011_apply_config(struct snd_uart_pl011 *uart)
 {
-	/* Check CTS - FIFO is empty */
-	if (!uart->flow_control ||
-			readw(uart->membase + UART01x_FR) & UART01x_FR_CTS) {
-		snd_uart_pl011_reset_delay_times(uart);
-		while (uart->fifo_count < uart->fifo_limit
-			&& uart->buff_in_count > 0) {
-			snd_uart_pl011_buffer_output(uart);
-			snd_uart_pl011_update_delay_time(uart);
-		}
-		snd_uart_pl011_update_write_delay(uart);
-	
-		uart->tx_state = TX_BUSY;
-		if (unlikely(uart->draining))
-			wake_up(&uart->drain_wait);
-		return 1;
+	if (uart->filemode != SERIAL_MODE_NOT_OPENED &&
+	    !snd_uart_pl011_tx_quiescent(uart))
+		return;
+
+	uart->flow_control = uart->new_flow_control;
+	if (uart->speed != uart->new_speed) {
+		uart->speed = uart->new_speed;
+		/* do_open sets the speed otherwise */
+		if (uart->filemode != SERIAL_MODE_NOT_OPENED)
+			snd_uart_pl011_set_speed(uart);
 	}
-	return 0;
+	uart->reconfig = 0;
 }
 
-static inline void snd_uart_pl011_start_timer(struct snd_uart_pl011 *uart)
+/* Get output moving after new data has been queued */
+static void snd_uart_pl011_tx_kick(struct snd_uart_pl011 *uart)
 {
-        if (!uart->timer_running) {
-		if (uart->flow_control) {
-			snd_uart_pl011_stop_rx(uart);
-			uart->tx_state = TX_BLOCK_RX;
-			uart->tx_attempts = TIMER_ATTEMPTS_LIMIT;
-		} else {
-			snd_uart_pl011_write_fifo_timer(uart);
-		}
-		hrtimer_start(&uart->buffer_timer, uart->throttle_delay,
-				HRTIMER_MODE_REL);
-		uart->timer_running = 1;
-        }
-}
+	if (unlikely(uart->reconfig))
+		snd_uart_pl011_apply_config(uart);
 
-static inline void snd_uart_pl011_del_timer(struct snd_uart_pl011 *uart)
-{
-        hrtimer_cancel(&uart->buffer_timer);
-        uart->timer_running = 0;
+	snd_uart_pl011_tx_schedule(uart);
+
+	if (uart->throttle_tx) {
+		if (uart->buff_in_count > 0 ||
+		    snd_uart_pl011_rt_pending(uart) > 0)
+			snd_uart_pl011_start_timer(uart);
+		return;
+	}
+
+	snd_uart_pl011_rt_output(uart);
+	if (snd_uart_pl011_dma_tx_start(uart))
+		return;
+
+	/* Tx FIFO empty - write immediately */
+	if (snd_uart_pl011_read(uart, UART01x_FR) & UART011_FR_TXFE)
+		uart->fifo_count = 0;
+	while (uart->fifo_count < uart->fifo_limit
+		&& snd_uart_pl011_tx_ready(uart))
+		snd_uart_pl011_buffer_output(uart);
 }
 
-/* This loop should be called with interrupts disabled
- * We don't want to interrupt this, 
- * as we're already handling an interrupt 
+/* Called with open_lock held, from the hard handler or, in threaded
+ * mode, from the IRQ thread with bottom halves off
  *
  * PL011 interrupts that must be serviced (and cleared):
  * UART011_RXIC	    (RX FIFO becoming full)
  * UART011_TXIC	    (TX FIFO becoming empty)
  * UART011_RTIC	    (RX timeout reached)
  */
-static void snd_uart_pl011_io_loop(struct snd_uart_pl011 * uart)
+static int snd_uart_pl011_io_loop(struct snd_uart_pl011 * uart)
 {
-	unsigned char c;
-	int substream;
 	int pass_counter = AMBA_ISR_PASS_LIMIT;
+	int work = 0;
+	int rx_timeout = 0;
+	int timed_out;
+	int count;
+
+	/* RX DMA leaves the tail of a burst in the FIFO and raises the
+	 * timeout interrupt; collect the DMA buffer before reading on */
+	if (snd_uart_pl011_irq_status(uart) & UART011_RTIS) {
+		rx_timeout = 1;
+		snd_uart_pl011_dma_rx_flush(uart);
+		snd_uart_pl011_write(uart, UART011_RTIC, UART011_ICR);
+	}
+	timed_out = rx_timeout;
+
+	/* Timestamped read loop */
+	while (uart->rx_tstamp && pass_counter > 0 &&
+	       (count = snd_uart_pl011_rx_fifo_tstamp(uart, rx_timeout))) {
+		if (snd_uart_pl011_read(uart, UART01x_FR) & UART011_FR_RXFF)
+			snd_uart_pl011_rx_overrun(uart);
+		/* only the first run can be the one that timed out */
+		rx_timeout = 0;
+		pass_counter -= count;
+		work += count;
+	}
 
-	/* recall previous stream */
-	substream = uart->prev_in;
-    
 	/* Read Loop */
-	while (!(readw(uart->membase + UART01x_FR) & UART01x_FR_RXFE)) {
+	while (!uart->rx_tstamp &&
+	       !(snd_uart_pl011_read(uart, UART01x_FR) & UART01x_FR_RXFE)) {
 		/* while receive data ready */
-		c = readb(uart->membase + UART01x_DR);
+		snd_uart_pl011_receive_char(uart,
+				snd_uart_pl011_getc(uart));
+		work++;
 
-		/* keep track of last status byte */
-		if (c & 0x80)
-			uart->rstatus = c;
-
-		/* handle stream switch */
-		if (uart->adaptor == SNDRV_SERIAL_GENERIC) {
-			if (uart->rstatus == 0xf5) {
-				if (c <= SNDRV_SERIAL_MAX_INS && c > 0)
-					substream = c - 1;
-				if (c != 0xf5)
-					/* prevent future bytes from being
-					   interpreted as streams */
-					uart->rstatus = 0;
-			} else if ((uart->filemode & SERIAL_MODE_INPUT_OPEN)
-				   && uart->midi_input[substream])
-				snd_rawmidi_receive(uart->midi_input[substream],
-						    &c, 1);
-		} else if ((uart->filemode & SERIAL_MODE_INPUT_OPEN) &&
-			   uart->midi_input[substream])
-			snd_rawmidi_receive(uart->midi_input[substream], &c, 1);
-
-		if (readw(uart->membase + UART01x_FR) & UART011_FR_RXFF)
-			snd_printk(KERN_WARNING
-				   "%s: Overrun on device at 0x%lx\n",
-			       uart->rmidi->name, uart->mapbase);
+		if (snd_uart_pl011_read(uart, UART01x_FR) & UART011_FR_RXFF)
+			snd_uart_pl011_rx_overrun(uart);
 
 		if (pass_counter-- == 0) break;
 	}
 
-	/* remember the last stream */
-	uart->prev_in = substream;
+	/* The line has gone idle if RX timed out, a message cut short
+	 * is not going to be finished */
+	snd_uart_pl011_flush_input(uart, uart->prev_in, timed_out);
+	snd_uart_pl011_rx_adapt(uart, work, timed_out);
 
-	if (uart->throttle_tx) return;
+	if (uart->throttle_tx) return work;
 
 	/* Check write status, if we get a TX fifo interrupt,
 	 * it's possible that there are still 2 bytes of data
 	 * in the FIFO */
-	if (readw(uart->membase + UART011_MIS) & UART011_TXIS) {
-		writew(UART011_TXIC, uart->membase + UART011_ICR);
-		uart->fifo_count = 2;
+	if (snd_uart_pl011_irq_status(uart) & UART011_TXIS) {
+		snd_uart_pl011_write(uart, UART011_TXIC, UART011_ICR);
+		uart->fifo_count = snd_uart_pl011_tx_level(uart);
 		if (unlikely(uart->draining)) wake_up(&uart->drain_wait);
 	}
 
-	if (readw(uart->membase + UART01x_FR) & UART011_FR_TXFE)
+	if (snd_uart_pl011_read(uart, UART01x_FR) & UART011_FR_TXFE)
 		uart->fifo_count = 0;
 
+	snd_uart_pl011_rt_output(uart);
+
+	/* Let the DMA engine feed the FIFO if it can */
+	if (snd_uart_pl011_dma_tx_start(uart))
+		return work;
+
 	/* Write loop */
 	while (uart->fifo_count < uart->fifo_limit /* Can we write ? */
-		&& uart->buff_in_count > 0)	/* Do we want to? */
+		&& snd_uart_pl011_tx_ready(uart)) {	/* Do we want to? */
 		snd_uart_pl011_buffer_output(uart);
+		work++;
+	}
+
+	if (unlikely(uart->reconfig))
+		snd_uart_pl011_apply_config(uart);
+
+	return work;
 }
 
 static irqreturn_t snd_uart_pl011_interrupt(int irq, void *dev_id)
 {
 	struct snd_uart_pl011 *uart;
+	ktime_t start = ktime_get();
+	int work;
 
 	uart = dev_id;
 	spin_lock(&uart->open_lock);
@@ -387,19 +2187,120 @@ static irqreturn_t snd_uart_pl011_interrupt(int irq, void *dev_id)
 		return IRQ_NONE;
 	}
 
-	snd_uart_pl011_io_loop(uart);
+	if (uart->rx_tstamp) {
+		uart->irq_time = start;
+		uart->irq_stamped = 1;
+	}
+
+	work = snd_uart_pl011_io_loop(uart);
+	snd_uart_pl011_mode_stat(uart, work);
+	snd_uart_pl011_hist_add(uart->irq_hist, ktime_sub(ktime_get(), start));
+	trace_snd_serial_pl011_irq(uart->mapbase, work, uart->buff_in_count,
+				   uart->fifo_count);
 	spin_unlock(&uart->open_lock);
 	return IRQ_HANDLED;
 }
 
-static enum hrtimer_restart snd_uart_pl011_buffer_timer(struct hrtimer *handle)
+/* Threaded mode: the hard handler takes no lock, so that nothing in
+ * hard IRQ context does and the thread can leave interrupts on. It
+ * notes the time for timestamped input and wakes the thread; the line
+ * stays masked (IRQF_ONESHOT) until the thread is done. */
+static irqreturn_t snd_uart_pl011_hard_interrupt(int irq, void *dev_id)
+{
+	struct snd_uart_pl011 *uart = dev_id;
+
+	if (!snd_uart_pl011_read(uart, UART011_MIS))
+		return IRQ_NONE;
+	if (READ_ONCE(uart->rx_tstamp))
+		atomic64_set(&uart->irq_stamp, ktime_to_ns(ktime_get()));
+	set_bit(SERIAL_EV_IO, &uart->irq_events);
+	return IRQ_WAKE_THREAD;
+}
+
+static ktime_t snd_uart_pl011_throttle_step(struct snd_uart_pl011 *uart);
+
+/* While traffic is continuous the thread keeps the UART masked and is
+ * woken by the poll timer instead, much like NAPI. Once a pass finds
+ * little to do, interrupts are turned back on. The throttled TX steps
+ * of buffer_timer run here too. */
+static irqreturn_t snd_uart_pl011_irq_thread(int irq, void *dev_id)
+{
+	struct snd_uart_pl011 *uart = dev_id;
+	ktime_t start = ktime_get();
+	ktime_t delay;
+	s64 stamp;
+	int work;
+
+	spin_lock_bh(&uart->open_lock);
+	if (uart->filemode == SERIAL_MODE_NOT_OPENED)
+		goto out;
+
+	if (test_and_clear_bit(SERIAL_EV_THROTTLE, &uart->irq_events) &&
+	    uart->timer_running) {
+		delay = snd_uart_pl011_throttle_step(uart);
+		if (delay)
+			hrtimer_start(&uart->buffer_timer, delay,
+				      HRTIMER_MODE_REL);
+	}
+
+	if (!test_and_clear_bit(SERIAL_EV_IO, &uart->irq_events))
+		goto out;
+	stamp = atomic64_xchg(&uart->irq_stamp, 0);
+	if (stamp) {
+		uart->irq_time = ns_to_ktime(stamp);
+		uart->irq_stamped = 1;
+	}
+	work = snd_uart_pl011_io_loop(uart);
+	snd_uart_pl011_mode_stat(uart, work);
+	snd_uart_pl011_hist_add(uart->irq_hist, ktime_sub(ktime_get(), start));
+	trace_snd_serial_pl011_irq(uart->mapbase, work, uart->buff_in_count,
+				   uart->fifo_count);
+	if (work >= POLL_BUSY_BYTES) {
+		if (!uart->irq_masked) {
+			uart->irq_masked = 1;
+			snd_uart_pl011_write_im(uart);
+		}
+		hrtimer_start(&uart->poll_timer, uart->poll_period,
+			      HRTIMER_MODE_REL);
+	} else if (uart->irq_masked) {
+		uart->irq_masked = 0;
+		snd_uart_pl011_write_im(uart);
+	}
+ out:
+	spin_unlock_bh(&uart->open_lock);
+	return IRQ_HANDLED;
+}
+
+/* The release runs on the producer side, from the fill tasklet */
+static enum hrtimer_restart snd_uart_pl011_sched_timer(struct hrtimer *handle)
+{
+	struct snd_uart_pl011 *uart =
+		container_of(handle, struct snd_uart_pl011, sched_timer);
+
+	tasklet_schedule(&uart->fill_tasklet);
+	return HRTIMER_NORESTART;
+}
+
+static enum hrtimer_restart snd_uart_pl011_poll_timer(struct hrtimer *handle)
+{
+	struct snd_uart_pl011 *uart =
+		container_of(handle, struct snd_uart_pl011, poll_timer);
+
+	set_bit(SERIAL_EV_IO, &uart->irq_events);
+	irq_wake_thread(uart->irq, uart);
+	return HRTIMER_NORESTART;
+}
+
+/* One step of throttled TX, with open_lock held. Returns the delay to
+ * the next step, 0 once there is nothing left to send. */
+static ktime_t snd_uart_pl011_throttle_step(struct snd_uart_pl011 *uart)
 {
-        struct snd_uart_pl011 *uart = 
-		container_of(handle, struct snd_uart_pl011, buffer_timer);
 	enum hrtimer_restart restart = HRTIMER_NORESTART;
 	int double_delay = 0;
+	int from;
 
-        spin_lock(&uart->open_lock);
+	uart->timer_fires++;
+	from = uart->tx_state;
 
 	switch (uart->tx_state) {
 	    case TX_IDLE:
@@ -418,13 +2319,16 @@ static enum hrtimer_restart snd_uart_pl011_buffer_timer(struct hrtimer *handle)
 			 * CTS. Therefore limit the number of times we call the
 			 * timer */
 			if (uart->tx_attempts--) restart = HRTIMER_RESTART;
-			else uart->tx_state = TX_IDLE;
+			else {
+				uart->tx_state = TX_IDLE;
+				uart->cts_timeouts++;
+			}
 		}
 
 		break;
 
 	    case TX_BUSY:
-		if (readw(uart->membase + UART01x_FR) & UART01x_FR_BUSY) {
+		if (snd_uart_pl011_read(uart, UART01x_FR) & UART01x_FR_BUSY) {
 			/* Still writing, reschedule */
 			restart = HRTIMER_RESTART;
 		} else {
@@ -437,23 +2341,54 @@ static enum hrtimer_restart snd_uart_pl011_buffer_timer(struct hrtimer *handle)
 			} else {
 				uart->tx_state = TX_BLOCK_RX;
 			}
-			if (uart->buff_in_count > 0) {
+			if (uart->buff_in_count > 0 ||
+			    snd_uart_pl011_tx_pending(uart) > 0 ||
+			    snd_uart_pl011_rt_pending(uart) > 0) {
 				restart = HRTIMER_RESTART;
 			}
 		}
 		break;
 	}
 
-	if (restart == HRTIMER_RESTART) {
-		hrtimer_forward_now(&uart->buffer_timer,
-			double_delay ? ktime_add(uart->throttle_delay, 
-				uart->throttle_delay) : uart->throttle_delay);
-	} else
+	if (restart != HRTIMER_RESTART) {
 		uart->timer_running = 0;
+		if (unlikely(uart->reconfig))
+			snd_uart_pl011_apply_config(uart);
+	}
+
+	if (from != uart->tx_state)
+		trace_snd_serial_pl011_timer(uart->mapbase, from,
+					     uart->tx_state,
+					     uart->buff_in_count,
+					     uart->fifo_count);
+
+	if (restart != HRTIMER_RESTART)
+		return 0;
+	return double_delay ? ktime_add(uart->throttle_delay,
+					uart->throttle_delay) :
+			      uart->throttle_delay;
+}
+
+/* In threaded mode the step is left to the IRQ thread, which arms the
+ * timer again, so that open_lock is never taken in hard IRQ context */
+static enum hrtimer_restart snd_uart_pl011_buffer_timer(struct hrtimer *handle)
+{
+	struct snd_uart_pl011 *uart =
+		container_of(handle, struct snd_uart_pl011, buffer_timer);
+	ktime_t delay;
 
-        spin_unlock(&uart->open_lock);
+	if (uart->threaded_irq) {
+		set_bit(SERIAL_EV_THROTTLE, &uart->irq_events);
+		irq_wake_thread(uart->irq, uart);
+		return HRTIMER_NORESTART;
+	}
 
-	return restart;
+	spin_lock(&uart->open_lock);
+	delay = snd_uart_pl011_throttle_step(uart);
+	if (delay)
+		hrtimer_forward_now(&uart->buffer_timer, delay);
+	spin_unlock(&uart->open_lock);
+	return delay ? HRTIMER_RESTART : HRTIMER_NORESTART;
 }
 
 static int snd_uart_pl011_detect(struct snd_uart_pl011 *uart)
@@ -462,25 +2397,26 @@ static int snd_uart_pl011_detect(struct snd_uart_pl011 *uart)
 	u16 status;
 	int timeout = 1000;
 
-	writew(0, uart->membase + UART011_IMSC);    /* Disable interrupts */
+	snd_uart_pl011_write(uart, 0, UART011_IMSC);    /* Disable interrupts */
 
-	writew(UART01x_CR_UARTEN
+	snd_uart_pl011_write(uart,
+	       UART01x_CR_UARTEN
 	     | UART011_CR_TXE
 	     | UART011_CR_LBE
 	     | UART011_CR_RXE
-	     , uart->membase + UART011_CR);
+	     , UART011_CR);
 
-	writew(0, uart->membase + UART011_FBRD);
-	writew(1, uart->membase + UART011_IBRD);
-	writew(0, uart->membase + UART011_LCRH);
-	writew(0x55, uart->membase + UART01x_DR);
+	snd_uart_pl011_write(uart, 0, UART011_FBRD);
+	snd_uart_pl011_write(uart, 1, UART011_IBRD);
+	snd_uart_pl011_write(uart, 0, UART011_LCRH);
+	snd_uart_pl011_write(uart, 0x55, UART01x_DR);
 	while (timeout &&
-		    (readw(uart->membase + UART01x_FR) & UART01x_FR_BUSY)) {
+		    (snd_uart_pl011_read(uart, UART01x_FR) & UART01x_FR_BUSY)) {
 		timeout--;
 		barrier();
 	}
-	status = readw(uart->membase + UART01x_DR) & 0xff;
-	writew(0xffff, uart->membase + UART011_ICR);	/* Clear interrupts */
+	status = snd_uart_pl011_read(uart, UART01x_DR) & 0xff;
+	snd_uart_pl011_write(uart, 0xffff, UART011_ICR);	/* Clear interrupts */
 	
 	/* Loopback with WLEN == 5 turns 0x55 into 0x15 */
 	if (status == 0x15) ok = 1;
@@ -490,8 +2426,8 @@ static int snd_uart_pl011_detect(struct snd_uart_pl011 *uart)
 
 static void snd_uart_pl011_do_open(struct snd_uart_pl011 * uart)
 {
-	unsigned int quot;
 	u16 reg;
+	int i;
 
 	/* Initialize basic variables */
 	uart->buff_in_count = 0;
@@ -499,27 +2435,54 @@ static void snd_uart_pl011_do_open(struct snd_uart_pl011 * uart)
 	uart->buff_out = 0;
 	uart->fifo_count = 0;
 	uart->tx_state = TX_IDLE;
+	uart->tx_next = 0;
+	uart->tx_hold = -1;
+	uart->tx_status = 0;
+	uart->prev_out = -1;
+	uart->rt_in = 0;
+	uart->rt_out = 0;
+	uart->wire_port = -1;
+	uart->wire_switch = 0;
+	uart->wire_mb_data = 0;
+	uart->tx_mark_pending = 0;
+	uart->tx_mark_valid = 0;
+	uart->rx_count = 0;
+	uart->rx_done = 0;
+	uart->rx_switch = 0;
+	memset(uart->rx_parse, 0, sizeof(uart->rx_parse));
+	for (i = 0; i < SNDRV_SERIAL_MAX_OUTS; i++) {
+		if (!uart->tx_port[i])
+			continue;
+		uart->tx_port[i]->buff_in = 0;
+		uart->tx_port[i]->buff_out = 0;
+		uart->tx_port[i]->triggered = 0;
+		uart->tx_port[i]->status = 0;
+		uart->tx_port[i]->tx_left = 0;
+		uart->tx_port[i]->tx_sysex = 0;
+		uart->tx_port[i]->sched_in = 0;
+		uart->tx_port[i]->sched_out = 0;
+		uart->tx_port[i]->sched_count = 0;
+		uart->tx_port[i]->mark_pos = -1;
+	}
 
-	writew(UART01x_CR_UARTEN	/* Enable UART */
+	snd_uart_pl011_write(uart,
+	       UART01x_CR_UARTEN	/* Enable UART */
 	     | UART011_CR_TXE		/* Enable UART TX */
 	     | UART011_CR_RXE		/* Enable UART RX */
-	     , uart->membase + UART011_CR);
-
-	uart->clk_rate = clk_get_rate(uart->clk);
-	quot = DIV_ROUND_CLOSEST(uart->clk_rate * 4, uart->speed);
+	     , UART011_CR);
 
-	writew(quot & 0x3f, uart->membase + UART011_FBRD);
-	writew(quot >> 6, uart->membase + UART011_IBRD);
-
-	writew(UART01x_LCRH_FEN		/* Enable FIFOs */
-	     | UART01x_LCRH_WLEN_8	/* 8 Bit words, 1 Stop, No Parity */
-	     , uart->membase + UART011_LCRH);	/* FIFO Control Register */
+	uart->irq_masked = 0;
+	uart->irq_stamped = 0;
+	/* interrupts are still off at the UART, nothing sets these */
+	uart->irq_events = 0;
+	atomic64_set(&uart->irq_stamp, 0);
+	snd_uart_pl011_set_speed(uart);
 
-	writew(UART011_IFLS_RX2_8 /* Set RX FIFO trigger at 4-bytes */
-	     | UART011_IFLS_TX1_8 /* Set TX FIFO trigger at 2-bytes */
-	     , uart->membase + UART011_IFLS);
+	/* adaptive mode starts from the old fixed RX level of 4 bytes */
+	uart->rx_level = 1;
+	snd_uart_pl011_set_ifls(uart);
 
-	reg = readw(uart->membase + UART011_CR);
+	reg = snd_uart_pl011_read(uart, UART011_CR);
 	switch (uart->adaptor) {
 	default:
 		reg |=	UART011_CR_RTS
@@ -527,7 +2490,7 @@ static void snd_uart_pl011_do_open(struct snd_uart_pl011 * uart)
 		    | (uart->throttle_tx ? 0 : UART011_CR_RTSEN)	
 			/* Hardware CTS unless throttling */
 		    | (uart->throttle_tx ? 0 : UART011_CR_CTSEN);
-		writew(reg, uart->membase + UART011_CR);
+		snd_uart_pl011_write(uart, reg, UART011_CR);
 		break;
 	case SNDRV_SERIAL_MS124W_SA:
 	case SNDRV_SERIAL_MS124W_MB:
@@ -542,19 +2505,22 @@ static void snd_uart_pl011_do_open(struct snd_uart_pl011 * uart)
 
 	uart->control_reg = reg;
 
-	writew(UART011_RXIC /* Clear corresponting interrupts */
+	snd_uart_pl011_write(uart,
+	       UART011_RXIC /* Clear corresponting interrupts */
 	     | UART011_TXIC
 	     | UART011_RTIC
-	     , uart->membase + UART011_ICR);
+	     , UART011_ICR);
 
+	uart->im = 0;
 	if (uart->adaptor == SNDRV_SERIAL_MS124W_SA) {
 		/* FIXME: Enable RX data and Modem Status */
 	} else if (uart->adaptor == SNDRV_SERIAL_GENERIC) {
-		writew(UART011_RXIM	/* Enable RX FIFO interrupt */
+		uart->im = UART011_RXIM	/* Enable RX FIFO interrupt */
 		     | UART011_RTIM	/* Enable RX timeout interrupt */
 			/* Enable TX FIFO if not using throttling */
-		     | (uart->throttle_tx ? 0 : UART011_TXIM)
-		     , uart->membase + UART011_IMSC);
+		     | (uart->throttle_tx ? 0 : UART011_TXIM);
+		snd_uart_pl011_dma_startup(uart);
+		snd_uart_pl011_write_im(uart);
 	} else {
 		/* FIXME: Enable RX data and THRI */
 	}
@@ -562,13 +2528,17 @@ static void snd_uart_pl011_do_open(struct snd_uart_pl011 * uart)
 
 static void snd_uart_pl011_do_close(struct snd_uart_pl011 * uart)
 {
-	writew(0, uart->membase + UART011_IMSC); /* Interrupt enable Register */
-	writew(0xffff, uart->membase + UART011_ICR);
+	snd_uart_pl011_write(uart, 0, UART011_IMSC); /* Interrupt enable Register */
+	snd_uart_pl011_write(uart, 0xffff, UART011_ICR);
+	snd_uart_pl011_dma_shutdown(uart);
+	if (uart->threaded_irq)
+		hrtimer_try_to_cancel(&uart->poll_timer);
+	hrtimer_try_to_cancel(&uart->sched_timer);
 
 	switch (uart->adaptor) {
 	default:
 		/* Disable everything */
-		writew(0, uart->membase + UART011_CR); 
+		snd_uart_pl011_write(uart, 0, UART011_CR); 
 		break;
 	case SNDRV_SERIAL_MS124W_SA:
 	case SNDRV_SERIAL_MS124W_MB:
@@ -587,24 +2557,50 @@ static int snd_uart_pl011_input_open(struct snd_rawmidi_substream *substream)
 {
 	unsigned long flags;
 	struct snd_uart_pl011 *uart = substream->rmidi->private_data;
+	int i;
 
 	spin_lock_irqsave(&uart->open_lock, flags);
 	if (uart->filemode == SERIAL_MODE_NOT_OPENED)
 		snd_uart_pl011_do_open(uart);
 	uart->filemode |= SERIAL_MODE_INPUT_OPEN;
-	uart->midi_input[substream->number] = substream;
+	if (substream->rmidi == uart->rmidi_tstamp) {
+		/* bytes staged before had no arrival time taken */
+		if (!uart->rx_tstamp++)
+			for (i = 0; i < uart->rx_count; i++)
+				uart->rx_stamp[i] = ktime_get();
+		uart->midi_tstamp[substream->number] = substream;
+	} else {
+		uart->midi_input[substream->number] = substream;
+	}
 	spin_unlock_irqrestore(&uart->open_lock, flags);
 	return 0;
 }
 
+/* Either device may still have an input open */
+static int snd_uart_pl011_inputs_open(struct snd_uart_pl011 *uart)
+{
+	int i;
+
+	for (i = 0; i < SNDRV_SERIAL_MAX_INS; i++)
+		if (uart->midi_input[i] || uart->midi_tstamp[i])
+			return 1;
+	return 0;
+}
+
 static int snd_uart_pl011_input_close(struct snd_rawmidi_substream *substream)
 {
 	unsigned long flags;
 	struct snd_uart_pl011 *uart = substream->rmidi->private_data;
 
 	spin_lock_irqsave(&uart->open_lock, flags);
-	uart->filemode &= ~SERIAL_MODE_INPUT_OPEN;
-	uart->midi_input[substream->number] = NULL;
+	if (substream->rmidi == uart->rmidi_tstamp) {
+		uart->rx_tstamp--;
+		uart->midi_tstamp[substream->number] = NULL;
+	} else {
+		uart->midi_input[substream->number] = NULL;
+	}
+	if (!snd_uart_pl011_inputs_open(uart))
+		uart->filemode &= ~SERIAL_MODE_INPUT_OPEN;
 	if (uart->filemode == SERIAL_MODE_NOT_OPENED)
 		snd_uart_pl011_do_close(uart);
 	spin_unlock_irqrestore(&uart->open_lock, flags);
@@ -625,17 +2621,56 @@ static void snd_uart_pl011_input_trigger(struct snd_rawmidi_substream *substream
 	spin_unlock_irqrestore(&uart->open_lock, flags);
 }
 
+/* The ring only holds the burst the scheduler is sending, the backlog
+ * waits in the port queues. tx_schedule tops it up to tx_quantum bytes,
+ * so two bursts (one of them addressed byte by byte in MB mode) fill it. */
+static inline unsigned int snd_uart_pl011_tx_buff_bytes(
+		struct snd_uart_pl011 *uart)
+{
+	return roundup_pow_of_two(clamp_t(unsigned int, uart->tx_quantum * 2,
+					  TX_BUFF_MIN, TX_BUFF_MAX));
+}
+
 static int snd_uart_pl011_output_open(struct snd_rawmidi_substream *substream)
 {
 	unsigned long flags;
 	struct snd_uart_pl011 *uart = substream->rmidi->private_data;
+	struct snd_uart_pl011_port *port;
+	unsigned char *buff = NULL;
+	unsigned int size = 0;
+
+	/* The queue lives as long as the substream is open */
+	port = kzalloc(sizeof(*port), GFP_KERNEL);
+	if (!port)
+		return -ENOMEM;
+	port->mark_pos = -1;
+
+	/* First output in, allocated outside the lock */
+	if (!uart->tx_buff) {
+		size = snd_uart_pl011_tx_buff_bytes(uart);
+		buff = kmalloc(size, GFP_KERNEL);
+		if (!buff) {
+			kfree(port);
+			return -ENOMEM;
+		}
+	}
 
 	spin_lock_irqsave(&uart->open_lock, flags);
+	uart->tx_port[substream->number] = port;
+	if (!uart->tx_buff && buff) {
+		uart->tx_buff = buff;
+		uart->tx_buff_mask = size - 1;
+		uart->buff_in_count = 0;
+		uart->buff_in = 0;
+		uart->buff_out = 0;
+		buff = NULL;
+	}
 	if (uart->filemode == SERIAL_MODE_NOT_OPENED)
 		snd_uart_pl011_do_open(uart);
 	uart->filemode |= SERIAL_MODE_OUTPUT_OPEN;
 	uart->midi_output[substream->number] = substream;
 	spin_unlock_irqrestore(&uart->open_lock, flags);
+	kfree(buff);
 	return 0;
 };
 
@@ -643,154 +2678,99 @@ static int snd_uart_pl011_output_close(struct snd_rawmidi_substream *substream)
 {
 	unsigned long flags;
 	struct snd_uart_pl011 *uart = substream->rmidi->private_data;
+	struct snd_uart_pl011_port *port;
+	unsigned char *buff = NULL;
+	int i, dma_sync = 0;
 
+	/* Keep the fill tasklet off the substream from here on, the
+	 * scheduler gives the wire up if the port had a message half sent */
+	spin_lock_bh(&uart->fill_lock);
 	spin_lock_irqsave(&uart->open_lock, flags);
-	uart->filemode &= ~SERIAL_MODE_OUTPUT_OPEN;
 	uart->midi_output[substream->number] = NULL;
+	port = uart->tx_port[substream->number];
+	uart->tx_port[substream->number] = NULL;
+	for (i = 0; i < SNDRV_SERIAL_MAX_OUTS; i++)
+		if (uart->midi_output[i])
+			break;
+	/* The last output takes the ring with it */
+	if (i == SNDRV_SERIAL_MAX_OUTS) {
+		uart->filemode &= ~SERIAL_MODE_OUTPUT_OPEN;
+		dma_sync = snd_uart_pl011_dma_tx_stop(uart);
+		buff = uart->tx_buff;
+		uart->tx_buff = NULL;
+		uart->buff_in_count = 0;
+	}
 	if (uart->filemode == SERIAL_MODE_NOT_OPENED)
 		snd_uart_pl011_do_close(uart);
 	spin_unlock_irqrestore(&uart->open_lock, flags);
+	spin_unlock_bh(&uart->fill_lock);
+
+	if (buff) {
+		snd_uart_pl011_del_timer(uart);
+		/* no TX DMA callback may still be running when the next
+		 * open sets up a new ring */
+		if (dma_sync)
+			snd_uart_pl011_dma_tx_sync(uart);
+		kfree(buff);
+	}
+	kfree(port);
 	return 0;
 };
 
-static inline int snd_uart_pl011_buffer_can_write(struct snd_uart_pl011 *uart,
-						 int Num)
-{
-	if (uart->buff_in_count + Num < TX_BUFF_SIZE)
-		return 1;
-	else
-		return 0;
-}
-
-static inline int snd_uart_pl011_write_buffer(struct snd_uart_pl011 *uart,
-					     unsigned char byte)
+/* Hand new port data to the consumer side */
+static void snd_uart_pl011_output_kick(struct snd_uart_pl011 *uart)
 {
-	unsigned short buff_in = uart->buff_in;
-	if (uart->buff_in_count < TX_BUFF_SIZE) {
-		uart->tx_buff[buff_in] = byte;
-		buff_in++;
-		buff_in &= TX_BUFF_MASK;
-		uart->buff_in = buff_in;
-		uart->buff_in_count++;
-		if (uart->throttle_tx)
-			snd_uart_pl011_start_timer(uart);
-		return 1;
-	} else
-		return 0;
-}
+	unsigned long flags;
 
-static int snd_uart_pl011_output_byte(struct snd_uart_pl011 *uart,
-				     struct snd_rawmidi_substream *substream,
-				     unsigned char midi_byte)
-{
-	if ((uart->buff_in_count == 0) && !uart->throttle_tx) {
-	        /* Tx Buffer Empty - try to write immediately */
-		if (readw(uart->membase + UART01x_FR) & UART011_FR_TXFE) {
-		        uart->fifo_count = 1;
-			writeb(midi_byte, uart->membase + UART01x_DR);
-		} else {
-		        if (uart->fifo_count < uart->fifo_limit) {
-			        uart->fifo_count++;
-				writeb(midi_byte, uart->membase + UART01x_DR);
-			} else {
-			        /* Cannot write (buffer empty) -
-				 * put char in buffer */
-				snd_uart_pl011_write_buffer(uart, midi_byte);
-			}
-		}
-	} else {
-		if (!snd_uart_pl011_write_buffer(uart, midi_byte)) {
-			snd_printk(KERN_WARNING
-				   "%s: Buffer overrun on device at 0x%lx\n",
-				   uart->rmidi->name, uart->mapbase);
-			return 0;
-		}
-	}
-	return 1;
+	spin_lock_irqsave(&uart->open_lock, flags);
+	if (uart->filemode & SERIAL_MODE_OUTPUT_OPEN)
+		snd_uart_pl011_tx_kick(uart);
+	spin_unlock_irqrestore(&uart->open_lock, flags);
 }
 
 static void snd_uart_pl011_output_write(struct snd_rawmidi_substream *substream)
 {
-	unsigned char midi_byte, addr_byte;
 	struct snd_uart_pl011 *uart = substream->rmidi->private_data;
-	char first;
-	static unsigned long lasttime = 0;
-	
-	/* Interrupts are disabled during the updating of the tx_buff,
-	 * since it is 'bad' to have two processes updating the same
-	 * variables (ie buff_in & buff_out)
-	 */
-
-	if (uart->adaptor == SNDRV_SERIAL_MS124W_MB) {
-		while (1) {
-			/* buffer full? */
-			/* in this mode we need two bytes of space */
-			if (uart->buff_in_count > TX_BUFF_SIZE - 2)
-				break;
-			if (snd_rawmidi_transmit(substream, &midi_byte, 1) != 1)
-				break;
-#ifdef SNDRV_SERIAL_MS124W_MB_NOCOMBO
-			/* select exactly one of the four ports */
-			addr_byte = (1 << (substream->number + 4)) | 0x08;
-#else
-			/* select any combination of the four ports */
-			addr_byte = (substream->number << 4) | 0x08;
-			/* ...except none */
-			if (addr_byte == 0x08)
-				addr_byte = 0xf8;
-#endif
-			snd_uart_pl011_output_byte(uart, substream, addr_byte);
-			/* send midi byte */
-			snd_uart_pl011_output_byte(uart, substream, midi_byte);
-		}
-	} else {
-		first = 0;
-		while (snd_rawmidi_transmit_peek(substream, &midi_byte, 1) == 1) {
-			/* Also send F5 after 3 seconds with no data
-			 * to handle device disconnect */
-			if (first == 0 &&
-			    (uart->adaptor == SNDRV_SERIAL_SOUNDCANVAS ||
-			     uart->adaptor == SNDRV_SERIAL_GENERIC) &&
-			    (uart->prev_out != substream->number ||
-			     time_after(jiffies, lasttime + 3*HZ))) {
-
-				if (snd_uart_pl011_buffer_can_write(uart, 3)) {
-					/* Roland Soundcanvas part selection */
-					/* If this substream of the data is
-					 * different previous substream
-					 * in this uart, send the change part
-					 * event
-					 */
-					uart->prev_out = substream->number;
-					/* change part */
-					snd_uart_pl011_output_byte(uart, substream,
-								  0xf5);
-					/* data */
-					snd_uart_pl011_output_byte(uart, substream,
-								  uart->prev_out + 1);
-					/* If midi_byte is a data byte,
-					 * send the previous status byte */
-					if (midi_byte < 0x80 &&
-					    uart->adaptor == SNDRV_SERIAL_SOUNDCANVAS)
-						snd_uart_pl011_output_byte(uart, substream, uart->prev_status[uart->prev_out]);
-				} else if (!uart->drop_on_full)
-					break;
-
-			}
 
-			/* send midi byte */
-			if (!snd_uart_pl011_output_byte(uart, substream, midi_byte) &&
-			    !uart->drop_on_full )
-				break;
+	/* The port queues are lock free towards the scheduler, so open_lock
+	 * is only taken to kick the output afterwards. fill_lock keeps the
+	 * producers apart and is never taken with interrupts off: a trigger
+	 * that comes that way (the sequencer's timer) leaves the fill to
+	 * the tasklet, which finds the port triggered.
+	 */
+	if (irqs_disabled()) {
+		tasklet_schedule(&uart->fill_tasklet);
+		return;
+	}
+	spin_lock_bh(&uart->fill_lock);
+	snd_uart_pl011_port_fill(uart, substream);
+	spin_unlock_bh(&uart->fill_lock);
+	trace_snd_serial_pl011_output_write(uart->mapbase, substream->number,
+		snd_uart_pl011_port_count(uart->tx_port[substream->number]),
+		uart->buff_in_count, uart->fifo_count);
+	snd_uart_pl011_output_kick(uart);
+}
 
-			if (midi_byte >= 0x80 && midi_byte < 0xf0)
-				uart->prev_status[uart->prev_out] = midi_byte;
-			first = 1;
+/* Refill ports the scheduler has drained below half, and release
+ * scheduled events */
+static void snd_uart_pl011_fill_tasklet(unsigned long data)
+{
+	struct snd_uart_pl011 *uart = (struct snd_uart_pl011 *)data;
+	struct snd_uart_pl011_port *port;
+	int i;
 
-			snd_rawmidi_transmit_ack( substream, 1 );
-		}
-		lasttime = jiffies;
+	spin_lock_bh(&uart->fill_lock);
+	for (i = 0; i < SNDRV_SERIAL_MAX_OUTS; i++) {
+		port = uart->tx_port[i];
+		if (port && port->triggered && uart->midi_output[i] &&
+		    snd_uart_pl011_port_count(port) < PORT_BUFF_SIZE / 2)
+			snd_uart_pl011_port_fill(uart, uart->midi_output[i]);
 	}
+	/* sched_timer expired, or a port has drained */
+	if (uart->tx_sched)
+		snd_uart_pl011_sched_release(uart);
+	spin_unlock_bh(&uart->fill_lock);
+	snd_uart_pl011_output_kick(uart);
 }
 
 static void snd_uart_pl011_output_trigger(struct snd_rawmidi_substream *substream,
@@ -802,12 +2782,24 @@ static void snd_uart_pl011_output_trigger(struct snd_rawmidi_substream *substrea
 	spin_lock_irqsave(&uart->open_lock, flags);
 	if (up) {
 		uart->filemode |= SERIAL_MODE_OUTPUT_TRIGGERED;
-		snd_uart_pl011_output_write(substream);
+		uart->tx_port[substream->number]->triggered = 1;
 	} else {
 		uart->filemode &= ~SERIAL_MODE_OUTPUT_TRIGGERED;
+		uart->tx_port[substream->number]->triggered = 0;
 		snd_uart_pl011_del_timer(uart);
 	}
 	spin_unlock_irqrestore(&uart->open_lock, flags);
+
+	if (up)
+		snd_uart_pl011_output_write(substream);
+}
+
+/* Output still on its way, besides scheduled events */
+static int snd_uart_pl011_drain_pending(struct snd_uart_pl011 *uart)
+{
+	return uart->buff_in_count || uart->fifo_count ||
+	       snd_uart_pl011_tx_pending(uart) ||
+	       snd_uart_pl011_rt_pending(uart);
 }
 
 static void snd_uart_pl011_output_drain(struct snd_rawmidi_substream *substream)
@@ -815,6 +2807,7 @@ static void snd_uart_pl011_output_drain(struct snd_rawmidi_substream *substream)
 	unsigned long flags;
 	struct snd_uart_pl011 *uart = substream->rmidi->private_data;
 	DEFINE_WAIT(wait);
+	ktime_t last = ktime_set(0, 0);
 	long timeout;
 
 	spin_lock_irqsave(&uart->open_lock, flags);
@@ -824,7 +2817,11 @@ static void snd_uart_pl011_output_drain(struct snd_rawmidi_substream *substream)
 		return;
 	}
 
-	if (uart->buff_in_count || uart->fifo_count) {
+	if (snd_uart_pl011_drain_pending(uart) ||
+	    snd_uart_pl011_sched_pending(uart, &last)) {
+		trace_snd_serial_pl011_drain(uart->mapbase, 0,
+					     uart->buff_in_count,
+					     uart->fifo_count);
 		uart->draining++;
 		do {
 			timeout = msecs_to_jiffies(50);
@@ -833,9 +2830,18 @@ static void snd_uart_pl011_output_drain(struct snd_rawmidi_substream *substream)
 			spin_unlock_irqrestore(&uart->open_lock, flags);
 			timeout = schedule_timeout(timeout);
 			spin_lock_irqsave(&uart->open_lock, flags);
-		} while ((uart->buff_in_count || uart->fifo_count) && timeout);
+			/* Output that stops moving for 50 ms is given up
+			 * on, but not before 50 ms after the last scheduled
+			 * event is due */
+		} while ((snd_uart_pl011_drain_pending(uart) ||
+			  snd_uart_pl011_sched_pending(uart, &last)) &&
+			 (timeout ||
+			  ktime_before(ktime_get(), ktime_add_ms(last, 50))));
 		uart->draining = 0;
 		finish_wait(&uart->drain_wait, &wait);
+		trace_snd_serial_pl011_drain(uart->mapbase, 1,
+					     uart->buff_in_count,
+					     uart->fifo_count);
 	}
 	spin_unlock_irqrestore(&uart->open_lock, flags);
 }
@@ -857,11 +2863,21 @@ static struct snd_rawmidi_ops snd_uart_pl011_input =
 
 static int snd_uart_pl011_free(struct snd_uart_pl011 *uart)
 {
-	if (uart->irq >= 0)
+	int i;
+
+	if (uart->irq >= 0) {
 		free_irq(uart->irq, uart);
+		hrtimer_cancel(&uart->poll_timer);
+		hrtimer_cancel(&uart->sched_timer);
+	}
+	tasklet_kill(&uart->fill_tasklet);
+	snd_uart_pl011_dma_remove(uart);
 	if (!IS_ERR(uart->clk) && uart->clk) clk_disable_unprepare(uart->clk);
 	if (uart->dev) pinctrl_pm_select_sleep_state(&uart->dev->dev);
 	release_and_free_resource(uart->res_base);
+	for (i = 0; i < SNDRV_SERIAL_MAX_OUTS; i++)
+		kfree(uart->tx_port[i]);
+	kfree(uart->tx_buff);
 	kfree(uart);
 	return 0;
 };
@@ -872,8 +2888,107 @@ static int snd_uart_pl011_dev_free(struct snd_device *device)
 	return snd_uart_pl011_free(uart);
 }
 
+static void snd_uart_pl011_proc_hist(struct snd_info_buffer *buffer,
+				     const char *name, unsigned long *hist)
+{
+	int i;
+
+	snd_iprintf(buffer, "%s:\n", name);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (i == HIST_BUCKETS - 1)
+			snd_iprintf(buffer, "  >= %6lu us: %lu\n",
+				    1UL << (i - 1), hist[i]);
+		else
+			snd_iprintf(buffer, "  <  %6lu us: %lu\n",
+				    1UL << i, hist[i]);
+	}
+}
+
+static void snd_uart_pl011_proc_read(struct snd_info_entry *entry,
+				     struct snd_info_buffer *buffer)
+{
+	struct snd_uart_pl011 *uart = entry->private_data;
+	struct snd_uart_pl011_port *port;
+	unsigned long sent = uart->switch_bytes;
+	unsigned long unbatched = uart->switch_bytes_unbatched;
+	unsigned long tx_bytes, queue_full, drops, flags;
+	int i;
+
+	snd_iprintf(buffer, "PL011 at 0x%lx, irq %d\n",
+		    uart->mapbase, uart->irq);
+	snd_iprintf(buffer, "TX quantum: %d\n", uart->tx_quantum);
+	snd_iprintf(buffer, "Part change bytes sent: %lu\n", sent);
+	snd_iprintf(buffer, "Part change bytes avoided: %lu\n",
+		    unbatched > sent ? unbatched - sent : 0);
+	snd_iprintf(buffer, "Running status: %s, %lu bytes saved\n",
+		    uart->running_status ? "on" : "off",
+		    uart->running_status_saved);
+	snd_iprintf(buffer, "Realtime bytes sent ahead: %lu\n",
+		    uart->rt_bytes);
+	if (uart->rmidi_tstamp)
+		snd_iprintf(buffer, "RX timestamps: device %d, %d open, %lu frames dropped\n",
+			    uart->rmidi_tstamp->device, uart->rx_tstamp,
+			    uart->rx_frames_dropped);
+	else
+		snd_iprintf(buffer, "RX timestamps: off\n");
+	snd_iprintf(buffer, "Scheduled output: %s, %lu events sent\n",
+		    uart->tx_sched ? "on" : "off", uart->sched_events);
+	snd_iprintf(buffer, "TX bytes: %lu\n", uart->tx_bytes);
+	snd_iprintf(buffer, "RX FIFO overruns: %lu\n", uart->rx_overruns);
+	snd_iprintf(buffer, "RX buffer overruns: %lu\n",
+		    uart->rx_ring_overruns);
+	snd_iprintf(buffer, "Timer fires: %lu, CTS timeouts: %lu\n",
+		    uart->timer_fires, uart->cts_timeouts);
+	snd_iprintf(buffer, "FIFO mode: %s, RX level %d, TX level %d bytes\n",
+		    fifo_mode_names[uart->fifo_mode],
+		    snd_uart_pl011_rx_levels[uart->rx_level].bytes,
+		    snd_uart_pl011_tx_level(uart));
+	for (i = 0; i < SNDRV_SERIAL_FIFO_MODES; i++) {
+		if (!uart->mode_irqs[i])
+			continue;
+		snd_iprintf(buffer,
+			    "FIFO %s: %lu IRQs, %lu bytes, %lu IRQs per 1000 bytes\n",
+			    fifo_mode_names[i], uart->mode_irqs[i],
+			    uart->mode_bytes[i],
+			    uart->mode_bytes[i] ? uart->mode_irqs[i] * 1000 /
+						  uart->mode_bytes[i] : 0);
+	}
+
+	for (i = 0; i < SNDRV_SERIAL_MAX_OUTS; i++) {
+		/* the port goes when its output is closed */
+		spin_lock_irqsave(&uart->open_lock, flags);
+		port = uart->tx_port[i];
+		if (port) {
+			tx_bytes = port->tx_bytes;
+			queue_full = port->queue_full;
+			drops = port->drops;
+		}
+		spin_unlock_irqrestore(&uart->open_lock, flags);
+		if (!port)
+			continue;
+		snd_iprintf(buffer,
+			    "Output %d: %lu bytes, queue full %lu, dropped %lu\n",
+			    i + 1, tx_bytes, queue_full, drops);
+		if (uart->adaptive_throttle)
+			snd_iprintf(buffer, "Output %d: drains in %u us/byte\n",
+				    i + 1, uart->drain_ns[i] / 1000);
+	}
+	for (i = 0; i < SNDRV_SERIAL_MAX_INS; i++)
+		if (uart->rx_bytes[i])
+			snd_iprintf(buffer, "Input %d: %lu bytes\n",
+				    i + 1, uart->rx_bytes[i]);
+
+	snd_uart_pl011_proc_hist(buffer, "Queue to FIFO latency",
+				 uart->latency_hist);
+	snd_uart_pl011_proc_hist(buffer, "IRQ service time",
+				 uart->irq_hist);
+}
+
 static int snd_uart_pl011_create(struct snd_card *card,
 				struct amba_device *devptr,
+				int device,
 				unsigned int speed,
 				int adaptor,
 				int droponfull,
@@ -882,13 +2997,22 @@ static int snd_uart_pl011_create(struct snd_card *card,
 				int dynamic_throttle,
 				int flow_control,
 				int fifo_limit,
+				int use_dma,
+				int tx_quantum,
+				int running_status,
+				int threaded_irq,
+				int tx_sched,
+				int adaptive_throttle,
+				int fifo_mode,
 				struct snd_uart_pl011 **ruart)
 {
 	static struct snd_device_ops ops = {
 		.dev_free =	snd_uart_pl011_dev_free,
 	};
 	struct snd_uart_pl011 *uart;
-	int err;
+	struct snd_info_entry *entry;
+	char name[16];
+	int i, err;
 	void __iomem *membase;
 
 
@@ -924,21 +3048,42 @@ static int snd_uart_pl011_create(struct snd_card *card,
 
 	uart->adaptor = adaptor;
 	uart->card = card;
+	uart->device = device;
+	uart->current_output = CUR_OUTPUT_INIT;
 	spin_lock_init(&uart->open_lock);
+	spin_lock_init(&uart->fill_lock);
+	tasklet_init(&uart->fill_tasklet, snd_uart_pl011_fill_tasklet,
+		     (unsigned long)uart);
 	uart->membase = membase;
 	uart->mapbase = devptr->res.start;
 	uart->drop_on_full = droponfull;
 	uart->throttle_tx = throttle_tx;
 	uart->throttle_delay = ns_to_ktime(throttle_delay * 1000);
+	uart->fixed_delay = uart->throttle_delay;
 	uart->dynamic_throttle = dynamic_throttle;
+	uart->adaptive_throttle = adaptive_throttle;
+	for (i = 0; i < SNDRV_SERIAL_MAX_OUTS; i++)
+		uart->drain_ns[i] = ADAPT_INIT_NS;
 	uart->flow_control = flow_control;
 	uart->fifo_limit = fifo_limit;
+	uart->fifo_mode = fifo_mode;
 	uart->speed = speed;
+	uart->new_speed = speed;
+	uart->new_flow_control = flow_control;
 	uart->prev_out = -1;
+	uart->enq_prev_out = -1;
+	uart->tx_quantum = tx_quantum;
+	uart->running_status = running_status;
 	memset(uart->prev_status, 0x80,
 			sizeof(unsigned char) * SNDRV_SERIAL_MAX_OUTS);
 	hrtimer_init(&uart->buffer_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
         uart->buffer_timer.function = snd_uart_pl011_buffer_timer;
+	uart->threaded_irq = threaded_irq;
+	hrtimer_init(&uart->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	uart->poll_timer.function = snd_uart_pl011_poll_timer;
+	uart->tx_sched = tx_sched;
+	hrtimer_init(&uart->sched_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	uart->sched_timer.function = snd_uart_pl011_sched_timer;
 
 	if (snd_uart_pl011_detect(uart) == 0) {
 		snd_printk(KERN_ERR "no UART detected\n");
@@ -946,8 +3091,15 @@ static int snd_uart_pl011_create(struct snd_card *card,
 		return -ENODEV;
 	}
 
-	if (request_irq(devptr->irq[0], snd_uart_pl011_interrupt,
-				0, "Serial MIDI", uart)) {
+	if (uart->threaded_irq)
+		err = request_threaded_irq(devptr->irq[0],
+					   snd_uart_pl011_hard_interrupt,
+					   snd_uart_pl011_irq_thread,
+					   IRQF_ONESHOT, "Serial MIDI", uart);
+	else
+		err = request_irq(devptr->irq[0], snd_uart_pl011_interrupt,
+				  0, "Serial MIDI", uart);
+	if (err) {
 		snd_printk(KERN_ERR "unable to request IRQ\n");
 		snd_uart_pl011_free(uart);
 		return -ENODEV;
@@ -956,6 +3108,9 @@ static int snd_uart_pl011_create(struct snd_card *card,
 
 	init_waitqueue_head(&uart->drain_wait);
 
+	if (use_dma)
+		snd_uart_pl011_dma_probe(uart, &devptr->dev);
+
 	snd_printk(KERN_INFO "Detected PL011 at 0x%lx using irq: %i\n",
 			uart->mapbase, uart->irq);
 
@@ -965,6 +3120,15 @@ static int snd_uart_pl011_create(struct snd_card *card,
 		return err;
 	}
 
+	if (device)
+		sprintf(name, "pl011-%d", device);
+	else
+		strcpy(name, "pl011");
+	if (!snd_card_proc_new(card, name, &entry)) {
+		snd_info_set_text_ops(entry, uart, snd_uart_pl011_proc_read);
+		uart->proc_entry = entry;
+	}
+
 	/* FIXME: CTS/RTS pins */
 	uart->dev = devptr;
 	pinctrl_pm_select_default_state(&uart->dev->dev);
@@ -989,6 +3153,213 @@ static int snd_uart_pl011_create(struct snd_card *card,
 	return 0;
 }
 
+/*
+ * sysfs controls, in the "midi" directory of the AMBA device. The
+ * throttle and FIFO limit take effect with the next write; speed and
+ * flow control wait until the output is quiescent.
+ */
+static ssize_t speed_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct snd_uart_pl011 *uart = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", uart->new_speed);
+}
+
+static ssize_t speed_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct snd_uart_pl011 *uart = dev_get_drvdata(dev);
+	unsigned long flags;
+	unsigned int val;
+	int err;
+
+	err = kstrtouint(buf, 0, &val);
+	if (err)
+		return err;
+	/* The divisor needs 16 clocks per bit */
+	if (val == 0 || val > clk_get_rate(uart->clk) / 16)
+		return -EINVAL;
+
+	spin_lock_irqsave(&uart->open_lock, flags);
+	uart->new_speed = val;
+	uart->reconfig = 1;
+	snd_uart_pl011_apply_config(uart);
+	spin_unlock_irqrestore(&uart->open_lock, flags);
+	return count;
+}
+
+static ssize_t flow_control_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct snd_uart_pl011 *uart = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", uart->new_flow_control);
+}
+
+static ssize_t flow_control_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct snd_uart_pl011 *uart = dev_get_drvdata(dev);
+	unsigned long flags;
+	int val, err;
+
+	err = kstrtoint(buf, 0, &val);
+	if (err)
+		return err;
+
+	spin_lock_irqsave(&uart->open_lock, flags);
+	uart->new_flow_control = !!val;
+	uart->reconfig = 1;
+	snd_uart_pl011_apply_config(uart);
+	spin_unlock_irqrestore(&uart->open_lock, flags);
+	return count;
+}
+
+static ssize_t throttle_delay_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct snd_uart_pl011 *uart = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lld\n", ktime_to_us(uart->fixed_delay));
+}
+
+static ssize_t throttle_delay_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct snd_uart_pl011 *uart = dev_get_drvdata(dev);
+	unsigned long flags;
+	unsigned int val;
+	int err;
+
+	err = kstrtouint(buf, 0, &val);
+	if (err)
+		return err;
+
+	spin_lock_irqsave(&uart->open_lock, flags);
+	uart->fixed_delay = ns_to_ktime((u64)val * 1000);
+	if (!uart->dynamic_throttle && !uart->adaptive_throttle)
+		uart->throttle_delay = uart->fixed_delay;
+	spin_unlock_irqrestore(&uart->open_lock, flags);
+	return count;
+}
+
+static ssize_t dynamic_throttle_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct snd_uart_pl011 *uart = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", uart->dynamic_throttle);
+}
+
+static ssize_t dynamic_throttle_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct snd_uart_pl011 *uart = dev_get_drvdata(dev);
+	unsigned long flags;
+	int val, err;
+
+	err = kstrtoint(buf, 0, &val);
+	if (err)
+		return err;
+	if (val < 0)
+		return -EINVAL;
+
+	spin_lock_irqsave(&uart->open_lock, flags);
+	uart->dynamic_throttle = val;
+	/* back to the fixed delay when turned off */
+	if (!val && !uart->adaptive_throttle)
+		uart->throttle_delay = uart->fixed_delay;
+	spin_unlock_irqrestore(&uart->open_lock, flags);
+	return count;
+}
+
+static ssize_t fifo_limit_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct snd_uart_pl011 *uart = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", uart->fifo_limit);
+}
+
+static ssize_t fifo_limit_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct snd_uart_pl011 *uart = dev_get_drvdata(dev);
+	unsigned long flags;
+	int val, err;
+
+	err = kstrtoint(buf, 0, &val);
+	if (err)
+		return err;
+	if (val < 1 || val > SNDRV_SERIAL_DEFAULT_FIFO)
+		return -EINVAL;
+
+	spin_lock_irqsave(&uart->open_lock, flags);
+	uart->fifo_limit = val;
+	/* the TX level follows the limit */
+	if (uart->filemode != SERIAL_MODE_NOT_OPENED)
+		snd_uart_pl011_set_ifls(uart);
+	spin_unlock_irqrestore(&uart->open_lock, flags);
+	return count;
+}
+
+static ssize_t fifo_mode_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct snd_uart_pl011 *uart = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%s\n", fifo_mode_names[uart->fifo_mode]);
+}
+
+static ssize_t fifo_mode_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct snd_uart_pl011 *uart = dev_get_drvdata(dev);
+	unsigned long flags;
+	int val;
+
+	for (val = 0; val < SNDRV_SERIAL_FIFO_MODES; val++)
+		if (sysfs_streq(buf, fifo_mode_names[val]))
+			break;
+	if (val == SNDRV_SERIAL_FIFO_MODES)
+		return -EINVAL;
+
+	spin_lock_irqsave(&uart->open_lock, flags);
+	uart->fifo_mode = val;
+	if (uart->filemode != SERIAL_MODE_NOT_OPENED)
+		snd_uart_pl011_set_ifls(uart);
+	spin_unlock_irqrestore(&uart->open_lock, flags);
+	return count;
+}
+
+static DEVICE_ATTR_RW(speed);
+static DEVICE_ATTR_RW(flow_control);
+static DEVICE_ATTR_RW(throttle_delay);
+static DEVICE_ATTR_RW(dynamic_throttle);
+static DEVICE_ATTR_RW(fifo_limit);
+static DEVICE_ATTR_RW(fifo_mode);
+
+static struct attribute *snd_uart_pl011_attrs[] = {
+	&dev_attr_speed.attr,
+	&dev_attr_flow_control.attr,
+	&dev_attr_throttle_delay.attr,
+	&dev_attr_dynamic_throttle.attr,
+	&dev_attr_fifo_limit.attr,
+	&dev_attr_fifo_mode.attr,
+	NULL,
+};
+
+static const struct attribute_group snd_uart_pl011_attr_group = {
+	.name = "midi",
+	.attrs = snd_uart_pl011_attrs,
+};
+
 static void snd_uart_pl011_substreams(struct snd_rawmidi_str *stream)
 {
 	struct snd_rawmidi_substream *substream;
@@ -1013,7 +3384,10 @@ static int snd_uart_pl011_rmidi(struct snd_uart_pl011 *uart, int device,
 			    &snd_uart_pl011_input);
 	snd_rawmidi_set_ops(rrawmidi, SNDRV_RAWMIDI_STREAM_OUTPUT,
 			    &snd_uart_pl011_output);
-	strcpy(rrawmidi->name, "Serial MIDI");
+	if (device)
+		sprintf(rrawmidi->name, "Serial MIDI %d", device + 1);
+	else
+		strcpy(rrawmidi->name, "Serial MIDI");
 	snd_uart_pl011_substreams(&rrawmidi->streams[SNDRV_RAWMIDI_STREAM_OUTPUT]);
 	snd_uart_pl011_substreams(&rrawmidi->streams[SNDRV_RAWMIDI_STREAM_INPUT]);
 	rrawmidi->info_flags = SNDRV_RAWMIDI_INFO_OUTPUT |
@@ -1025,95 +3399,283 @@ static int snd_uart_pl011_rmidi(struct snd_uart_pl011 *uart, int device,
 	return 0;
 }
 
+/* snd-seq-midi leaves alone a device with a dev_register of its own;
+ * it would read the frames as MIDI */
+static int snd_uart_pl011_tstamp_register(struct snd_rawmidi *rmidi)
+{
+	return 0;
+}
+
+static struct snd_rawmidi_global_ops snd_uart_pl011_tstamp_ops = {
+	.dev_register = snd_uart_pl011_tstamp_register,
+};
+
+/* The rx_tstamp device: the inputs again, read as frames stamped with
+ * the arrival of each message. Rawmidi on these kernels has no framing
+ * mode of its own, so the frames are the only thing read from it. */
+static int snd_uart_pl011_rmidi_tstamp(struct snd_uart_pl011 *uart,
+				       int device, int ins)
+{
+	struct snd_rawmidi *rrawmidi;
+	int err;
+
+	err = snd_rawmidi_new(uart->card, "UART Serial MIDI TS",
+			      device + SNDRV_SERIAL_TSTAMP_DEV, 0, ins,
+			      &rrawmidi);
+	if (err < 0)
+		return err;
+	snd_rawmidi_set_ops(rrawmidi, SNDRV_RAWMIDI_STREAM_INPUT,
+			    &snd_uart_pl011_input);
+	sprintf(rrawmidi->name, "Serial MIDI %d Timestamps", device + 1);
+	snd_uart_pl011_substreams(&rrawmidi->streams[SNDRV_RAWMIDI_STREAM_INPUT]);
+	rrawmidi->info_flags = SNDRV_RAWMIDI_INFO_INPUT;
+	rrawmidi->ops = &snd_uart_pl011_tstamp_ops;
+	rrawmidi->private_data = uart;
+	uart->rmidi_tstamp = rrawmidi;
+	return 0;
+}
+
+/* All UARTs share one card, each with a rawmidi device of its own */
+static DEFINE_MUTEX(snd_serial_mutex);
+static struct snd_card *snd_serial_card;
+static unsigned long snd_serial_devices;	/* device numbers in use */
+static struct snd_uart_pl011 *snd_serial_uarts[SNDRV_SERIAL_MAX_UARTS];
+
+/* The card is named after the first UART still bound */
+static void snd_serial_longname(struct snd_card *card,
+				struct snd_uart_pl011 *uart)
+{
+	sprintf(card->longname, "%s [%s] at %#lx, irq %d",
+		card->shortname,
+		adaptor_names[uart->adaptor],
+		(unsigned long) uart->membase,
+		uart->irq);
+}
+
+/* Take one UART off the shared card, leaving the others running */
+static void snd_serial_detach(struct snd_card *card,
+			      struct snd_uart_pl011 *uart)
+{
+	if (uart->rmidi_tstamp)
+		snd_device_free(card, uart->rmidi_tstamp);
+	if (uart->rmidi)
+		snd_device_free(card, uart->rmidi);
+	snd_info_free_entry(uart->proc_entry);
+	uart->proc_entry = NULL;
+	snd_device_free(card, uart);
+}
+
 static int snd_serial_probe(struct amba_device *devptr,
 		const struct amba_id *id)
 {
+	struct device_node *np = devptr->dev.of_node;
 	struct snd_card *card;
-	struct snd_uart_pl011 *uart;
+	struct snd_uart_pl011 *uart = NULL;
+	u32 dev_speed = speed;
+	u32 dev_adaptor = adaptor;
+	u32 dev_outs = outs;
+	u32 dev_ins = ins;
+	u32 dev_fifo_limit = fifo_limit;
+	u32 dev_quantum = tx_quantum;
+	int dev_flow_control = flow_control;
+	int dev_droponfull = droponfull;
+	int dev_running_status = running_status;
+	int dev_adaptive_throttle = adaptive_throttle;
+	u32 dev_fifo_mode = fifo_mode;
+	int max_uarts;
+	int device;
 	int err;
 
-	switch (adaptor) {
+	/* The module parameters are defaults, devicetree can set each
+	 * UART up differently */
+	if (np) {
+		of_property_read_u32(np, "current-speed", &dev_speed);
+		of_property_read_u32(np, "midi-adaptor", &dev_adaptor);
+		of_property_read_u32(np, "midi-outs", &dev_outs);
+		of_property_read_u32(np, "midi-ins", &dev_ins);
+		of_property_read_u32(np, "midi-fifo-limit", &dev_fifo_limit);
+		of_property_read_u32(np, "midi-tx-quantum", &dev_quantum);
+		of_property_read_u32(np, "midi-fifo-mode", &dev_fifo_mode);
+		if (of_property_read_bool(np, "uart-has-rtscts"))
+			dev_flow_control = 1;
+		if (of_property_read_bool(np, "midi-drop-on-full"))
+			dev_droponfull = 1;
+		if (of_property_read_bool(np, "midi-running-status"))
+			dev_running_status = 1;
+		if (of_property_read_bool(np, "midi-adaptive-throttle"))
+			dev_adaptive_throttle = 1;
+	}
+
+	switch (dev_adaptor) {
 	case SNDRV_SERIAL_SOUNDCANVAS:
-		ins = 1;
+		dev_ins = 1;
 		break;
 	case SNDRV_SERIAL_MS124T:
 	case SNDRV_SERIAL_MS124W_SA:
-		outs = 1;
-		ins = 1;
+		dev_outs = 1;
+		dev_ins = 1;
 		break;
 	case SNDRV_SERIAL_MS124W_MB:
-		outs = 16;
-		ins = 1;
+		dev_outs = 16;
+		dev_ins = 1;
 		break;
 	case SNDRV_SERIAL_GENERIC:
 		break;
 	default:
 		snd_printk(KERN_ERR
 			   "Adaptor type is out of range 0-%d (%d)\n",
-			   SNDRV_SERIAL_MAX_ADAPTOR, adaptor);
+			   SNDRV_SERIAL_MAX_ADAPTOR, dev_adaptor);
 		return -ENODEV;
 	}
 
-	if (outs < 1 || outs > SNDRV_SERIAL_MAX_OUTS) {
+	if (dev_outs < 1 || dev_outs > SNDRV_SERIAL_MAX_OUTS) {
 		snd_printk(KERN_ERR
 			   "Count of outputs is out of range 1-%d (%d)\n",
-			   SNDRV_SERIAL_MAX_OUTS, outs);
+			   SNDRV_SERIAL_MAX_OUTS, dev_outs);
 		return -ENODEV;
 	}
 
-	if (ins < 1 || ins > SNDRV_SERIAL_MAX_INS) {
+	if (dev_ins < 1 || dev_ins > SNDRV_SERIAL_MAX_INS) {
 		snd_printk(KERN_ERR
 			   "Count of inputs is out of range 1-%d (%d)\n",
-			   SNDRV_SERIAL_MAX_INS, ins);
+			   SNDRV_SERIAL_MAX_INS, dev_ins);
 		return -ENODEV;
 	}
 
-	err  = snd_card_new(&devptr->dev, -1, NULL, THIS_MODULE,
-			    0, &card);
-	if (err < 0)
-		return err;
+	if (dev_quantum < 1 || dev_quantum > PORT_BUFF_SIZE) {
+		snd_printk(KERN_ERR
+			   "TX quantum is out of range 1-%d (%d)\n",
+			   PORT_BUFF_SIZE, dev_quantum);
+		return -ENODEV;
+	}
+
+	if (dev_fifo_mode >= SNDRV_SERIAL_FIFO_MODES) {
+		snd_printk(KERN_ERR
+			   "FIFO mode is out of range 0-%d (%d)\n",
+			   SNDRV_SERIAL_FIFO_MODES - 1, dev_fifo_mode);
+		return -ENODEV;
+	}
+
+	if (dev_speed == 0) {
+		snd_printk(KERN_ERR "Speed must not be 0\n");
+		return -ENODEV;
+	}
+
+	/* CTS after a timed write is what the drain rate is learnt from */
+	if (dev_adaptive_throttle && (!throttle_tx || !dev_flow_control)) {
+		snd_printk(KERN_WARNING
+			   "adaptive_throttle needs throttle_tx and flow_control, ignored\n");
+		dev_adaptive_throttle = 0;
+	}
+
+	mutex_lock(&snd_serial_mutex);
+
+	/* with rx_tstamp the upper half of the devices are the
+	 * timestamped inputs */
+	max_uarts = rx_tstamp ? SNDRV_SERIAL_TSTAMP_DEV :
+				SNDRV_SERIAL_MAX_UARTS;
+	device = find_first_zero_bit(&snd_serial_devices, max_uarts);
+	if (device >= max_uarts) {
+		snd_printk(KERN_ERR "Too many UARTs, at most %d\n",
+			   max_uarts);
+		err = -ENODEV;
+		goto _unlock;
+	}
 
-	strcpy(card->driver, "Serial");
-	strcpy(card->shortname, "Serial MIDI (PL011)");
+	/* The card outlives any one UART, so it hangs off none of them
+	 * rather than moving between parents as they are unbound */
+	card = snd_serial_card;
+	if (!card) {
+		err  = snd_card_new(NULL, -1, NULL, THIS_MODULE,
+				    0, &card);
+		if (err < 0)
+			goto _unlock;
+
+		strcpy(card->driver, "Serial");
+		strcpy(card->shortname, "Serial MIDI (PL011)");
+	}
 
 	if ((err = snd_uart_pl011_create(card, devptr,
-					speed,
-					adaptor,
-					droponfull,
+					device,
+					dev_speed,
+					dev_adaptor,
+					dev_droponfull,
 					throttle_tx,
 					throttle_delay,
 					dynamic_throttle,
-					flow_control,
-					fifo_limit,
-					&uart)) < 0)
+					dev_flow_control,
+					dev_fifo_limit,
+					use_dma,
+					dev_quantum,
+					dev_running_status,
+					threaded_irq,
+					tx_sched,
+					dev_adaptive_throttle,
+					dev_fifo_mode,
+					&uart)) < 0) {
+		uart = NULL;
 		goto _err;
+	}
 
-	err = snd_uart_pl011_rmidi(uart, 0, outs, ins, &uart->rmidi);
+	err = snd_uart_pl011_rmidi(uart, device, dev_outs, dev_ins,
+				   &uart->rmidi);
 	if (err < 0)
 		goto _err;
+	if (rx_tstamp) {
+		err = snd_uart_pl011_rmidi_tstamp(uart, device, dev_ins);
+		if (err < 0)
+			goto _err;
+	}
 
-	sprintf(card->longname, "%s [%s] at %#lx, irq %d",
-		card->shortname,
-		adaptor_names[uart->adaptor],
-		(unsigned long) uart->membase,
-		uart->irq);
-
-	snd_card_set_dev(card, &devptr->dev);
+	if (!snd_serial_card)
+		snd_serial_longname(card, uart);
 
+	/* Registers the new devices when the card is already up */
 	if ((err = snd_card_register(card)) < 0)
 		goto _err;
 
-	amba_set_drvdata(devptr, card);
+	amba_set_drvdata(devptr, uart);
+	err = sysfs_create_group(&devptr->dev.kobj,
+				 &snd_uart_pl011_attr_group);
+	if (err < 0)
+		goto _err;
+
+	snd_serial_card = card;
+	snd_serial_uarts[device] = uart;
+	set_bit(device, &snd_serial_devices);
+	mutex_unlock(&snd_serial_mutex);
 	return 0;
 
  _err:
-	snd_card_free(card);
+	if (card != snd_serial_card)
+		snd_card_free(card);
+	else if (uart)
+		snd_serial_detach(card, uart);
+ _unlock:
+	mutex_unlock(&snd_serial_mutex);
 	return err;
 }
 
 static int snd_serial_remove(struct amba_device *devptr)
 {
-	snd_card_free(amba_get_drvdata(devptr));
+	struct snd_uart_pl011 *uart = amba_get_drvdata(devptr);
+	struct snd_card *card;
+
+	sysfs_remove_group(&devptr->dev.kobj, &snd_uart_pl011_attr_group);
+	mutex_lock(&snd_serial_mutex);
+	card = snd_serial_card;
+	clear_bit(uart->device, &snd_serial_devices);
+	snd_serial_uarts[uart->device] = NULL;
+	if (snd_serial_devices) {
+		snd_serial_detach(card, uart);
+		snd_serial_longname(card, snd_serial_uarts[
+			find_first_bit(&snd_serial_devices,
+				       SNDRV_SERIAL_MAX_UARTS)]);
+	} else {
+		snd_card_free(snd_serial_card);
+		snd_serial_card = NULL;
+	}
+	mutex_unlock(&snd_serial_mutex);
 	return 0;
 }
 
@@ -0,0 +1,112 @@
+/*
+ * The driver, built against the shim. Included rather than linked so
+ * that the module parameters and the driver state can be reached.
+ */
+#include "../serial-pl011.c"
+
+#include "sim.h"
+
+#define HARNESS_PARAM(name, type) { #name, type, &name }
+
+static const struct {
+	const char *name;
+	char type;	/* 'i' int, 'b' bool */
+	void *var;
+} harness_params[] = {
+	HARNESS_PARAM(speed, 'i'),
+	HARNESS_PARAM(outs, 'i'),
+	HARNESS_PARAM(ins, 'i'),
+	HARNESS_PARAM(adaptor, 'i'),
+	HARNESS_PARAM(droponfull, 'b'),
+	HARNESS_PARAM(throttle_tx, 'b'),
+	HARNESS_PARAM(throttle_delay, 'i'),
+	HARNESS_PARAM(dynamic_throttle, 'i'),
+	HARNESS_PARAM(fifo_limit, 'i'),
+	HARNESS_PARAM(flow_control, 'b'),
+	HARNESS_PARAM(use_dma, 'b'),
+	HARNESS_PARAM(tx_quantum, 'i'),
+	HARNESS_PARAM(running_status, 'b'),
+	HARNESS_PARAM(threaded_irq, 'b'),
+	HARNESS_PARAM(tx_sched, 'b'),
+	HARNESS_PARAM(rx_tstamp, 'b'),
+	HARNESS_PARAM(adaptive_throttle, 'b'),
+	HARNESS_PARAM(fifo_mode, 'i'),
+};
+
+/* Set a module parameter, before harness_init */
+int harness_set_param(const char *name, const char *value)
+{
+	char *end;
+	long val;
+	int i;
+
+	val = strtol(value, &end, 0);
+	if (*end)
+		return -EINVAL;
+	for (i = 0; i < ARRAY_SIZE(harness_params); i++) {
+		if (strcmp(harness_params[i].name, name))
+			continue;
+		if (harness_params[i].type == 'b')
+			*(bool *)harness_params[i].var = !!val;
+		else
+			*(int *)harness_params[i].var = val;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+/* Load the module and bind the first sim_cfg.uarts UARTs */
+int harness_init(void)
+{
+	int err = shim_module_init();
+	int i;
+
+	for (i = 0; !err && i < sim_cfg.uarts; i++)
+		err = shim_bind(i);
+	return err;
+}
+
+/* Unloading unbinds them all */
+void harness_exit(void)
+{
+	shim_module_exit();
+}
+
+static struct snd_uart_pl011 *harness_uart(int n)
+{
+	return shim_drvdata(n);
+}
+
+/* How the outputs of UART n share the wire */
+enum harness_wire harness_wire(int n)
+{
+	struct snd_uart_pl011 *uart = harness_uart(n);
+
+	switch (uart ? uart->adaptor : SNDRV_SERIAL_GENERIC) {
+	case SNDRV_SERIAL_SOUNDCANVAS:
+	case SNDRV_SERIAL_GENERIC:
+		return HARNESS_WIRE_F5;
+	case SNDRV_SERIAL_MS124W_MB:
+		return HARNESS_WIRE_MB;
+	default:
+		return HARNESS_WIRE_PLAIN;
+	}
+}
+
+/* Only the generic interface takes F5 nn on input */
+int harness_in_wire_f5(int n)
+{
+	struct snd_uart_pl011 *uart = harness_uart(n);
+
+	return !uart || uart->adaptor == SNDRV_SERIAL_GENERIC;
+}
+
+/* droponfull losses of an open output */
+unsigned long harness_port_drops(int n, int port)
+{
+	struct snd_uart_pl011 *uart = harness_uart(n);
+
+	if (!uart || !uart->tx_port[port])
+		return 0;
+	return uart->tx_port[port]->drops;
+}
@@ -0,0 +1,289 @@
+/*
+ * PL011 UART model, see pl011_model.h
+ */
+#include <string.h>
+
+#include <linux/amba/serial.h>
+
+#include "pl011_model.h"
+
+/* IFLS selects 1/8, 1/4, 1/2, 3/4 or 7/8 of the FIFO */
+static const int pl011_levels[8] = { 2, 4, 8, 12, 14, 14, 14, 14 };
+
+static int pl011_depth(const struct pl011_model *m)
+{
+	return m->lcrh & UART01x_LCRH_FEN ? PL011_FIFO_DEPTH : 1;
+}
+
+/* TX interrupt once the FIFO has gone down to this many bytes */
+static int pl011_tx_level(const struct pl011_model *m)
+{
+	if (!(m->lcrh & UART01x_LCRH_FEN))
+		return 0;
+	return pl011_levels[m->ifls & 7];
+}
+
+/* RX interrupt once the FIFO holds this many */
+static int pl011_rx_level(const struct pl011_model *m)
+{
+	if (!(m->lcrh & UART01x_LCRH_FEN))
+		return 1;
+	return pl011_levels[(m->ifls >> 3) & 7];
+}
+
+static int pl011_bits(const struct pl011_model *m)
+{
+	return 5 + ((m->lcrh >> 5) & 3);
+}
+
+static int64_t pl011_bit_ns(const struct pl011_model *m)
+{
+	/* baud = UARTCLK / (16 * div64 / 64) */
+	if (!m->div64 || !m->clk)
+		return 0;
+	return (int64_t)m->div64 * 1000000000LL / (4LL * m->clk);
+}
+
+int64_t pl011_char_ns(const struct pl011_model *m)
+{
+	int bits = 1 + pl011_bits(m) + 1;
+
+	if (m->lcrh & UART01x_LCRH_STP2)
+		bits++;
+	if (m->lcrh & UART01x_LCRH_PEN)
+		bits++;
+	return bits * pl011_bit_ns(m);
+}
+
+void pl011_init(struct pl011_model *m, unsigned long clk,
+		void (*tx_out)(void *, int64_t, uint8_t), void *ctx)
+{
+	memset(m, 0, sizeof(*m));
+	m->clk = clk;
+	m->cr = UART011_CR_RXE | UART011_CR_TXE;	/* reset value */
+	m->ifls = UART011_IFLS_RX4_8 | UART011_IFLS_TX4_8;
+	m->rt_deadline = PL011_NEVER;
+	m->cts = 1;
+	m->tx_out = tx_out;
+	m->ctx = ctx;
+}
+
+static int pl011_enabled(const struct pl011_model *m, uint16_t bit)
+{
+	return (m->cr & UART01x_CR_UARTEN) && (m->cr & bit);
+}
+
+static void pl011_rx_push(struct pl011_model *m, int64_t t, uint8_t byte)
+{
+	if (!pl011_enabled(m, UART011_CR_RXE)) {
+		m->rx_disabled++;
+		return;
+	}
+	if (m->rx_count == pl011_depth(m)) {
+		m->rx_overruns++;
+		m->ris |= UART011_OEIS;
+		return;
+	}
+	m->rxf[(m->rx_head + m->rx_count) % PL011_FIFO_DEPTH] = byte;
+	m->rx_count++;
+	m->rx_chars++;
+	if (m->rx_count >= pl011_rx_level(m))
+		m->ris |= UART011_RXIS;
+	m->rt_deadline = t + 32 * pl011_bit_ns(m);
+}
+
+/* Start the next byte at t, if there is one and we may */
+static void pl011_tx_start(struct pl011_model *m, int64_t t)
+{
+	if (m->tx_shifting || !m->tx_count ||
+	    !pl011_enabled(m, UART011_CR_TXE) || !pl011_char_ns(m))
+		return;
+	if ((m->cr & UART011_CR_CTSEN) && !m->cts) {
+		if (!m->tx_stalled)
+			m->tx_cts_stalls++;
+		m->tx_stalled = 1;
+		return;
+	}
+	m->tx_stalled = 0;
+
+	m->tx_fifo_sum += m->tx_count;
+	m->tx_byte = m->txf[m->tx_head];
+	m->tx_head = (m->tx_head + 1) % PL011_FIFO_DEPTH;
+	m->tx_count--;
+	/* the level is passed on the way down */
+	if (m->tx_count == pl011_tx_level(m))
+		m->ris |= UART011_TXIS;
+	m->tx_shifting = 1;
+	m->tx_done = t + pl011_char_ns(m);
+	m->tx_busy_ns += pl011_char_ns(m);
+}
+
+void pl011_sync(struct pl011_model *m, int64_t now)
+{
+	int64_t t;
+
+	if (now < m->now)
+		now = m->now;
+
+	for (;;) {
+		t = PL011_NEVER;
+		if (m->tx_shifting)
+			t = m->tx_done;
+		if (m->rt_deadline < t)
+			t = m->rt_deadline;
+		if (t > now)
+			break;
+
+		if (m->tx_shifting && m->tx_done == t) {
+			m->tx_shifting = 0;
+			m->tx_chars++;
+			if (m->cr & UART011_CR_LBE)
+				pl011_rx_push(m, t, m->tx_byte &
+					      ((1 << pl011_bits(m)) - 1));
+			else if (m->tx_out)
+				m->tx_out(m->ctx, t, m->tx_byte);
+			pl011_tx_start(m, t);
+		}
+		if (m->rt_deadline == t) {
+			if (m->rx_count)
+				m->ris |= UART011_RTIS;
+			m->rt_deadline = PL011_NEVER;
+		}
+	}
+	m->now = now;
+}
+
+uint16_t pl011_read(struct pl011_model *m, int64_t now, unsigned int reg)
+{
+	uint16_t val = 0;
+
+	pl011_sync(m, now);
+	switch (reg) {
+	case UART01x_DR:
+		if (!m->rx_count)
+			return 0;
+		val = m->rxf[m->rx_head];
+		m->rx_head = (m->rx_head + 1) % PL011_FIFO_DEPTH;
+		m->rx_count--;
+		if (m->rx_count < pl011_rx_level(m))
+			m->ris &= ~UART011_RXIS;
+		if (!m->rx_count)
+			m->ris &= ~UART011_RTIS;
+		return val;
+	case UART01x_FR:
+		if (m->tx_count == 0)
+			val |= UART011_FR_TXFE;
+		if (m->tx_count == pl011_depth(m))
+			val |= UART01x_FR_TXFF;
+		if (m->rx_count == 0)
+			val |= UART01x_FR_RXFE;
+		if (m->rx_count == pl011_depth(m))
+			val |= UART011_FR_RXFF;
+		if (m->tx_count || m->tx_shifting)
+			val |= UART01x_FR_BUSY;
+		if (m->cts)
+			val |= UART01x_FR_CTS;
+		return val;
+	case UART011_IBRD:
+		return m->ibrd;
+	case UART011_FBRD:
+		return m->fbrd;
+	case UART011_LCRH:
+		return m->lcrh;
+	case UART011_CR:
+		return m->cr;
+	case UART011_IFLS:
+		return m->ifls;
+	case UART011_IMSC:
+		return m->imsc;
+	case UART011_RIS:
+		return m->ris;
+	case UART011_MIS:
+		return m->ris & m->imsc;
+	case UART011_DMACR:
+		return m->dmacr;
+	}
+	return 0;
+}
+
+void pl011_write(struct pl011_model *m, int64_t now, unsigned int reg,
+		 uint16_t val)
+{
+	pl011_sync(m, now);
+	switch (reg) {
+	case UART01x_DR:
+		if (m->tx_count == pl011_depth(m)) {
+			m->tx_overwrites++;
+			return;
+		}
+		m->txf[(m->tx_head + m->tx_count) % PL011_FIFO_DEPTH] = val;
+		m->tx_count++;
+		if (m->tx_count > pl011_tx_level(m))
+			m->ris &= ~UART011_TXIS;
+		pl011_tx_start(m, m->now);
+		return;
+	case UART011_IBRD:
+		m->ibrd = val;
+		return;
+	case UART011_FBRD:
+		m->fbrd = val & 0x3f;
+		return;
+	case UART011_LCRH:
+		m->lcrh = val;
+		m->div64 = m->ibrd * 64 + m->fbrd;
+		return;
+	case UART011_CR:
+		m->cr = val;
+		pl011_tx_start(m, m->now);
+		return;
+	case UART011_IFLS:
+		m->ifls = val & 0x3f;
+		return;
+	case UART011_IMSC:
+		m->imsc = val & 0x7ff;
+		return;
+	case UART011_ICR:
+		m->ris &= ~val;
+		return;
+	case UART011_DMACR:
+		m->dmacr = val & 7;
+		return;
+	}
+}
+
+void pl011_rx_char(struct pl011_model *m, int64_t now, uint8_t byte)
+{
+	pl011_sync(m, now);
+	if (m->cr & UART011_CR_LBE)
+		return;
+	pl011_rx_push(m, m->now, byte);
+}
+
+void pl011_set_cts(struct pl011_model *m, int64_t now, int cts)
+{
+	pl011_sync(m, now);
+	if (m->cts != cts)
+		m->ris |= UART011_CTSMIS;
+	m->cts = cts;
+	pl011_tx_start(m, m->now);
+}
+
+/* With RTSEN the receiver drops RTS at its interrupt level */
+int pl011_rts(const struct pl011_model *m)
+{
+	if (m->cr & UART011_CR_RTSEN)
+		return m->rx_count < pl011_rx_level(m);
+	return !!(m->cr & UART011_CR_RTS);
+}
+
+int pl011_irq_line(const struct pl011_model *m)
+{
+	return (m->ris & m->imsc) != 0;
+}
+
+int64_t pl011_next_event(const struct pl011_model *m)
+{
+	int64_t t = m->tx_shifting ? m->tx_done : PL011_NEVER;
+
+	return m->rt_deadline < t ? m->rt_deadline : t;
+}
@@ -0,0 +1,77 @@
+/*
+ * Cycle-approximate model of an ARM PL011 UART, as far as the MIDI
+ * driver uses it: 16 byte FIFOs (1 byte with FEN clear), character
+ * timing from IBRD/FBRD/LCRH and the UART clock, CTS/RTS with and
+ * without hardware flow control, the IFLS interrupt levels, the receive
+ * timeout and loopback. No DMA, no break, parity or framing errors.
+ *
+ * Time is in nanoseconds and only moves forward: every access first
+ * brings the model up to the time given.
+ */
+#ifndef _PL011_MODEL_H
+#define _PL011_MODEL_H
+
+#include <stdint.h>
+
+#define PL011_FIFO_DEPTH	16
+#define PL011_NEVER		INT64_MAX
+
+struct pl011_model {
+	/* registers */
+	uint16_t cr;
+	uint16_t lcrh;
+	uint16_t ibrd, fbrd;	/* as written */
+	uint16_t ifls;
+	uint16_t imsc;
+	uint16_t ris;
+	uint16_t dmacr;
+	uint32_t div64;		/* divisor in 64ths, latched by LCRH */
+	unsigned long clk;	/* UARTCLK in Hz */
+	int64_t now;
+
+	/* transmit FIFO and shift register */
+	uint8_t txf[PL011_FIFO_DEPTH];
+	int tx_head, tx_count;
+	int tx_shifting;
+	uint8_t tx_byte;
+	int64_t tx_done;	/* when the byte being shifted is out */
+
+	/* receive FIFO and timeout */
+	uint16_t rxf[PL011_FIFO_DEPTH];
+	int rx_head, rx_count;
+	int64_t rt_deadline;	/* 32 bit times after the last byte in */
+
+	int cts;		/* CTS input, 1 = clear to send */
+	int tx_stalled;		/* a byte is waiting for CTS */
+
+	/* a byte is complete on TXD, and when */
+	void (*tx_out)(void *ctx, int64_t t, uint8_t byte);
+	void *ctx;
+
+	/* statistics */
+	unsigned long tx_chars;
+	unsigned long rx_chars;
+	unsigned long rx_overruns;	/* lost, RX FIFO full */
+	unsigned long rx_disabled;	/* lost, receiver off */
+	unsigned long tx_overwrites;	/* DR written with TX FIFO full */
+	unsigned long tx_cts_stalls;	/* waits for CTS before a byte */
+	int64_t tx_busy_ns;		/* TXD carrying a character */
+	unsigned long tx_fifo_sum;	/* FIFO fill at each byte start */
+};
+
+void pl011_init(struct pl011_model *m, unsigned long clk,
+		void (*tx_out)(void *, int64_t, uint8_t), void *ctx);
+void pl011_sync(struct pl011_model *m, int64_t now);
+uint16_t pl011_read(struct pl011_model *m, int64_t now, unsigned int reg);
+void pl011_write(struct pl011_model *m, int64_t now, unsigned int reg,
+		 uint16_t val);
+
+/* A byte from the far end has been received completely at 'now' */
+void pl011_rx_char(struct pl011_model *m, int64_t now, uint8_t byte);
+void pl011_set_cts(struct pl011_model *m, int64_t now, int cts);
+int pl011_rts(const struct pl011_model *m);
+int pl011_irq_line(const struct pl011_model *m);
+int64_t pl011_char_ns(const struct pl011_model *m);
+int64_t pl011_next_event(const struct pl011_model *m);
+
+#endif /* _PL011_MODEL_H */
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Run every workload under each setting, for midicheck.py on the host.
+#
+#   bench.sh [uart] [workload dir]
+#
+# uart is the PL011 that QEMU wires to the host (101f2000.uart on
+# versatilepb). It is taken from the tty driver and the module is
+# loaded again for each setting.
+
+UART=${1:-101f2000.uart}
+DIR=${2:-.}
+BASE="speed=31250 outs=16 adaptor=4"
+
+# label, then module parameters over $BASE
+SETTINGS="
+default:
+throttle_tx=1:throttle_tx=1
+dynamic_throttle=50:throttle_tx=1 dynamic_throttle=50
+flow_control=1:flow_control=1
+droponfull=1:droponfull=1
+"
+
+if [ -e /sys/bus/amba/drivers/uart-pl011/$UART ]; then
+	echo $UART > /sys/bus/amba/drivers/uart-pl011/unbind || exit 1
+fi
+
+load() {
+	rmmod snd-serial-pl011 2>/dev/null
+	modprobe snd-serial-pl011 $BASE $1 || exit 1
+	if [ ! -e /sys/bus/amba/drivers/snd_serial_pl011/$UART ]; then
+		echo $UART > /sys/bus/amba/drivers/snd_serial_pl011/bind ||
+			exit 1
+	fi
+}
+
+card() {
+	c=$(ls -d /proc/asound/card*/pl011 | head -n 1)
+	c=${c#/proc/asound/card}
+	echo ${c%/pl011}
+}
+
+echo "$SETTINGS" | while IFS=: read label params; do
+	[ -n "$label" ] || continue
+	load "$params"
+	for w in notes sysex clock ports16; do
+		echo "$label: $w"
+		./midisend -D hw:$(card),0 -l "$w $label" $DIR/$w.txt || exit 1
+		sleep 1
+	done
+done
+./midisend -D hw:$(card),0 -l done /dev/null
@@ -0,0 +1,251 @@
+#!/usr/bin/env python3
+"""Check what the driver put on the wire against the workloads.
+
+Connects to the UART's QEMU chardev (or a serial adapter through a TCP
+bridge), stamps the bytes as they arrive and, once bench.sh is done,
+prints one line per setting and workload: messages sent and received,
+lost, out of order, damaged, wire bytes/s and the 99th percentile
+latency.
+
+    midicheck.py [-c host:port] [-w dir] [-s capture] [-l capture]
+
+Runs are delimited by midisend's markers on output 0. The wire is
+demultiplexed on F5 <port + 1> (adaptor=generic) and running status is
+undone. Latency is arrival minus the message's time in the workload,
+less the smallest such difference in the run, as the two clocks are
+not related: it is the delay over the least delayed message.
+"""
+
+import argparse
+import bisect
+import os
+import socket
+import sys
+import time
+
+MARK_BEGIN = 0x42
+MARK_END = 0x45
+
+
+def data_len(status):
+    """Data bytes after a status byte, None for SysEx"""
+    if status < 0xf0:
+        return 1 if 0xc0 <= status < 0xe0 else 2
+    return {0xf0: None, 0xf1: 1, 0xf2: 2, 0xf3: 1}.get(status, 0)
+
+
+class Wire:
+    """Splits the byte stream into (time, port, message, bad)"""
+
+    def __init__(self):
+        self.port = 0
+        self.switch = False
+        self.status = 0
+        self.msg = []
+        self.need = 0
+        self.out = []
+
+    def emit(self, t, msg, bad=False):
+        self.out.append((t, self.port, tuple(msg), bad))
+
+    def byte(self, t, b):
+        if self.switch:
+            self.switch = False
+            self.port = max(b - 1, 0)
+            return
+        if b >= 0xf8:
+            self.emit(t, [b])
+            return
+        if b == 0xf5:
+            if self.msg:
+                self.emit(t, self.msg, True)
+            self.msg = []
+            self.status = 0
+            self.switch = True
+            return
+        if self.msg and self.msg[0] == 0xf0:
+            if b == 0xf7:
+                self.emit(t, self.msg + [b])
+                self.msg = []
+            elif b < 0x80:
+                self.msg.append(b)
+            else:
+                self.emit(t, self.msg, True)
+                self.msg = []
+                self.byte(t, b)
+            return
+        if b >= 0x80:
+            if self.msg:
+                self.emit(t, self.msg, True)
+            self.msg = [b]
+            self.need = data_len(b)
+            self.status = b if b < 0xf0 else 0
+        elif not self.msg:
+            if not self.status:
+                self.emit(t, [b], True)
+                return
+            self.msg = [self.status, b]
+            self.need = data_len(self.status) - 1
+            if self.need == 0:
+                self.emit(t, self.msg)
+                self.msg = []
+            return
+        else:
+            self.msg.append(b)
+            self.need -= 1
+        if self.need == 0:
+            self.emit(t, self.msg)
+            self.msg = []
+
+
+def read_workload(path):
+    msgs = []
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            msgs.append((int(fields[0]), int(fields[1]),
+                         tuple(int(x, 16) for x in fields[2:])))
+    return msgs
+
+
+def p99(values):
+    if not values:
+        return 0
+    values = sorted(values)
+    return values[min(len(values) - 1, (len(values) * 99) // 100)]
+
+
+def check_run(label, expected, msgs, nbytes):
+    """One line of the table for the messages between two markers"""
+    # positions of each message in each port's expected stream
+    where = {}
+    sched = {}
+    for us, port, data in expected:
+        where.setdefault((port, data), []).append(len(sched.get(port, [])))
+        sched.setdefault(port, []).append(us)
+    used = set()
+    last = {}
+    offsets = []
+    recv = lost = order = bad = 0
+    for t, port, data, damaged in msgs:
+        recv += 1
+        idx = where.get((port, data))
+        if damaged or idx is None:
+            bad += 1
+            continue
+        i = bisect.bisect_right(idx, last.get(port, -1))
+        while i < len(idx) and (port, idx[i]) in used:
+            i += 1
+        if i == len(idx):
+            # only earlier copies are left: it came out of order
+            i = next((j for j in range(len(idx))
+                      if (port, idx[j]) not in used), None)
+            if i is None:
+                bad += 1
+                continue
+            order += 1
+        else:
+            last[port] = idx[i]
+        used.add((port, idx[i]))
+        offsets.append(t / 1000.0 - sched[port][idx[i]])
+    lost = len(expected) - len(used)
+    low = min(offsets) if offsets else 0
+    span = msgs[-1][0] - msgs[0][0] if len(msgs) > 1 else 0
+    rate = nbytes * 1e9 / span if span else 0
+    words = label.split(None, 1)
+    return (words[1] if len(words) > 1 else "default", words[0],
+            len(expected), recv, lost, order, bad, rate,
+            p99([o - low for o in offsets]) / 1000.0)
+
+
+def record(addr, save):
+    host, port = addr.rsplit(":", 1)
+    sock = socket.create_connection((host, int(port)))
+    chunks = []
+    wire = Wire()
+    out = open(save, "w") if save else None
+    try:
+        while True:
+            data = sock.recv(4096)
+            if not data:
+                break
+            t = time.monotonic_ns()
+            chunks.append((t, data))
+            if out:
+                out.write("%d %s\n" % (t, data.hex()))
+            for b in data:
+                wire.byte(t, b)
+            if any(m[2] == (0xf0, 0x7d, MARK_BEGIN) + tuple(b"done") +
+                   (0xf7,) for m in wire.out[-4:]):
+                break
+    except KeyboardInterrupt:
+        pass
+    if out:
+        out.close()
+    return chunks
+
+
+def load(path):
+    chunks = []
+    with open(path) as f:
+        for line in f:
+            t, data = line.split()
+            chunks.append((int(t), bytes.fromhex(data)))
+    return chunks
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("-c", "--connect", default="localhost:4555")
+    ap.add_argument("-w", "--workloads", default=".")
+    ap.add_argument("-s", "--save", help="keep the capture in this file")
+    ap.add_argument("-l", "--load", help="check a saved capture")
+    args = ap.parse_args()
+
+    chunks = load(args.load) if args.load else record(args.connect,
+                                                      args.save)
+    wire = Wire()
+    counts = []
+    for t, data in chunks:
+        for b in data:
+            wire.byte(t, b)
+            counts.append(len(wire.out))
+
+    rows = []
+    label = None
+    run = []
+    first = 0
+    for i, m in enumerate(wire.out):
+        data = m[2]
+        if m[1] == 0 and data[:2] == (0xf0, 0x7d) and len(data) > 3 and \
+           data[2] in (MARK_BEGIN, MARK_END):
+            if data[2] == MARK_BEGIN:
+                label = bytes(data[3:-1]).decode("ascii", "replace")
+                run = []
+                first = bisect.bisect_left(counts, i + 1)
+            elif label is not None and label != "done":
+                nbytes = bisect.bisect_left(counts, i + 1) - first - \
+                    (len(data) - 1)
+                name = label.split()[0]
+                path = os.path.join(args.workloads, name + ".txt")
+                if not os.path.exists(path):
+                    sys.exit("midicheck: no workload %s" % path)
+                rows.append(check_run(label, read_workload(path), run,
+                                      nbytes))
+                label = None
+            continue
+        if label is not None:
+            run.append(m)
+
+    print("%-28s %-8s %6s %6s %6s %6s %6s %9s %8s" %
+          ("setting", "workload", "sent", "recv", "lost", "order", "bad",
+           "bytes/s", "p99 ms"))
+    for r in rows:
+        print("%-28s %-8s %6d %6d %6d %6d %6d %9.0f %8.2f" % r)
+    # loss is a setting's choice (droponfull), disorder never is
+    if any(r[5] or r[6] for r in rows):
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
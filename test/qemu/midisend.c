@@ -0,0 +1,148 @@
+/*
+ * midisend: play a workload from workload.py to the driver's outputs,
+ * each message at its time, between two markers for midicheck.
+ *
+ *   gcc -O2 -o midisend midisend.c -lasound
+ *   midisend [-D hw:N,0] [-l label] workload.txt
+ *
+ * The markers are SysEx on output 0 with the non-commercial ID:
+ * F0 7D 42 <label> F7 before the workload, F0 7D 45 F7 after it.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <alsa/asoundlib.h>
+
+#define MAX_PORTS	16
+#define MAX_MSG		2048
+
+static const char *device = "hw:0,0";
+static snd_rawmidi_t *outs[MAX_PORTS];
+
+static snd_rawmidi_t *port_open(int port)
+{
+	char name[64];
+	int err;
+
+	if (outs[port])
+		return outs[port];
+	snprintf(name, sizeof(name), "%s,%d", device, port);
+	err = snd_rawmidi_open(NULL, &outs[port], name, 0);
+	if (err < 0) {
+		fprintf(stderr, "midisend: %s: %s\n", name, snd_strerror(err));
+		exit(1);
+	}
+	return outs[port];
+}
+
+static void send(int port, const unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = snd_rawmidi_write(port_open(port), buf, len);
+		if (n < 0) {
+			fprintf(stderr, "midisend: write to port %d: %s\n",
+				port, snd_strerror(n));
+			exit(1);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void marker(unsigned char kind, const char *label)
+{
+	unsigned char buf[MAX_MSG];
+	size_t len = 0;
+
+	buf[len++] = 0xf0;
+	buf[len++] = 0x7d;
+	buf[len++] = kind;
+	for (; label && *label && len < sizeof(buf) - 1; label++)
+		buf[len++] = *label & 0x7f;
+	buf[len++] = 0xf7;
+	send(0, buf, len);
+	snd_rawmidi_drain(outs[0]);
+}
+
+static void wait_until(const struct timespec *start, long long us)
+{
+	struct timespec t = *start;
+
+	t.tv_sec += us / 1000000;
+	t.tv_nsec += (us % 1000000) * 1000;
+	if (t.tv_nsec >= 1000000000) {
+		t.tv_sec++;
+		t.tv_nsec -= 1000000000;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) ==
+	       EINTR)
+		;
+}
+
+int main(int argc, char **argv)
+{
+	const char *label = "";
+	unsigned char msg[MAX_MSG];
+	char line[4 * MAX_MSG];
+	struct timespec start;
+	long long us;
+	int c, port, off, n, i;
+	unsigned int byte;
+	size_t len;
+	FILE *f;
+
+	while ((c = getopt(argc, argv, "D:l:")) != -1) {
+		switch (c) {
+		case 'D':
+			device = optarg;
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+	f = fopen(argv[optind], "r");
+	if (!f) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	marker(0x42, label);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lld %d%n", &us, &port, &off) != 2 ||
+		    port < 0 || port >= MAX_PORTS) {
+			fprintf(stderr, "midisend: bad line: %s", line);
+			return 1;
+		}
+		for (len = 0; len < sizeof(msg) &&
+		     sscanf(line + off, "%x%n", &byte, &n) == 1; off += n)
+			msg[len++] = byte;
+		wait_until(&start, us);
+		send(port, msg, len);
+	}
+	fclose(f);
+
+	for (i = 0; i < MAX_PORTS; i++)
+		if (outs[i])
+			snd_rawmidi_drain(outs[i]);
+	marker(0x45, NULL);
+	for (i = 0; i < MAX_PORTS; i++)
+		if (outs[i])
+			snd_rawmidi_close(outs[i]);
+	return 0;
+
+ usage:
+	fprintf(stderr, "usage: midisend [-D hw:N,0] [-l label] workload.txt\n");
+	return 1;
+}
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""Write the benchmark workloads, one file each, for midisend and midicheck.
+
+Each line is "<us> <port> <hex bytes>": send the message to output
+<port> (hw:N,0,<port>) <us> after the start. Messages are numbered so
+that midicheck can tell a lost one from a late one.
+
+    workload.py [dir]
+"""
+
+import os
+import sys
+
+# 31250 baud carries a byte every 320 us
+
+
+def seq_bytes(seq):
+    """Two data bytes numbering a message, up to 16383"""
+    return [(seq >> 7) & 0x7f, seq & 0x7f]
+
+
+def notes():
+    """Note storm: a note on and off every 400 us, twice what the wire
+    carries, on one output"""
+    out = []
+    for i in range(4000):
+        hi, lo = seq_bytes(i)
+        status = (0x90 if i % 2 == 0 else 0x80) | (i >> 8 & 0x0f)
+        out.append((i * 400, 0, [status, hi, lo]))
+    return out
+
+
+def sysex():
+    """SysEx dumps of 1 KiB, one every 400 ms, with notes in between"""
+    out = []
+    for i in range(25):
+        data = [(i * 7 + j) & 0x7f for j in range(1020)]
+        out.append((i * 400000, 0, [0xf0, 0x7d] + seq_bytes(i) + data +
+                    [0xf7]))
+    for i in range(500):
+        out.append((i * 20000 + 5000, 0, [0x91] + seq_bytes(i)))
+    return sorted(out, key=lambda m: m[0])
+
+
+def clock():
+    """MIDI clock, 24 ppqn at 300 BPM, for 20 seconds between start
+    and stop, with a note each beat"""
+    period = 60 * 1000000 // (300 * 24)
+    out = [(0, 0, [0xfa])]
+    for i in range(24 * 5 * 20):
+        out.append((i * period, 0, [0xf8]))
+        if i % 24 == 0:
+            out.append((i * period + 1, 0, [0x99] + seq_bytes(i // 24)))
+    out.append((24 * 5 * 20 * period, 0, [0xfc]))
+    return out
+
+
+def ports16():
+    """Controller changes on 16 outputs in turn, one every 1 ms"""
+    out = []
+    for i in range(8000):
+        port = i % 16
+        out.append((i * 1000, port, [0xb0 | port] + seq_bytes(i // 16)))
+    return out
+
+
+WORKLOADS = {
+    "notes": notes,
+    "sysex": sysex,
+    "clock": clock,
+    "ports16": ports16,
+}
+
+
+def write(path, msgs):
+    with open(path, "w") as f:
+        for us, port, data in msgs:
+            f.write("%d %d %s\n" % (us, port,
+                                    " ".join("%02x" % b for b in data)))
+
+
+def main():
+    outdir = sys.argv[1] if len(sys.argv) > 1 else "."
+    os.makedirs(outdir, exist_ok=True)
+    for name, gen in WORKLOADS.items():
+        write(os.path.join(outdir, name + ".txt"), gen())
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,1299 @@
+/*
+ * Kernel side of the simulation: what the shim headers declare, run on
+ * the simulated clock. Interrupt handlers, hrtimer callbacks and
+ * tasklets run when they are due; the time they take is what their
+ * register accesses cost.
+ */
+#include <stdarg.h>
+
+#include <linux/interrupt.h>
+#include <linux/amba/bus.h>
+#include <sound/core.h>
+#include <sound/info.h>
+#include <sound/rawmidi.h>
+
+#include "sim.h"
+
+s64 sim_now;
+int sim_irqs_off;
+struct shim_stats shim_stats;
+
+/* printk */
+
+int printk(const char *fmt, ...)
+{
+	va_list ap;
+	int level = 6;
+	int n;
+
+	if (fmt[0] == '<' && fmt[1] >= '0' && fmt[1] <= '7' && fmt[2] == '>') {
+		level = fmt[1] - '0';
+		fmt += 3;
+	}
+	if (level <= 4)
+		shim_stats.warnings++;
+	if (!sim_cfg.verbose)
+		return 0;
+	fprintf(stderr, "[%6lld.%06lld] ", (long long)(sim_now / SIM_MS),
+		(long long)(sim_now % SIM_MS));
+	va_start(ap, fmt);
+	n = vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	return n;
+}
+
+/* At most 10 messages a second, as the kernel's default */
+int printk_ratelimit(void)
+{
+	static int64_t begin;
+	static int printed;
+
+	if (sim_now - begin >= 1000 * SIM_MS) {
+		begin = sim_now;
+		printed = 0;
+	}
+	return printed++ < 10;
+}
+
+/* bits */
+
+unsigned long find_first_bit(const unsigned long *addr, unsigned long size)
+{
+	unsigned long i;
+
+	for (i = 0; i < size; i++)
+		if (*addr & (1UL << i))
+			return i;
+	return size;
+}
+
+unsigned long find_first_zero_bit(const unsigned long *addr,
+				  unsigned long size)
+{
+	unsigned long i;
+
+	for (i = 0; i < size; i++)
+		if (!(*addr & (1UL << i)))
+			return i;
+	return size;
+}
+
+/* clocks */
+
+ktime_t ktime_get_real(void)
+{
+	return sim_now + ktime_set(1700000000, 0);
+}
+
+ktime_t ktime_get_raw(void)
+{
+	return sim_now;
+}
+
+/* Time spent in a handler, timer or tasklet */
+static int shim_cpu_depth;
+static int64_t shim_cpu_start;
+
+static void shim_cpu_enter(void)
+{
+	if (!shim_cpu_depth++)
+		shim_cpu_start = sim_now;
+}
+
+static void shim_cpu_exit(void)
+{
+	if (!--shim_cpu_depth)
+		shim_stats.cpu_ns += sim_now - shim_cpu_start;
+}
+
+/* The UART being probed, whose timers and tasklets are set up; they
+ * are dropped from the registries when it is unbound */
+static int shim_probing = -1;
+
+/* hrtimers */
+
+#define SHIM_MAX_TIMERS	16
+static struct hrtimer *shim_timers[SHIM_MAX_TIMERS];
+static int shim_timer_uart[SHIM_MAX_TIMERS];
+
+void hrtimer_init(struct hrtimer *timer, int clock, enum hrtimer_mode mode)
+{
+	int i;
+
+	memset(timer, 0, sizeof(*timer));
+	for (i = 0; i < SHIM_MAX_TIMERS; i++) {
+		if (!shim_timers[i] || shim_timers[i] == timer) {
+			shim_timers[i] = timer;
+			shim_timer_uart[i] = shim_probing;
+			return;
+		}
+	}
+	fprintf(stderr, "shim: too many hrtimers\n");
+	abort();
+}
+
+void hrtimer_start(struct hrtimer *timer, ktime_t t, enum hrtimer_mode mode)
+{
+	timer->expires = mode == HRTIMER_MODE_REL ? sim_now + t : t;
+	timer->queued = 1;
+}
+
+int hrtimer_try_to_cancel(struct hrtimer *timer)
+{
+	int was = timer->queued;
+
+	if (timer->running)
+		return -1;
+	timer->queued = 0;
+	return was;
+}
+
+int hrtimer_cancel(struct hrtimer *timer)
+{
+	int was = timer->queued;
+
+	timer->queued = 0;
+	return was;
+}
+
+u64 hrtimer_forward_now(struct hrtimer *timer, ktime_t interval)
+{
+	u64 overruns = 0;
+
+	if (interval <= 0)
+		interval = 1;
+	while (timer->expires <= sim_now) {
+		timer->expires += interval;
+		overruns++;
+	}
+	return overruns;
+}
+
+/* tasklets and work */
+
+#define SHIM_MAX_TASKLETS	16
+static struct tasklet_struct *shim_tasklets[SHIM_MAX_TASKLETS];
+static int shim_tasklet_uart[SHIM_MAX_TASKLETS];
+
+void tasklet_init(struct tasklet_struct *t, void (*func)(unsigned long),
+		  unsigned long data)
+{
+	int i;
+
+	t->func = func;
+	t->data = data;
+	t->scheduled = 0;
+	for (i = 0; i < SHIM_MAX_TASKLETS; i++) {
+		if (!shim_tasklets[i] || shim_tasklets[i] == t) {
+			shim_tasklets[i] = t;
+			shim_tasklet_uart[i] = shim_probing;
+			return;
+		}
+	}
+	fprintf(stderr, "shim: too many tasklets\n");
+	abort();
+}
+
+void tasklet_schedule(struct tasklet_struct *t)
+{
+	t->scheduled = 1;
+}
+
+void tasklet_kill(struct tasklet_struct *t)
+{
+	int i;
+
+	t->scheduled = 0;
+	for (i = 0; i < SHIM_MAX_TASKLETS; i++)
+		if (shim_tasklets[i] == t)
+			shim_tasklets[i] = NULL;
+}
+
+#define SHIM_MAX_WORK	8
+static struct work_struct *shim_work[SHIM_MAX_WORK];
+static int shim_work_count;
+
+int schedule_work(struct work_struct *work)
+{
+	int i;
+
+	for (i = 0; i < shim_work_count; i++)
+		if (shim_work[i] == work)
+			return 0;
+	if (shim_work_count == SHIM_MAX_WORK)
+		return 0;
+	shim_work[shim_work_count++] = work;
+	return 1;
+}
+
+/* Every change of the interrupt state goes through here, so that the
+ * time spent with interrupts off is known */
+void shim_irqs_set(int off)
+{
+	static int64_t since;
+	int64_t t;
+
+	if (!sim_irqs_off && off) {
+		since = sim_now;
+	} else if (sim_irqs_off && !off) {
+		t = sim_now - since;
+		shim_stats.irqs_off_ns += t;
+		if (t > shim_stats.irqs_off_max_ns)
+			shim_stats.irqs_off_max_ns = t;
+	}
+	sim_irqs_off = off;
+}
+
+/* As the kernel's local_bh_enable, which warns with interrupts off */
+void shim_bh_enable(void)
+{
+	if (sim_irqs_off) {
+		shim_stats.bh_irqs_off++;
+		printk(KERN_WARNING "WARNING: spin_unlock_bh with interrupts off\n");
+	}
+}
+
+/* sleeping */
+
+static wait_queue_head_t *shim_waiting;
+
+void prepare_to_wait(wait_queue_head_t *q, struct wait_queue_entry *w,
+		     int state)
+{
+	w->head = q;
+	q->woken = 0;
+	shim_waiting = q;
+}
+
+void finish_wait(wait_queue_head_t *q, struct wait_queue_entry *w)
+{
+	shim_waiting = NULL;
+}
+
+long schedule_timeout(long timeout)
+{
+	int64_t end = sim_now + timeout * (NSEC_PER_SEC / HZ);
+	int none = 0;
+
+	if (sim_irqs_off) {
+		printk(KERN_ERR "BUG: scheduling with interrupts off\n");
+		shim_irqs_set(0);
+	}
+	sim_run_until(end, shim_waiting ? &shim_waiting->woken : &none);
+	if (sim_now >= end)
+		return 0;
+	return (end - sim_now) / (NSEC_PER_SEC / HZ) + 1;
+}
+
+/* The UARTs of the model, each with its registers, its interrupt line
+ * and what the driver registered on it */
+
+static struct shim_uart {
+	struct amba_device adev;
+	unsigned char iomem[0x200];
+	irq_handler_t handler;
+	irq_handler_t thread_fn;
+	void *dev;
+	int64_t due;		/* handler runs */
+	int64_t thread_due;	/* thread runs */
+	int unhandled;
+	int bound;
+	struct snd_rawmidi *rmidi[2];	/* in the order created */
+} shim_uarts[SIM_MAX_UARTS] = {
+	{
+		.adev = {
+			.dev = { .name = "3f201000.serial" },
+			.res = { 0x3f201000, 0x3f2011ff },
+			.irq = { 81 },
+		},
+	},
+	{
+		.adev = {
+			.dev = { .name = "3f201400.serial" },
+			.res = { 0x3f201400, 0x3f2015ff },
+			.irq = { 82 },
+		},
+	},
+};
+
+/* registers */
+
+static unsigned int shim_reg(const volatile void *addr,
+			     struct pl011_model **model)
+{
+	unsigned long off;
+	int i;
+
+	for (i = 0; i < SIM_MAX_UARTS; i++) {
+		off = (const char *)addr - (const char *)shim_uarts[i].iomem;
+		if (off < sizeof(shim_uarts[i].iomem)) {
+			*model = &sim_uarts[i];
+			sim_now += sim_cfg.mmio_ns;
+			shim_stats.mmio++;
+			return off;
+		}
+	}
+	fprintf(stderr, "shim: access outside the UARTs at %p\n",
+		(void *)addr);
+	abort();
+}
+
+u16 readw(const volatile void __iomem *addr)
+{
+	struct pl011_model *m;
+	unsigned int reg = shim_reg(addr, &m);
+
+	return pl011_read(m, sim_now, reg);
+}
+
+u8 readb(const volatile void __iomem *addr)
+{
+	struct pl011_model *m;
+	unsigned int reg = shim_reg(addr, &m);
+
+	return pl011_read(m, sim_now, reg);
+}
+
+void writew(u16 val, volatile void __iomem *addr)
+{
+	struct pl011_model *m;
+	unsigned int reg = shim_reg(addr, &m);
+
+	pl011_write(m, sim_now, reg, val);
+}
+
+void writeb(u8 val, volatile void __iomem *addr)
+{
+	struct pl011_model *m;
+	unsigned int reg = shim_reg(addr, &m);
+
+	pl011_write(m, sim_now, reg, val);
+}
+
+/* the interrupt lines, one per UART */
+
+static struct shim_uart *shim_irq_line(unsigned int irq)
+{
+	int i;
+
+	for (i = 0; i < SIM_MAX_UARTS; i++)
+		if (shim_uarts[i].adev.irq[0] == irq)
+			return &shim_uarts[i];
+	return NULL;
+}
+
+int request_threaded_irq(unsigned int irq, irq_handler_t handler,
+			 irq_handler_t thread_fn, unsigned long flags,
+			 const char *name, void *dev)
+{
+	struct shim_uart *u = shim_irq_line(irq);
+
+	if (!u)
+		return -EINVAL;
+	if (u->handler)
+		return -EBUSY;
+	u->handler = handler;
+	u->thread_fn = thread_fn;
+	u->dev = dev;
+	u->due = SIM_NEVER;
+	u->thread_due = SIM_NEVER;
+	return 0;
+}
+
+int request_irq(unsigned int irq, irq_handler_t handler, unsigned long flags,
+		const char *name, void *dev)
+{
+	return request_threaded_irq(irq, handler, NULL, flags, name, dev);
+}
+
+void free_irq(unsigned int irq, void *dev)
+{
+	struct shim_uart *u = shim_irq_line(irq);
+
+	u->handler = NULL;
+	u->thread_fn = NULL;
+	u->due = SIM_NEVER;
+	u->thread_due = SIM_NEVER;
+}
+
+void irq_wake_thread(unsigned int irq, void *dev)
+{
+	struct shim_uart *u = shim_irq_line(irq);
+
+	if (u->thread_fn && u->thread_due == SIM_NEVER)
+		u->thread_due = sim_now + sim_cfg.thread_latency_ns;
+}
+
+/* The line is masked while the thread of a oneshot handler is pending */
+static int shim_irq_asserted(int n)
+{
+	struct shim_uart *u = &shim_uarts[n];
+
+	return u->handler && u->thread_due == SIM_NEVER &&
+	       pl011_irq_line(&sim_uarts[n]);
+}
+
+static void shim_irq_run(int n)
+{
+	struct shim_uart *u = &shim_uarts[n];
+	unsigned int irq = u->adev.irq[0];
+	irqreturn_t ret;
+
+	u->due = SIM_NEVER;
+	if (!shim_irq_asserted(n))
+		return;
+
+	shim_stats.irqs++;
+	shim_cpu_enter();
+	shim_irqs_set(sim_irqs_off + 1);
+	ret = u->handler(irq, u->dev);
+	shim_irqs_set(sim_irqs_off - 1);
+	shim_cpu_exit();
+
+	if (ret == IRQ_WAKE_THREAD) {
+		irq_wake_thread(irq, u->dev);
+	} else if (ret == IRQ_NONE) {
+		shim_stats.irqs_unhandled++;
+		/* as note_interrupt() does, if much less patiently */
+		if (++u->unhandled == 1000) {
+			printk(KERN_ERR "irq %u: nobody cared, disabling\n",
+			       irq);
+			free_irq(irq, u->dev);
+		}
+		return;
+	}
+	u->unhandled = 0;
+}
+
+static void shim_thread_run(int n)
+{
+	struct shim_uart *u = &shim_uarts[n];
+
+	u->thread_due = SIM_NEVER;
+	if (!u->thread_fn)
+		return;
+	shim_stats.irq_threads++;
+	shim_cpu_enter();
+	u->thread_fn(u->adev.irq[0], u->dev);
+	shim_cpu_exit();
+}
+
+/* What is due next on the kernel side */
+int64_t shim_next_event(void)
+{
+	int64_t t = SIM_NEVER;
+	int i;
+
+	for (i = 0; i < SHIM_MAX_TASKLETS; i++)
+		if (shim_tasklets[i] && shim_tasklets[i]->scheduled)
+			return sim_now;
+	if (shim_work_count)
+		return sim_now;
+
+	for (i = 0; i < SIM_MAX_UARTS; i++) {
+		if (shim_irq_asserted(i)) {
+			if (shim_uarts[i].due == SIM_NEVER)
+				return sim_now;
+			if (shim_uarts[i].due < t)
+				t = shim_uarts[i].due;
+		}
+		if (shim_uarts[i].thread_due < t)
+			t = shim_uarts[i].thread_due;
+	}
+	for (i = 0; i < SHIM_MAX_TIMERS; i++)
+		if (shim_timers[i] && shim_timers[i]->queued &&
+		    shim_timers[i]->expires + sim_cfg.timer_latency_ns < t)
+			t = shim_timers[i]->expires + sim_cfg.timer_latency_ns;
+	return t;
+}
+
+/* Run what is due: interrupts, then timers, then softirq work */
+void shim_run_due(void)
+{
+	struct hrtimer *timer;
+	struct tasklet_struct *t;
+	struct work_struct *work;
+	int i;
+
+	for (i = 0; i < SIM_MAX_UARTS; i++) {
+		pl011_sync(&sim_uarts[i], sim_now);
+		if (shim_irq_asserted(i) && shim_uarts[i].due == SIM_NEVER)
+			shim_uarts[i].due = sim_now + sim_cfg.irq_latency_ns;
+		if (shim_uarts[i].due <= sim_now)
+			shim_irq_run(i);
+		if (shim_uarts[i].thread_due <= sim_now)
+			shim_thread_run(i);
+	}
+
+	for (i = 0; i < SHIM_MAX_TIMERS; i++) {
+		timer = shim_timers[i];
+		if (!timer || !timer->queued ||
+		    timer->expires + sim_cfg.timer_latency_ns > sim_now)
+			continue;
+		timer->queued = 0;
+		timer->running = 1;
+		shim_stats.timer_fires++;
+		shim_cpu_enter();
+		shim_irqs_set(sim_irqs_off + 1);
+		if (timer->function(timer) == HRTIMER_RESTART)
+			timer->queued = 1;
+		shim_irqs_set(sim_irqs_off - 1);
+		shim_cpu_exit();
+		timer->running = 0;
+	}
+
+	for (i = 0; i < SHIM_MAX_TASKLETS; i++) {
+		t = shim_tasklets[i];
+		if (!t || !t->scheduled)
+			continue;
+		t->scheduled = 0;
+		shim_stats.tasklets++;
+		shim_cpu_enter();
+		t->func(t->data);
+		shim_cpu_exit();
+	}
+
+	while (shim_work_count) {
+		work = shim_work[0];
+		memmove(shim_work, shim_work + 1,
+			--shim_work_count * sizeof(*shim_work));
+		if (work->func)
+			work->func(work);
+	}
+}
+
+/* devices, sysfs, devicetree */
+
+int sysfs_create_group(struct kobject *kobj,
+		       const struct attribute_group *grp)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(kobj->groups); i++) {
+		if (!kobj->groups[i]) {
+			kobj->groups[i] = grp;
+			return 0;
+		}
+	}
+	return -ENOMEM;
+}
+
+void sysfs_remove_group(struct kobject *kobj,
+			const struct attribute_group *grp)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(kobj->groups); i++)
+		if (kobj->groups[i] == grp)
+			kobj->groups[i] = NULL;
+}
+
+int sysfs_streq(const char *s1, const char *s2)
+{
+	while (*s1 && *s1 == *s2) {
+		s1++;
+		s2++;
+	}
+	if (*s1 == *s2)
+		return 1;
+	if (!*s1 && *s2 == '\n' && !s2[1])
+		return 1;
+	if (*s1 == '\n' && !s1[1] && !*s2)
+		return 1;
+	return 0;
+}
+
+static int shim_kstrtol(const char *s, unsigned int base, long *res)
+{
+	char *end;
+
+	errno = 0;
+	*res = strtol(s, &end, base);
+	if (end == s || errno)
+		return -EINVAL;
+	if (*end == '\n')
+		end++;
+	return *end ? -EINVAL : 0;
+}
+
+int kstrtoint(const char *s, unsigned int base, int *res)
+{
+	long val;
+	int err = shim_kstrtol(s, base, &val);
+
+	if (!err)
+		*res = val;
+	return err;
+}
+
+int kstrtouint(const char *s, unsigned int base, unsigned int *res)
+{
+	long val;
+	int err = shim_kstrtol(s, base, &val);
+
+	if (!err && val < 0)
+		err = -EINVAL;
+	if (!err)
+		*res = val;
+	return err;
+}
+
+int of_property_read_u32(const struct device_node *np, const char *name,
+			 u32 *val)
+{
+	return -EINVAL;
+}
+
+bool of_property_read_bool(const struct device_node *np, const char *name)
+{
+	return false;
+}
+
+struct resource *request_mem_region(unsigned long start, unsigned long n,
+				    const char *name)
+{
+	struct resource *res = kzalloc(sizeof(*res), GFP_KERNEL);
+
+	if (res) {
+		res->start = start;
+		res->end = start + n - 1;
+	}
+	return res;
+}
+
+void release_and_free_resource(struct resource *res)
+{
+	kfree(res);
+}
+
+void __iomem *devm_ioremap(struct device *dev, unsigned long offset,
+			   unsigned long size)
+{
+	int i;
+
+	for (i = 0; i < SIM_MAX_UARTS; i++)
+		if (shim_uarts[i].adev.res.start == offset)
+			return shim_uarts[i].iomem;
+	return NULL;
+}
+
+static int shim_clk;
+
+struct clk *devm_clk_get(struct device *dev, const char *id)
+{
+	return (struct clk *)&shim_clk;
+}
+
+unsigned long clk_get_rate(struct clk *clk)
+{
+	return sim_cfg.clk;
+}
+
+/* The timers and tasklets of a UART were in the driver's memory */
+static void shim_drop(int n)
+{
+	int i;
+
+	for (i = 0; i < SHIM_MAX_TIMERS; i++)
+		if (shim_timer_uart[i] == n)
+			shim_timers[i] = NULL;
+	for (i = 0; i < SHIM_MAX_TASKLETS; i++)
+		if (shim_tasklet_uart[i] == n)
+			shim_tasklets[i] = NULL;
+}
+
+/* the AMBA bus, with the UARTs of the model */
+
+static struct amba_driver *shim_driver;
+
+int amba_driver_register(struct amba_driver *drv)
+{
+	shim_driver = drv;
+	return 0;
+}
+
+void amba_driver_unregister(struct amba_driver *drv)
+{
+	int i;
+
+	for (i = SIM_MAX_UARTS - 1; i >= 0; i--)
+		shim_unbind(i);
+	shim_driver = NULL;
+}
+
+int shim_bind(int n)
+{
+	struct shim_uart *u = &shim_uarts[n];
+	int err;
+
+	if (!shim_driver)
+		return -ENODEV;
+	if (u->bound)
+		return -EBUSY;
+	shim_probing = n;
+	err = shim_driver->probe(&u->adev, shim_driver->id_table);
+	shim_probing = -1;
+	if (err) {
+		shim_drop(n);
+		return err;
+	}
+	u->bound = 1;
+	return 0;
+}
+
+void shim_unbind(int n)
+{
+	struct shim_uart *u = &shim_uarts[n];
+
+	if (!u->bound)
+		return;
+	if (shim_driver->remove)
+		shim_driver->remove(&u->adev);
+	u->bound = 0;
+	shim_drop(n);
+}
+
+/* The driver data of a bound UART */
+void *shim_drvdata(int n)
+{
+	return shim_uarts[n].bound ? amba_get_drvdata(&shim_uarts[n].adev) :
+	       NULL;
+}
+
+/* the sound card */
+
+static struct snd_card *shim_card;
+
+int snd_card_new(struct device *parent, int idx, const char *xid,
+		 void *module, int extra_size, struct snd_card **card_ret)
+{
+	struct snd_card *card = kzalloc(sizeof(*card), GFP_KERNEL);
+
+	if (!card)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&card->devices);
+	card->proc_root = kzalloc(sizeof(*card->proc_root), GFP_KERNEL);
+	if (!card->proc_root) {
+		kfree(card);
+		return -ENOMEM;
+	}
+	strcpy(card->proc_root->name, "card0");
+	INIT_LIST_HEAD(&card->proc_root->children);
+	card->dev = parent;
+	card->card_dev.name = "card0";
+	card->card_dev.parent = parent;
+	shim_card = card;
+	*card_ret = card;
+	return 0;
+}
+
+static int shim_info_register(struct snd_info_entry *entry);
+
+/* New devices are registered with the card; so are proc entries,
+ * which fail on a name the card already has */
+int snd_card_register(struct snd_card *card)
+{
+	struct snd_info_entry *entry;
+	struct snd_device *dev;
+	int err;
+
+	card->registered = 1;
+	list_for_each_entry(dev, &card->devices, list) {
+		if (dev->registered)
+			continue;
+		if (dev->ops->dev_register) {
+			err = dev->ops->dev_register(dev);
+			if (err)
+				return err;
+		}
+		dev->registered = 1;
+	}
+	list_for_each_entry(entry, &card->proc_root->children, list) {
+		err = shim_info_register(entry);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+int snd_device_new(struct snd_card *card, enum snd_device_type type,
+		   void *device_data, const struct snd_device_ops *ops)
+{
+	struct snd_device *dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+
+	if (!dev)
+		return -ENOMEM;
+	dev->card = card;
+	dev->type = type;
+	dev->device_data = device_data;
+	dev->ops = ops;
+	list_add_tail(&dev->list, &card->devices);
+	return 0;
+}
+
+static void shim_device_free(struct snd_device *dev)
+{
+	dev->list.prev->next = dev->list.next;
+	dev->list.next->prev = dev->list.prev;
+	if (dev->ops->dev_free)
+		dev->ops->dev_free(dev);
+	kfree(dev);
+}
+
+void snd_device_free(struct snd_card *card, void *device_data)
+{
+	struct snd_device *dev;
+
+	list_for_each_entry(dev, &card->devices, list) {
+		if (dev->device_data == device_data) {
+			shim_device_free(dev);
+			return;
+		}
+	}
+	/* only dev_dbg in the kernel, the data is not freed */
+	printk(KERN_DEBUG "device free %p, not found\n", device_data);
+}
+
+/* Devices go in the reverse order of creation, then the proc entries
+ * the card still has */
+int snd_card_free(struct snd_card *card)
+{
+	while (card->devices.prev != &card->devices)
+		shim_device_free(container_of(card->devices.prev,
+					      struct snd_device, list));
+	snd_info_free_entry(card->proc_root);
+	if (shim_card == card)
+		shim_card = NULL;
+	kfree(card);
+	return 0;
+}
+
+/* proc */
+
+struct snd_info_entry *snd_info_create_card_entry(struct snd_card *card,
+		const char *name, struct snd_info_entry *parent)
+{
+	struct snd_info_entry *entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+
+	if (!entry)
+		return NULL;
+	snprintf(entry->name, sizeof(entry->name), "%s", name);
+	entry->card = card;
+	entry->parent = parent;
+	INIT_LIST_HEAD(&entry->children);
+	list_add_tail(&entry->list, &parent->children);
+	/* a card already up registers its new entries on the next
+	 * snd_card_register */
+	return entry;
+}
+
+/* proc_create fails on a name that is taken */
+static int shim_info_register(struct snd_info_entry *entry)
+{
+	struct snd_info_entry *e;
+
+	if (entry->registered)
+		return 0;
+	list_for_each_entry(e, &entry->parent->children, list) {
+		if (e != entry && e->registered &&
+		    !strcmp(e->name, entry->name)) {
+			printk(KERN_WARNING "proc_dir_entry '%s/%s' already registered\n",
+			       entry->parent->name, entry->name);
+			return -ENOMEM;
+		}
+	}
+	entry->registered = 1;
+	return 0;
+}
+
+void snd_info_free_entry(struct snd_info_entry *entry)
+{
+	if (!entry)
+		return;
+	while (entry->children.next != &entry->children)
+		snd_info_free_entry(container_of(entry->children.next,
+						 struct snd_info_entry, list));
+	if (entry->parent)
+		list_del(&entry->list);
+	kfree(entry);
+}
+
+int snd_iprintf(struct snd_info_buffer *buffer, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (buffer->len + n + 1 > buffer->size) {
+		buffer->size = (buffer->len + n + 1) * 2;
+		buffer->buffer = realloc(buffer->buffer, buffer->size);
+	}
+	va_start(ap, fmt);
+	vsnprintf(buffer->buffer + buffer->len, n + 1, fmt, ap);
+	va_end(ap);
+	buffer->len += n;
+	return n;
+}
+
+/* Print every proc file of the card */
+void shim_proc_dump(FILE *f, const char *indent)
+{
+	struct snd_info_buffer buffer = { NULL, 0, 0 };
+	struct snd_info_entry *entry;
+	char *line, *next;
+
+	if (!shim_card)
+		return;
+	list_for_each_entry(entry, &shim_card->proc_root->children, list) {
+		if (!entry->registered || !entry->read)
+			continue;
+		buffer.len = 0;
+		entry->read(entry, &buffer);
+		if (!buffer.len)
+			continue;
+		fprintf(f, "%s/proc/asound/card0/%s:\n", indent, entry->name);
+		for (line = buffer.buffer; line && *line; line = next) {
+			next = strchr(line, '\n');
+			if (next)
+				*next++ = 0;
+			fprintf(f, "%s  %s\n", indent, line);
+		}
+	}
+	free(buffer.buffer);
+}
+
+/* Write to an attribute of a bound UART, as through sysfs */
+int shim_sysfs_store(int n, const char *attr, const char *value)
+{
+	struct device *dev = &shim_uarts[n].adev.dev;
+	const struct attribute_group **groups = dev->kobj.groups;
+	struct device_attribute *dattr;
+	struct attribute **a;
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(dev->kobj.groups); i++) {
+		if (!groups[i])
+			continue;
+		for (a = groups[i]->attrs; *a; a++) {
+			if (strcmp((*a)->name, attr))
+				continue;
+			dattr = container_of(*a, struct device_attribute, attr);
+			if (!dattr->store)
+				return -EPERM;
+			ret = dattr->store(dev, dattr, value,
+					   strlen(value));
+			return ret < 0 ? ret : 0;
+		}
+	}
+	return -ENOENT;
+}
+
+/* rawmidi */
+
+static int shim_rawmidi_free(struct snd_device *dev)
+{
+	struct snd_rawmidi *rmidi = dev->device_data;
+	struct snd_rawmidi_substream *s;
+	struct list_head *pos, *next;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		for (pos = rmidi->streams[i].substreams.next;
+		     pos != &rmidi->streams[i].substreams; pos = next) {
+			next = pos->next;
+			s = container_of(pos, struct snd_rawmidi_substream,
+					 list);
+			if (s->runtime)
+				shim_close(s);
+			kfree(s);
+		}
+	}
+	for (i = 0; i < SIM_MAX_UARTS * 2; i++)
+		if (shim_uarts[i / 2].rmidi[i % 2] == rmidi)
+			shim_uarts[i / 2].rmidi[i % 2] = NULL;
+	if (rmidi->seq_device)
+		shim_stats.seq_devices--;
+	kfree(rmidi);
+	return 0;
+}
+
+/* As snd_rawmidi_dev_register: a device without a dev_register of its
+ * own gets a sequencer device, which snd-seq-midi binds */
+static int shim_rawmidi_register(struct snd_device *dev)
+{
+	struct snd_rawmidi *rmidi = dev->device_data;
+
+	if (rmidi->ops && rmidi->ops->dev_register)
+		return rmidi->ops->dev_register(rmidi);
+	rmidi->seq_device = 1;
+	shim_stats.seq_devices++;
+	return 0;
+}
+
+int snd_rawmidi_new(struct snd_card *card, char *id, int device,
+		    int output_count, int input_count,
+		    struct snd_rawmidi **rrawmidi)
+{
+	static const struct snd_device_ops ops = {
+		.dev_free = shim_rawmidi_free,
+		.dev_register = shim_rawmidi_register,
+	};
+	struct shim_uart *u;
+	struct snd_rawmidi *rmidi = kzalloc(sizeof(*rmidi), GFP_KERNEL);
+	struct snd_rawmidi_substream *s;
+	int count[2] = { output_count, input_count };
+	int i, n, err;
+
+	if (!rmidi)
+		return -ENOMEM;
+	rmidi->card = card;
+	rmidi->device = device;
+	snprintf(rmidi->name, sizeof(rmidi->name), "%s", id);
+	for (i = 0; i < 2; i++) {
+		INIT_LIST_HEAD(&rmidi->streams[i].substreams);
+		rmidi->streams[i].substream_count = count[i];
+		for (n = 0; n < count[i]; n++) {
+			s = kzalloc(sizeof(*s), GFP_KERNEL);
+			if (!s)
+				return -ENOMEM;
+			s->stream = i;
+			s->number = n;
+			s->rmidi = rmidi;
+			list_add_tail(&s->list,
+				      &rmidi->streams[i].substreams);
+		}
+	}
+	err = snd_device_new(card, SNDRV_DEV_RAWMIDI, rmidi, &ops);
+	if (err)
+		return err;
+	if (shim_probing >= 0) {
+		u = &shim_uarts[shim_probing];
+		u->rmidi[u->rmidi[0] ? 1 : 0] = rmidi;
+	}
+	*rrawmidi = rmidi;
+	return 0;
+}
+
+void snd_rawmidi_set_ops(struct snd_rawmidi *rmidi, int stream,
+			 const struct snd_rawmidi_ops *ops)
+{
+	struct snd_rawmidi_substream *s;
+
+	list_for_each_entry(s, &rmidi->streams[stream].substreams, list)
+		s->ops = ops;
+}
+
+/* A substream of a rawmidi device of UART n, 0 the first it made */
+struct snd_rawmidi_substream *shim_substream(int n, int dev, int stream,
+					     int number)
+{
+	struct snd_rawmidi *rmidi = shim_uarts[n].rmidi[dev];
+	struct snd_rawmidi_substream *s;
+
+	if (!rmidi)
+		return NULL;
+	list_for_each_entry(s, &rmidi->streams[stream].substreams, list)
+		if (s->number == number)
+			return s;
+	return NULL;
+}
+
+int shim_open(struct snd_rawmidi_substream *substream)
+{
+	struct snd_rawmidi_runtime *runtime;
+	int size;
+	int err;
+
+	if (substream->runtime)
+		return -EBUSY;
+	runtime = kzalloc(sizeof(*runtime), GFP_KERNEL);
+	if (!runtime)
+		return -ENOMEM;
+	size = substream->stream == SNDRV_RAWMIDI_STREAM_OUTPUT ?
+	       sim_cfg.out_buffer : sim_cfg.in_buffer;
+	runtime->buffer = kmalloc(size, GFP_KERNEL);
+	runtime->buffer_size = size;
+	runtime->avail_min = 1;
+	if (substream->stream == SNDRV_RAWMIDI_STREAM_OUTPUT)
+		runtime->avail = size;
+	spin_lock_init(&runtime->lock);
+	init_waitqueue_head(&runtime->sleep);
+	substream->runtime = runtime;
+
+	err = substream->ops->open(substream);
+	if (err) {
+		kfree(runtime->buffer);
+		kfree(runtime);
+		substream->runtime = NULL;
+		return err;
+	}
+	/* The reader is there from the start */
+	if (substream->stream == SNDRV_RAWMIDI_STREAM_INPUT)
+		substream->ops->trigger(substream, 1);
+	return 0;
+}
+
+/* As snd_rawmidi_drain_output: wait for the buffer to empty, then let
+ * the driver drain its own */
+void shim_drain(struct snd_rawmidi_substream *substream)
+{
+	struct snd_rawmidi_runtime *runtime = substream->runtime;
+
+	if (!runtime || substream->stream != SNDRV_RAWMIDI_STREAM_OUTPUT)
+		return;
+	runtime->sleep.woken = runtime->avail >= runtime->buffer_size;
+	if (!runtime->sleep.woken)
+		sim_run_until(sim_now + 10 * NSEC_PER_SEC, &runtime->sleep.woken);
+	if (runtime->avail < runtime->buffer_size)
+		printk(KERN_WARNING "rawmidi drain error (avail = %zu, buffer_size = %zu)\n",
+		       runtime->avail, runtime->buffer_size);
+	if (substream->ops->drain)
+		substream->ops->drain(substream);
+}
+
+void shim_close(struct snd_rawmidi_substream *substream)
+{
+	struct snd_rawmidi_runtime *runtime = substream->runtime;
+
+	if (!runtime)
+		return;
+	if (substream->stream == SNDRV_RAWMIDI_STREAM_OUTPUT)
+		shim_drain(substream);
+	substream->ops->trigger(substream, 0);
+	substream->ops->close(substream);
+	substream->runtime = NULL;
+	kfree(runtime->buffer);
+	kfree(runtime);
+}
+
+int shim_write_room(struct snd_rawmidi_substream *substream)
+{
+	return substream->runtime ? substream->runtime->avail : 0;
+}
+
+/* As snd_rawmidi_write: copy what fits, then trigger. With
+ * writer_irqs_off the trigger comes as from the sequencer's timer */
+int shim_write(struct snd_rawmidi_substream *substream,
+	       const unsigned char *buf, int count)
+{
+	struct snd_rawmidi_runtime *runtime = substream->runtime;
+	int n, done = 0;
+
+	if (!runtime)
+		return -EBADFD;
+	while (done < count && runtime->avail) {
+		n = min_t(int, count - done, runtime->buffer_size -
+			  runtime->appl_ptr);
+		n = min_t(int, n, runtime->avail);
+		memcpy(runtime->buffer + runtime->appl_ptr, buf + done, n);
+		runtime->appl_ptr = (runtime->appl_ptr + n) %
+				    runtime->buffer_size;
+		runtime->avail -= n;
+		done += n;
+	}
+	if (done) {
+		if (sim_cfg.writer_irqs_off)
+			shim_irqs_set(sim_irqs_off + 1);
+		substream->ops->trigger(substream, 1);
+		if (sim_cfg.writer_irqs_off)
+			shim_irqs_set(sim_irqs_off - 1);
+	}
+	return done;
+}
+
+int snd_rawmidi_transmit_peek(struct snd_rawmidi_substream *substream,
+			      unsigned char *buffer, int count)
+{
+	struct snd_rawmidi_runtime *runtime = substream->runtime;
+	size_t pos;
+	int n, done = 0;
+
+	if (!runtime || !runtime->buffer)
+		return -EINVAL;
+	count = min_t(int, count, runtime->buffer_size - runtime->avail);
+	pos = runtime->hw_ptr;
+	while (done < count) {
+		n = min_t(int, count - done, runtime->buffer_size - pos);
+		memcpy(buffer + done, runtime->buffer + pos, n);
+		pos = (pos + n) % runtime->buffer_size;
+		done += n;
+	}
+	return done;
+}
+
+int snd_rawmidi_transmit_ack(struct snd_rawmidi_substream *substream,
+			     int count)
+{
+	struct snd_rawmidi_runtime *runtime = substream->runtime;
+
+	if (!runtime || !runtime->buffer)
+		return -EINVAL;
+	count = min_t(int, count, runtime->buffer_size - runtime->avail);
+	runtime->hw_ptr = (runtime->hw_ptr + count) % runtime->buffer_size;
+	runtime->avail += count;
+	if (runtime->avail >= runtime->buffer_size)
+		wake_up(&runtime->sleep);
+	sim_output_acked();
+	return count;
+}
+
+/* As the core: what fits, the rest counts as an xrun */
+int snd_rawmidi_receive(struct snd_rawmidi_substream *substream,
+			const unsigned char *buffer, int count)
+{
+	struct snd_rawmidi_runtime *runtime = substream->runtime;
+	int n, done = 0, room;
+
+	if (!runtime || !runtime->buffer)
+		return -EINVAL;
+	room = min_t(int, count, runtime->buffer_size - runtime->avail);
+	while (done < room) {
+		n = min_t(int, room - done, runtime->buffer_size -
+			  runtime->hw_ptr);
+		memcpy(runtime->buffer + runtime->hw_ptr, buffer + done, n);
+		runtime->hw_ptr = (runtime->hw_ptr + n) % runtime->buffer_size;
+		runtime->avail += n;
+		done += n;
+	}
+	runtime->xruns += count - done;
+	if (runtime->avail >= runtime->avail_min)
+		wake_up(&runtime->sleep);
+	return done;
+}
+
+int shim_read(struct snd_rawmidi_substream *substream, unsigned char *buf,
+	      int count)
+{
+	struct snd_rawmidi_runtime *runtime = substream->runtime;
+	int n, done = 0;
+
+	if (!runtime)
+		return 0;
+	count = min_t(int, count, runtime->avail);
+	while (done < count) {
+		n = min_t(int, count - done, runtime->buffer_size -
+			  runtime->appl_ptr);
+		memcpy(buf + done, runtime->buffer + runtime->appl_ptr, n);
+		runtime->appl_ptr = (runtime->appl_ptr + n) %
+				    runtime->buffer_size;
+		runtime->avail -= n;
+		done += n;
+	}
+	if (!runtime->avail)
+		runtime->sleep.woken = 0;
+	return done;
+}
+
+/* A reader sleeping on the substream would have been woken */
+int shim_read_woken(struct snd_rawmidi_substream *substream)
+{
+	return substream->runtime && substream->runtime->sleep.woken;
+}
+
+size_t shim_xruns(struct snd_rawmidi_substream *substream)
+{
+	return substream->runtime ? substream->runtime->xruns : 0;
+}
@@ -0,0 +1,369 @@
+/*
+ * Kernel API shim for building serial-pl011.c in userspace.
+ *
+ * Only what the driver uses is here. Everything runs in one thread on
+ * the simulated clock of sim.c: locks only track whether interrupts are
+ * "off", timers, tasklets and the IRQ line are events of the simulation,
+ * and register accesses go to the PL011 model.
+ */
+#ifndef _SHIM_KERNEL_H
+#define _SHIM_KERNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef unsigned int gfp_t;
+typedef u64 dma_addr_t;
+typedef s64 ktime_t;
+
+#define GFP_KERNEL	0
+#define GFP_ATOMIC	1
+
+#define __init
+#define __exit
+#define __iomem
+#define __packed	__attribute__((packed))
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+#define READ_ONCE(x)	(*(volatile typeof(x) *)&(x))
+#define barrier()	__asm__ __volatile__("" : : : "memory")
+#define smp_load_acquire(p)	(*(p))
+#define smp_store_release(p, v)	(*(p) = (v))
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(a, b) ({ typeof(a) _a = (a); typeof(b) _b = (b); \
+		     (void)(&_a == &_b); _a < _b ? _a : _b; })
+#define max(a, b) ({ typeof(a) _a = (a); typeof(b) _b = (b); \
+		     (void)(&_a == &_b); _a > _b ? _a : _b; })
+#define min_t(t, a, b)	((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b)	((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define clamp_t(t, v, lo, hi)	min_t(t, max_t(t, v, lo), hi)
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+#define DIV_ROUND_CLOSEST(x, d)	(((x) + (d) / 2) / (d))
+
+#define MAX_ERRNO	4095
+#define IS_ERR(p)	((unsigned long)(p) >= (unsigned long)-MAX_ERRNO)
+#define PTR_ERR(p)	((long)(p))
+#define ERR_PTR(e)	((void *)(long)(e))
+
+#define HZ		250
+#define NSEC_PER_SEC	1000000000LL
+#define NSEC_PER_MSEC	1000000LL
+#define NSEC_PER_USEC	1000LL
+
+/* printk */
+#define KERN_ERR	"<3>"
+#define KERN_WARNING	"<4>"
+#define KERN_INFO	"<6>"
+#define KERN_DEBUG	"<7>"
+int printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+int printk_ratelimit(void);
+#define snd_printk(fmt, ...)	printk(fmt, ##__VA_ARGS__)
+
+/* memory */
+static inline void *kmalloc(size_t size, gfp_t gfp) { return malloc(size); }
+static inline void *kzalloc(size_t size, gfp_t gfp) { return calloc(1, size); }
+static inline void kfree(const void *p) { free((void *)p); }
+
+/* bit tricks */
+static inline int fls64(u64 x) { return x ? 64 - __builtin_clzll(x) : 0; }
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+	return n <= 1 ? 1 : 1UL << (64 - __builtin_clzl(n - 1));
+}
+static inline u64 div_u64(u64 n, u32 d) { return n / d; }
+
+unsigned long find_first_zero_bit(const unsigned long *addr,
+				  unsigned long size);
+unsigned long find_first_bit(const unsigned long *addr, unsigned long size);
+static inline void set_bit(long nr, volatile unsigned long *addr)
+{
+	*addr |= 1UL << nr;
+}
+static inline void clear_bit(long nr, volatile unsigned long *addr)
+{
+	*addr &= ~(1UL << nr);
+}
+static inline int test_and_clear_bit(long nr, volatile unsigned long *addr)
+{
+	int old = !!(*addr & (1UL << nr));
+
+	*addr &= ~(1UL << nr);
+	return old;
+}
+
+typedef struct {
+	s64 counter;
+} atomic64_t;
+#define ATOMIC64_INIT(i)	{ (i) }
+static inline s64 atomic64_read(const atomic64_t *v) { return v->counter; }
+static inline void atomic64_set(atomic64_t *v, s64 i) { v->counter = i; }
+static inline s64 atomic64_xchg(atomic64_t *v, s64 i)
+{
+	s64 old = v->counter;
+
+	v->counter = i;
+	return old;
+}
+
+/* simulated time */
+extern s64 sim_now;
+static inline ktime_t ktime_get(void) { return sim_now; }
+ktime_t ktime_get_real(void);
+ktime_t ktime_get_raw(void);
+#define ns_to_ktime(ns)		((ktime_t)(ns))
+#define ktime_set(s, ns)	((ktime_t)(s) * NSEC_PER_SEC + (ns))
+#define ktime_add(a, b)		((a) + (b))
+#define ktime_sub(a, b)		((a) - (b))
+#define ktime_add_ns(a, ns)	((a) + (ns))
+#define ktime_sub_ns(a, ns)	((a) - (s64)(ns))
+#define ktime_add_ms(a, ms)	((a) + (s64)(ms) * NSEC_PER_MSEC)
+#define ktime_to_ns(a)		((s64)(a))
+#define ktime_to_us(a)		((s64)(a) / NSEC_PER_USEC)
+#define ktime_after(a, b)	((a) > (b))
+#define ktime_before(a, b)	((a) < (b))
+struct timespec64 {
+	s64 tv_sec;
+	long tv_nsec;
+};
+static inline struct timespec64 ktime_to_timespec64(ktime_t t)
+{
+	struct timespec64 ts = { t / NSEC_PER_SEC, t % NSEC_PER_SEC };
+	return ts;
+}
+
+#define jiffies		((unsigned long)(sim_now / (NSEC_PER_SEC / HZ)))
+#define time_after(a, b)	((long)((b) - (a)) < 0)
+static inline unsigned long msecs_to_jiffies(unsigned int ms)
+{
+	return (ms * HZ + 999) / 1000;
+}
+
+/* hrtimers, expiry is an event of the simulation */
+enum hrtimer_restart { HRTIMER_NORESTART, HRTIMER_RESTART };
+enum hrtimer_mode { HRTIMER_MODE_ABS, HRTIMER_MODE_REL };
+#define CLOCK_MONOTONIC	1
+struct hrtimer {
+	enum hrtimer_restart (*function)(struct hrtimer *);
+	ktime_t expires;
+	int queued;
+	int running;
+};
+void hrtimer_init(struct hrtimer *timer, int clock, enum hrtimer_mode mode);
+void hrtimer_start(struct hrtimer *timer, ktime_t t, enum hrtimer_mode mode);
+int hrtimer_cancel(struct hrtimer *timer);
+int hrtimer_try_to_cancel(struct hrtimer *timer);
+u64 hrtimer_forward_now(struct hrtimer *timer, ktime_t interval);
+
+/* tasklets run once the interrupt and timer that raised them are done */
+struct tasklet_struct {
+	void (*func)(unsigned long);
+	unsigned long data;
+	int scheduled;
+};
+void tasklet_init(struct tasklet_struct *t, void (*func)(unsigned long),
+		  unsigned long data);
+void tasklet_schedule(struct tasklet_struct *t);
+void tasklet_kill(struct tasklet_struct *t);
+
+struct work_struct {
+	void (*func)(struct work_struct *);
+};
+int schedule_work(struct work_struct *work);
+
+/* Locks: one thread, so they only keep the interrupt state, to catch
+ * spin_unlock_bh with interrupts off as the kernel would and to time
+ * how long interrupts stay off */
+typedef struct {
+	int held;
+} spinlock_t;
+extern int sim_irqs_off;
+void shim_irqs_set(int off);
+void shim_bh_enable(void);
+static inline void spin_lock_init(spinlock_t *l) { l->held = 0; }
+static inline void spin_lock(spinlock_t *l) { l->held++; }
+static inline void spin_unlock(spinlock_t *l) { l->held--; }
+#define spin_lock_irqsave(l, flags) \
+	do { (flags) = sim_irqs_off; shim_irqs_set(sim_irqs_off + 1); \
+	     spin_lock(l); } while (0)
+static inline void spin_unlock_irqrestore(spinlock_t *l, unsigned long flags)
+{
+	spin_unlock(l);
+	shim_irqs_set(flags);
+}
+static inline int irqs_disabled(void) { return sim_irqs_off > 0; }
+static inline void spin_lock_bh(spinlock_t *l) { spin_lock(l); }
+static inline void spin_unlock_bh(spinlock_t *l)
+{
+	spin_unlock(l);
+	shim_bh_enable();
+}
+
+struct mutex {
+	int held;
+};
+#define DEFINE_MUTEX(m)	struct mutex m
+static inline void mutex_lock(struct mutex *m) { m->held++; }
+static inline void mutex_unlock(struct mutex *m) { m->held--; }
+
+/* Sleeping runs the simulation until woken or timed out */
+typedef struct {
+	int woken;
+} wait_queue_head_t;
+struct wait_queue_entry {
+	wait_queue_head_t *head;
+};
+#define DEFINE_WAIT(w)	struct wait_queue_entry w = { NULL }
+#define TASK_UNINTERRUPTIBLE	2
+static inline void init_waitqueue_head(wait_queue_head_t *q) { q->woken = 0; }
+static inline void wake_up(wait_queue_head_t *q) { q->woken = 1; }
+void prepare_to_wait(wait_queue_head_t *q, struct wait_queue_entry *w,
+		     int state);
+void finish_wait(wait_queue_head_t *q, struct wait_queue_entry *w);
+long schedule_timeout(long timeout);
+
+/* Register access, into the PL011 model */
+u16 readw(const volatile void __iomem *addr);
+u8 readb(const volatile void __iomem *addr);
+void writew(u16 val, volatile void __iomem *addr);
+void writeb(u8 val, volatile void __iomem *addr);
+
+/* interrupts */
+typedef enum { IRQ_NONE, IRQ_HANDLED, IRQ_WAKE_THREAD } irqreturn_t;
+typedef irqreturn_t (*irq_handler_t)(int, void *);
+#define IRQF_ONESHOT	0x2000
+int request_irq(unsigned int irq, irq_handler_t handler, unsigned long flags,
+		const char *name, void *dev);
+int request_threaded_irq(unsigned int irq, irq_handler_t handler,
+			 irq_handler_t thread_fn, unsigned long flags,
+			 const char *name, void *dev);
+void free_irq(unsigned int irq, void *dev);
+void irq_wake_thread(unsigned int irq, void *dev);
+
+/* list */
+struct list_head {
+	struct list_head *next, *prev;
+};
+static inline void INIT_LIST_HEAD(struct list_head *h)
+{
+	h->next = h->prev = h;
+}
+static inline void list_add_tail(struct list_head *n, struct list_head *h)
+{
+	n->prev = h->prev;
+	n->next = h;
+	h->prev->next = n;
+	h->prev = n;
+}
+static inline void list_del(struct list_head *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+#define list_for_each_entry(pos, head, member) \
+	for (pos = container_of((head)->next, typeof(*pos), member); \
+	     &pos->member != (head); \
+	     pos = container_of(pos->member.next, typeof(*pos), member))
+
+/* module */
+#define MODULE_DESCRIPTION(x)
+#define MODULE_LICENSE(x)
+#define MODULE_SUPPORTED_DEVICE(x)
+#define MODULE_PARM_DESC(name, desc)
+#define module_param(name, type, perm)
+#define module_init(fn)	int shim_module_init(void) { return fn(); }
+#define module_exit(fn)	void shim_module_exit(void) { fn(); }
+#define THIS_MODULE	NULL
+
+/* devices */
+struct device_node;
+struct kobject {
+	const struct attribute_group *groups[4];
+};
+struct device {
+	const char *name;
+	struct device_node *of_node;
+	void *driver_data;
+	struct kobject kobj;
+	struct device *parent;
+};
+static inline void *dev_get_drvdata(const struct device *dev)
+{
+	return dev->driver_data;
+}
+static inline const char *dev_name(const struct device *dev)
+{
+	return dev->name;
+}
+
+struct attribute {
+	const char *name;
+	int mode;
+};
+struct attribute_group {
+	const char *name;
+	struct attribute **attrs;
+};
+struct device_attribute {
+	struct attribute attr;
+	ssize_t (*show)(struct device *, struct device_attribute *, char *);
+	ssize_t (*store)(struct device *, struct device_attribute *,
+			 const char *, size_t);
+};
+#define DEVICE_ATTR_RW(_name) \
+	struct device_attribute dev_attr_##_name = \
+		{ { #_name, 0644 }, _name##_show, _name##_store }
+int sysfs_create_group(struct kobject *kobj,
+		       const struct attribute_group *grp);
+void sysfs_remove_group(struct kobject *kobj,
+			const struct attribute_group *grp);
+int sysfs_streq(const char *s1, const char *s2);
+int kstrtoint(const char *s, unsigned int base, int *res);
+int kstrtouint(const char *s, unsigned int base, unsigned int *res);
+
+int of_property_read_u32(const struct device_node *np, const char *name,
+			 u32 *val);
+bool of_property_read_bool(const struct device_node *np, const char *name);
+
+struct resource {
+	unsigned long start, end;
+};
+static inline unsigned long resource_size(const struct resource *res)
+{
+	return res->end - res->start + 1;
+}
+struct resource *request_mem_region(unsigned long start, unsigned long n,
+				    const char *name);
+void release_and_free_resource(struct resource *res);
+void __iomem *devm_ioremap(struct device *dev, unsigned long offset,
+			   unsigned long size);
+
+struct clk;
+struct clk *devm_clk_get(struct device *dev, const char *id);
+unsigned long clk_get_rate(struct clk *clk);
+static inline int clk_prepare_enable(struct clk *clk) { return 0; }
+static inline void clk_disable_unprepare(struct clk *clk) { }
+
+static inline int pinctrl_pm_select_default_state(struct device *dev)
+{
+	return 0;
+}
+static inline int pinctrl_pm_select_sleep_state(struct device *dev)
+{
+	return 0;
+}
+
+#endif /* _SHIM_KERNEL_H */
@@ -0,0 +1,38 @@
+#ifndef _SHIM_AMBA_BUS_H
+#define _SHIM_AMBA_BUS_H
+
+#include "../../kernel.h"
+
+#define AMBA_NR_IRQS	9
+
+struct amba_device {
+	struct device dev;
+	struct resource res;
+	unsigned int irq[AMBA_NR_IRQS];
+};
+
+struct amba_id {
+	unsigned int id;
+	unsigned int mask;
+	void *data;
+};
+
+struct device_driver {
+	const char *name;
+};
+
+struct amba_driver {
+	struct device_driver drv;
+	int (*probe)(struct amba_device *, const struct amba_id *);
+	int (*remove)(struct amba_device *);
+	const struct amba_id *id_table;
+};
+
+#define amba_get_drvdata(d)	dev_get_drvdata(&(d)->dev)
+#define amba_set_drvdata(d, p)	((d)->dev.driver_data = (p))
+
+/* The harness binds the UARTs of the model to the registered driver */
+int amba_driver_register(struct amba_driver *drv);
+void amba_driver_unregister(struct amba_driver *drv);
+
+#endif /* _SHIM_AMBA_BUS_H */
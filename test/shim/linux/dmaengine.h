@@ -0,0 +1,10 @@
+#ifndef _SHIM_DMAENGINE_H
+#define _SHIM_DMAENGINE_H
+
+#include "../kernel.h"
+
+/* CONFIG_DMA_ENGINE is left unset, the driver builds its PIO stubs */
+struct dma_chan;
+typedef s32 dma_cookie_t;
+
+#endif /* _SHIM_DMAENGINE_H */
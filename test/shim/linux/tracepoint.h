@@ -0,0 +1,10 @@
+#ifndef _SHIM_TRACEPOINT_H
+#define _SHIM_TRACEPOINT_H
+
+/* Trace events compile to nothing */
+#define TP_PROTO(args...)	args
+#define TP_ARGS(args...)	args
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+	static inline void trace_##name(proto) { }
+
+#endif /* _SHIM_TRACEPOINT_H */
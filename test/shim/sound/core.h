@@ -0,0 +1,52 @@
+#ifndef _SHIM_SOUND_CORE_H
+#define _SHIM_SOUND_CORE_H
+
+#include "../kernel.h"
+
+struct snd_info_entry;
+
+struct snd_card {
+	int number;
+	char driver[16];
+	char shortname[32];
+	char longname[80];
+	struct device *dev;
+	struct device card_dev;
+	struct list_head devices;
+	struct snd_info_entry *proc_root;
+	int registered;
+};
+
+enum snd_device_type {
+	SNDRV_DEV_LOWLEVEL,
+	SNDRV_DEV_RAWMIDI,
+};
+
+struct snd_device;
+
+struct snd_device_ops {
+	int (*dev_free)(struct snd_device *dev);
+	int (*dev_register)(struct snd_device *dev);
+	int (*dev_disconnect)(struct snd_device *dev);
+};
+
+struct snd_device {
+	struct list_head list;
+	struct snd_card *card;
+	enum snd_device_type type;
+	void *device_data;
+	const struct snd_device_ops *ops;
+	int registered;
+};
+
+int snd_card_new(struct device *parent, int idx, const char *xid,
+		 void *module, int extra_size, struct snd_card **card_ret);
+int snd_card_register(struct snd_card *card);
+int snd_card_free(struct snd_card *card);
+#define snd_card_set_dev(card, devptr)	((card)->dev = (devptr))
+
+int snd_device_new(struct snd_card *card, enum snd_device_type type,
+		   void *device_data, const struct snd_device_ops *ops);
+void snd_device_free(struct snd_card *card, void *device_data);
+
+#endif /* _SHIM_SOUND_CORE_H */
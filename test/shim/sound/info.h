@@ -0,0 +1,47 @@
+#ifndef _SHIM_SOUND_INFO_H
+#define _SHIM_SOUND_INFO_H
+
+#include "core.h"
+
+struct snd_info_buffer {
+	char *buffer;
+	size_t len;
+	size_t size;
+};
+
+/* Entries hang off the card's proc_root and get their proc file when
+ * the card is registered, as from 4.2 on */
+struct snd_info_entry {
+	char name[32];
+	struct snd_card *card;
+	struct snd_info_entry *parent;
+	struct list_head children;
+	struct list_head list;
+	int registered;
+	void *private_data;
+	void (*read)(struct snd_info_entry *entry,
+		     struct snd_info_buffer *buffer);
+};
+
+int snd_iprintf(struct snd_info_buffer *buffer, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+struct snd_info_entry *snd_info_create_card_entry(struct snd_card *card,
+		const char *name, struct snd_info_entry *parent);
+void snd_info_free_entry(struct snd_info_entry *entry);
+
+static inline int snd_card_proc_new(struct snd_card *card, const char *name,
+				    struct snd_info_entry **entryp)
+{
+	*entryp = snd_info_create_card_entry(card, name, card->proc_root);
+	return *entryp ? 0 : -ENOMEM;
+}
+
+static inline void snd_info_set_text_ops(struct snd_info_entry *entry,
+	void *private_data,
+	void (*read)(struct snd_info_entry *, struct snd_info_buffer *))
+{
+	entry->private_data = private_data;
+	entry->read = read;
+}
+
+#endif /* _SHIM_SOUND_INFO_H */
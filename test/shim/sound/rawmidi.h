@@ -0,0 +1,87 @@
+#ifndef _SHIM_SOUND_RAWMIDI_H
+#define _SHIM_SOUND_RAWMIDI_H
+
+#include "core.h"
+
+#define SNDRV_RAWMIDI_STREAM_OUTPUT	0
+#define SNDRV_RAWMIDI_STREAM_INPUT	1
+
+#define SNDRV_RAWMIDI_INFO_OUTPUT	0x00000001
+#define SNDRV_RAWMIDI_INFO_INPUT	0x00000002
+#define SNDRV_RAWMIDI_INFO_DUPLEX	0x00000004
+
+struct snd_rawmidi_substream;
+
+/* Output: avail is the free space, the driver reads at hw_ptr.
+ * Input: avail is what the reader has not taken, the driver writes at
+ * hw_ptr. */
+struct snd_rawmidi_runtime {
+	unsigned char *buffer;
+	size_t buffer_size;
+	size_t avail;
+	size_t avail_min;
+	size_t appl_ptr;
+	size_t hw_ptr;
+	size_t xruns;
+	spinlock_t lock;
+	wait_queue_head_t sleep;
+	void (*event)(struct snd_rawmidi_substream *substream);
+	struct work_struct event_work;
+};
+
+struct snd_rawmidi;
+struct snd_rawmidi_ops;
+
+struct snd_rawmidi_substream {
+	struct list_head list;
+	int stream;
+	int number;
+	char name[32];
+	struct snd_rawmidi *rmidi;
+	struct snd_rawmidi_runtime *runtime;
+	const struct snd_rawmidi_ops *ops;
+};
+
+struct snd_rawmidi_str {
+	unsigned int substream_count;
+	struct list_head substreams;
+};
+
+struct snd_rawmidi;
+
+struct snd_rawmidi_global_ops {
+	int (*dev_register)(struct snd_rawmidi *rmidi);
+	int (*dev_unregister)(struct snd_rawmidi *rmidi);
+};
+
+struct snd_rawmidi {
+	struct snd_card *card;
+	int device;
+	unsigned int info_flags;
+	char name[80];
+	struct snd_rawmidi_str streams[2];
+	struct snd_rawmidi_global_ops *ops;
+	void *private_data;
+	int seq_device;		/* shim: snd-seq-midi would bind it */
+};
+
+struct snd_rawmidi_ops {
+	int (*open)(struct snd_rawmidi_substream *substream);
+	int (*close)(struct snd_rawmidi_substream *substream);
+	void (*trigger)(struct snd_rawmidi_substream *substream, int up);
+	void (*drain)(struct snd_rawmidi_substream *substream);
+};
+
+int snd_rawmidi_new(struct snd_card *card, char *id, int device,
+		    int output_count, int input_count,
+		    struct snd_rawmidi **rmidi);
+void snd_rawmidi_set_ops(struct snd_rawmidi *rmidi, int stream,
+			 const struct snd_rawmidi_ops *ops);
+int snd_rawmidi_receive(struct snd_rawmidi_substream *substream,
+			const unsigned char *buffer, int count);
+int snd_rawmidi_transmit_peek(struct snd_rawmidi_substream *substream,
+			      unsigned char *buffer, int count);
+int snd_rawmidi_transmit_ack(struct snd_rawmidi_substream *substream,
+			     int count);
+
+#endif /* _SHIM_SOUND_RAWMIDI_H */
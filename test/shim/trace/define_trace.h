@@ -0,0 +1 @@
+/* Nothing to generate, see linux/tracepoint.h */
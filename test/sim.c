@@ -0,0 +1,1520 @@
+/*
+ * Discrete event simulation of the serial MIDI driver on a PL011.
+ *
+ * A traffic script (see README) drives writers and readers on
+ * the rawmidi substreams and a far end on the other side of the wire.
+ * The far end takes the UART's output apart into ports, checks every
+ * message against what was written, and can send and throttle. At the
+ * end the metrics are printed and the script's expectations checked.
+ *
+ * Processes (writers, readers, the script itself) run one at a time:
+ * while a close or drain sleeps, the script waits for it.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define SIM_MAX_PORTS	16
+#define SIM_FRAME	32	/* struct snd_uart_pl011_frame */
+#define SIM_FRAME_DATA	16
+
+struct sim_config sim_cfg = {
+	.clk = 48000000,
+	.mmio_ns = 100,
+	.irq_latency_ns = 5 * SIM_US,
+	.thread_latency_ns = 20 * SIM_US,
+	.timer_latency_ns = 2 * SIM_US,
+	.out_buffer = 4096,
+	.in_buffer = 4096,
+	.uarts = 1,
+};
+struct pl011_model sim_uarts[SIM_MAX_UARTS];
+
+static const char *sim_script_name;
+
+static void sim_die(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s: ", sim_script_name);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(2);
+}
+
+static void *sim_grow(void *p, size_t *cap, size_t need, size_t size)
+{
+	if (need <= *cap)
+		return p;
+	*cap = need * 2 > 64 ? need * 2 : 64;
+	p = realloc(p, *cap * size);
+	if (!p)
+		sim_die("out of memory");
+	return p;
+}
+
+/* latency and error statistics */
+
+struct sim_stat {
+	double sum;
+	int64_t max;
+	unsigned long n;
+};
+
+static void sim_stat_add(struct sim_stat *s, int64_t v)
+{
+	s->sum += v;
+	if (!s->n || v > s->max)
+		s->max = v;
+	s->n++;
+}
+
+static double sim_stat_mean(const struct sim_stat *s)
+{
+	return s->n ? s->sum / s->n : 0;
+}
+
+/* MIDI messages, with running status taken out */
+
+struct midi_msg {
+	uint32_t hash;		/* FNV-1a over status and data */
+	int len;
+	int64_t t;
+};
+
+struct midi_queue {
+	struct midi_msg *msg;
+	size_t head, tail, cap;
+};
+
+static void midi_queue_push(struct midi_queue *q, struct midi_msg m)
+{
+	if (q->head && q->tail == q->cap) {
+		memmove(q->msg, q->msg + q->head,
+			(q->tail - q->head) * sizeof(*q->msg));
+		q->tail -= q->head;
+		q->head = 0;
+	}
+	q->msg = sim_grow(q->msg, &q->cap, q->tail + 1, sizeof(*q->msg));
+	q->msg[q->tail++] = m;
+}
+
+static size_t midi_queue_len(const struct midi_queue *q)
+{
+	return q->tail - q->head;
+}
+
+struct time_queue {
+	int64_t *t;
+	size_t head, tail, cap;
+};
+
+static void time_queue_push(struct time_queue *q, int64_t t)
+{
+	if (q->head && q->tail == q->cap) {
+		memmove(q->t, q->t + q->head, (q->tail - q->head) * sizeof(*q->t));
+		q->tail -= q->head;
+		q->head = 0;
+	}
+	q->t = sim_grow(q->t, &q->cap, q->tail + 1, sizeof(*q->t));
+	q->t[q->tail++] = t;
+}
+
+static int time_queue_pop(struct time_queue *q, int64_t *t)
+{
+	if (q->head == q->tail)
+		return 0;
+	*t = q->t[q->head++];
+	return 1;
+}
+
+enum { MIDI_NONE, MIDI_MSG, MIDI_RT };
+
+struct midi_parser {
+	uint8_t running;	/* channel status for running status */
+	uint8_t cur;		/* status of the message being parsed */
+	int mid;		/* status seen, message not complete */
+	int have, need;
+	int sysex;
+	uint32_t hash;
+	int len;
+	unsigned long stray;	/* data bytes without a status */
+};
+
+static uint32_t fnv(uint32_t h, uint8_t b)
+{
+	return (h ^ b) * 16777619u;
+}
+
+static void midi_start(struct midi_parser *p, uint8_t status, int need)
+{
+	p->cur = status;
+	p->need = need;
+	p->have = 0;
+	p->hash = fnv(2166136261u, status);
+	p->len = 1;
+}
+
+/* Give up the message being parsed, as a receiver does on a new status */
+static void midi_abort(struct midi_parser *p)
+{
+	p->sysex = 0;
+	p->mid = 0;
+	p->cur = 0;
+	p->have = 0;
+}
+
+static int midi_mid(const struct midi_parser *p)
+{
+	return p->sysex || p->mid;
+}
+
+static int midi_parse(struct midi_parser *p, uint8_t b, int64_t t,
+		      struct midi_msg *out)
+{
+	static const int common_len[8] = { 0, 1, 2, 1, 0, 0, 0, 0 };
+
+	if (b >= 0xf8)
+		return MIDI_RT;
+
+	if (p->sysex) {
+		if (b < 0x80) {
+			p->hash = fnv(p->hash, b);
+			p->len++;
+			return MIDI_NONE;
+		}
+		p->sysex = 0;
+		if (b == 0xf7) {
+			out->hash = fnv(p->hash, b);
+			out->len = p->len + 1;
+			out->t = t;
+			return MIDI_MSG;
+		}
+		/* cut short, lost */
+	}
+
+	if (b >= 0x80) {
+		p->mid = 0;
+		if (b == 0xf0) {
+			p->running = 0;
+			p->cur = 0;
+			p->sysex = 1;
+			p->hash = fnv(2166136261u, b);
+			p->len = 1;
+			return MIDI_NONE;
+		}
+		if (b == 0xf7)
+			return MIDI_NONE;
+		if (b >= 0xf0) {
+			p->running = 0;
+			midi_start(p, b, common_len[b & 7]);
+		} else {
+			p->running = b;
+			midi_start(p, b, (b & 0xe0) == 0xc0 ? 1 : 2);
+		}
+		if (p->need)
+			p->mid = 1;
+	} else {
+		if (!p->cur) {
+			if (!p->running) {
+				p->stray++;
+				return MIDI_NONE;
+			}
+			midi_start(p, p->running,
+				   (p->running & 0xe0) == 0xc0 ? 1 : 2);
+		}
+		p->hash = fnv(p->hash, b);
+		p->len++;
+		p->have++;
+		p->mid = 1;
+	}
+
+	if (p->have < p->need)
+		return MIDI_NONE;
+	out->hash = p->hash;
+	out->len = p->len;
+	out->t = t;
+	p->mid = 0;
+	p->cur = 0;
+	return MIDI_MSG;
+}
+
+/* Match a message against the expected ones, which are in order: what
+ * is skipped is lost */
+static int midi_match(struct midi_queue *q, const struct midi_msg *m,
+		      unsigned long *missing, int64_t *t)
+{
+	size_t i;
+
+	for (i = q->head; i < q->tail; i++) {
+		if (q->msg[i].hash == m->hash && q->msg[i].len == m->len) {
+			*missing += i - q->head;
+			*t = q->msg[i].t;
+			q->head = i + 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* writers, one per output */
+
+struct sim_writer {
+	struct snd_rawmidi_substream *sub;
+	int open;
+	int sched;		/* writes frames for tx_sched */
+	uint8_t *buf;		/* written, not yet taken by rawmidi */
+	size_t len, cap;
+	int idle;		/* nothing left in buf */
+	uint8_t frame[SIM_FRAME];
+	int frame_fill;
+	struct midi_parser src;
+	struct midi_queue expect;
+	unsigned long rt_expect;
+	unsigned long rt_wire;
+	struct sim_stat lat;
+};
+
+/* readers, one per input */
+
+struct sim_reader {
+	struct snd_rawmidi_substream *sub;
+	int open;
+	int tstamp;			/* frames from the rx_tstamp device */
+	struct time_queue arrival;	/* wire time of each byte */
+	struct midi_parser src;		/* as the far end sent it */
+	struct midi_queue expect;
+	struct midi_parser got;
+	int frame_left;			/* bytes left of the frame */
+	struct sim_stat lat;
+};
+
+static struct sim_writer writers[SIM_MAX_PORTS];
+static struct sim_reader readers[SIM_MAX_PORTS];
+static int sim_acked;		/* rawmidi took output, writers may go on */
+static int64_t sim_reader_next = SIM_NEVER;
+
+/* the far end: a MIDI interface taking the wire apart into ports */
+
+static struct {
+	int uart;			/* the one it is wired to */
+
+	/* from the UART */
+	unsigned long tx_wire;
+	int64_t tx_first, tx_last;
+	int port;			/* addressed by the wire */
+	int select;			/* F5 seen, port number next */
+	int mb_data;			/* MB: the data byte is next */
+	uint8_t mb_addr;
+	struct midi_parser parser[SIM_MAX_PORTS];
+	unsigned long tx_msgs, tx_mismatch, tx_missing, tx_split;
+	unsigned long tx_bad_port;
+	struct sim_stat tx_lat;
+
+	/* MIDI outputs of the far end, and CTS from them */
+	int rate;			/* baud */
+	int buffer;			/* bytes per port, 0 unlimited */
+	int flow;			/* CTS from the buffers */
+	int fill[SIM_MAX_PORTS];
+	int64_t drain_next[SIM_MAX_PORTS];
+	unsigned long overflows;
+	int cts;
+	int cts_want;
+
+	/* to the UART */
+	int rtscts;			/* hold off while RTS is down */
+	uint8_t *rx;
+	size_t rx_len, rx_off, rx_cap;
+	int rx_busy;
+	uint8_t rx_byte;
+	int64_t rx_done;
+	int64_t rx_next;
+	unsigned long rx_wire;
+	unsigned long rts_waits;
+	int rx_waiting;
+	int rx_select;			/* F5 demux of the input */
+	int rx_port;
+	unsigned long rx_unread;	/* for inputs not open */
+	unsigned long rx_msgs, rx_mismatch, rx_missing;
+	unsigned long rx_rt;
+	struct sim_stat rx_lat;
+	unsigned long xruns;
+	struct sim_stat tstamp_err;	/* frame stamp against arrival */
+	unsigned long rx_torn_frames;	/* reads not a whole number of them */
+} fe = {
+	.rate = 31250,
+	.cts = 1,
+	.cts_want = 1,
+	.rx_next = SIM_NEVER,
+};
+
+static struct pl011_model *farend_uart(void)
+{
+	return &sim_uarts[fe.uart];
+}
+
+static int sim_outs(void)
+{
+	int n = 0, i;
+
+	for (i = 0; i < SIM_MAX_PORTS; i++)
+		if (writers[i].sub)
+			n = i + 1;
+	return n;
+}
+
+static int64_t farend_byte_ns(void)
+{
+	return 10 * SIM_S / fe.rate;
+}
+
+static void farend_update_cts(void)
+{
+	int hi = fe.buffer * 3 / 4, lo = fe.buffer / 4;
+	int i, above = 0, below = 1;
+
+	if (!fe.flow || !fe.buffer)
+		return;
+	if (hi > fe.buffer - 2)
+		hi = fe.buffer - 2;
+	for (i = 0; i < SIM_MAX_PORTS; i++) {
+		if (fe.fill[i] >= hi)
+			above = 1;
+		if (fe.fill[i] > lo)
+			below = 0;
+	}
+	if (above)
+		fe.cts_want = 0;
+	else if (below)
+		fe.cts_want = 1;
+}
+
+/* A message for port has come through */
+static void farend_message(int port, const struct midi_msg *m)
+{
+	struct sim_writer *w = &writers[port];
+	int64_t t;
+
+	if (midi_match(&w->expect, m, &fe.tx_missing, &t)) {
+		fe.tx_msgs++;
+		sim_stat_add(&w->lat, m->t - t);
+		sim_stat_add(&fe.tx_lat, m->t - t);
+	} else {
+		fe.tx_mismatch++;
+		if (sim_cfg.verbose)
+			fprintf(stderr, "out%d: unexpected message, %d bytes\n",
+				port, m->len);
+	}
+}
+
+static void farend_port_byte(int port, int64_t t, uint8_t byte)
+{
+	struct midi_msg m;
+
+	if (port < 0 || port >= sim_outs()) {
+		fe.tx_bad_port++;
+		return;
+	}
+	if (fe.buffer) {
+		if (fe.fill[port] >= fe.buffer) {
+			fe.overflows++;
+			return;
+		}
+		if (!fe.fill[port]++)
+			fe.drain_next[port] = t + farend_byte_ns();
+		farend_update_cts();
+	}
+	switch (midi_parse(&fe.parser[port], byte, t, &m)) {
+	case MIDI_MSG:
+		farend_message(port, &m);
+		break;
+	case MIDI_RT:
+		writers[port].rt_wire++;
+		break;
+	}
+}
+
+/* A byte is out of the UART; called from inside the model */
+static void farend_tx(void *ctx, int64_t t, uint8_t byte)
+{
+	struct midi_parser *p;
+	int port;
+
+	if (!fe.tx_wire++)
+		fe.tx_first = t;
+	fe.tx_last = t;
+
+	switch (harness_wire(fe.uart)) {
+	case HARNESS_WIRE_PLAIN:
+		farend_port_byte(0, t, byte);
+		break;
+	case HARNESS_WIRE_F5:
+		if (fe.select) {
+			fe.select = 0;
+			fe.port = byte - 1;
+			if (fe.port >= 0 && fe.port < SIM_MAX_PORTS)
+				fe.parser[fe.port].running = 0;
+			break;
+		}
+		if (byte == 0xf5) {
+			if (fe.port >= 0 && fe.port < SIM_MAX_PORTS) {
+				p = &fe.parser[fe.port];
+				/* a part change inside a message breaks it */
+				if (midi_mid(p)) {
+					fe.tx_split++;
+					midi_abort(p);
+				}
+				p->running = 0;
+			}
+			fe.select = 1;
+			break;
+		}
+		farend_port_byte(fe.port, t, byte);
+		break;
+	case HARNESS_WIRE_MB:
+		if (!fe.mb_data) {
+			fe.mb_addr = byte;
+			fe.mb_data = 1;
+			break;
+		}
+		fe.mb_data = 0;
+		if ((fe.mb_addr & 0x0f) != 0x08) {
+			fe.tx_bad_port++;
+			break;
+		}
+		port = fe.mb_addr >> 4;
+		farend_port_byte(port == 0x0f ? 0 : port, t, byte);
+		break;
+	}
+}
+
+/* The far end's MIDI outputs play their buffers out */
+static void farend_drain(void)
+{
+	int i;
+
+	for (i = 0; i < SIM_MAX_PORTS; i++) {
+		while (fe.fill[i] && fe.drain_next[i] <= sim_now) {
+			fe.fill[i]--;
+			fe.drain_next[i] += farend_byte_ns();
+		}
+	}
+	farend_update_cts();
+	if (fe.cts_want != fe.cts) {
+		fe.cts = fe.cts_want;
+		pl011_set_cts(farend_uart(), sim_now, fe.cts);
+	}
+}
+
+/* A byte from the far end has arrived at the UART at t */
+static void farend_rx_arrived(int64_t t, uint8_t byte)
+{
+	struct sim_reader *r;
+	struct midi_msg m;
+	int port = 0;
+
+	if (harness_in_wire_f5(fe.uart)) {
+		if (fe.rx_select) {
+			fe.rx_select = 0;
+			fe.rx_port = byte - 1;
+			return;
+		}
+		if (byte == 0xf5) {
+			fe.rx_select = 1;
+			return;
+		}
+		port = fe.rx_port;
+	}
+	if (port < 0 || port >= SIM_MAX_PORTS || !readers[port].open) {
+		fe.rx_unread++;
+		return;
+	}
+	r = &readers[port];
+	time_queue_push(&r->arrival, t);
+	switch (midi_parse(&r->src, byte, t, &m)) {
+	case MIDI_MSG:
+		midi_queue_push(&r->expect, m);
+		break;
+	case MIDI_RT:
+		fe.rx_rt++;
+		break;
+	}
+}
+
+static int64_t farend_rx_char_ns(void)
+{
+	int64_t ns = pl011_char_ns(farend_uart());
+
+	return ns ? ns : farend_byte_ns();
+}
+
+static void farend_rx_run(void)
+{
+	if (fe.rx_busy && fe.rx_done <= sim_now) {
+		fe.rx_busy = 0;
+		fe.rx_wire++;
+		pl011_rx_char(farend_uart(), fe.rx_done, fe.rx_byte);
+		farend_rx_arrived(fe.rx_done, fe.rx_byte);
+		fe.rx_next = fe.rx_done;
+	}
+	if (fe.rx_busy || fe.rx_off == fe.rx_len) {
+		if (!fe.rx_busy)
+			fe.rx_next = SIM_NEVER;
+		return;
+	}
+	if (fe.rx_next > sim_now)
+		return;
+	if (fe.rtscts && !pl011_rts(farend_uart())) {
+		if (!fe.rx_waiting)
+			fe.rts_waits++;
+		fe.rx_waiting = 1;
+		fe.rx_next = sim_now + farend_rx_char_ns() / 10;
+		return;
+	}
+	fe.rx_waiting = 0;
+	fe.rx_byte = fe.rx[fe.rx_off++];
+	fe.rx_busy = 1;
+	fe.rx_done = sim_now + farend_rx_char_ns();
+}
+
+static void farend_send(const uint8_t *buf, size_t len)
+{
+	fe.rx = sim_grow(fe.rx, &fe.rx_cap, fe.rx_len + len, 1);
+	memcpy(fe.rx + fe.rx_len, buf, len);
+	fe.rx_len += len;
+	if (fe.rx_next == SIM_NEVER)
+		fe.rx_next = sim_now;
+}
+
+static int64_t farend_next_event(void)
+{
+	int64_t t = fe.rx_busy ? fe.rx_done : fe.rx_next;
+	int i;
+
+	for (i = 0; i < SIM_MAX_PORTS; i++)
+		if (fe.fill[i] && fe.drain_next[i] < t)
+			t = fe.drain_next[i];
+	if (fe.cts_want != fe.cts)
+		t = sim_now;
+	return t;
+}
+
+/* writers */
+
+static void writer_accepted(struct sim_writer *w, const uint8_t *buf, int n)
+{
+	struct midi_msg m;
+	uint32_t tv_nsec;
+	uint64_t tv_sec;
+	int64_t due;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		if (w->sched) {
+			w->frame[w->frame_fill++] = buf[i];
+			if (w->frame_fill < SIM_FRAME)
+				continue;
+			w->frame_fill = 0;
+			memcpy(&tv_nsec, w->frame + 4, 4);
+			memcpy(&tv_sec, w->frame + 8, 8);
+			due = (int64_t)tv_sec * SIM_S + tv_nsec;
+			for (j = 0; j < w->frame[1]; j++) {
+				switch (midi_parse(&w->src, w->frame[16 + j],
+						   due, &m)) {
+				case MIDI_MSG:
+					midi_queue_push(&w->expect, m);
+					break;
+				case MIDI_RT:
+					w->rt_expect++;
+					break;
+				}
+			}
+			continue;
+		}
+		switch (midi_parse(&w->src, buf[i], sim_now, &m)) {
+		case MIDI_MSG:
+			midi_queue_push(&w->expect, m);
+			break;
+		case MIDI_RT:
+			w->rt_expect++;
+			break;
+		}
+	}
+}
+
+static unsigned long sim_tx_written;
+
+static void writers_run(void)
+{
+	struct sim_writer *w;
+	int i, n;
+
+	sim_acked = 0;
+	for (i = 0; i < SIM_MAX_PORTS; i++) {
+		w = &writers[i];
+		if (!w->open || !w->len)
+			continue;
+		n = shim_write(w->sub, w->buf, w->len);
+		if (n <= 0)
+			continue;
+		writer_accepted(w, w->buf, n);
+		sim_tx_written += w->sched ? 0 : n;
+		memmove(w->buf, w->buf + n, w->len - n);
+		w->len -= n;
+		w->idle = !w->len;
+	}
+}
+
+static void writer_queue(struct sim_writer *w, const uint8_t *buf, size_t len)
+{
+	w->buf = sim_grow(w->buf, &w->cap, w->len + len, 1);
+	memcpy(w->buf + w->len, buf, len);
+	w->len += len;
+	w->idle = 0;
+	sim_acked = 1;
+}
+
+/* readers */
+
+static void reader_bytes(int port, const uint8_t *buf, int n,
+			 int64_t stamp)
+{
+	struct sim_reader *r = &readers[port];
+	struct midi_msg m;
+	int64_t arrival, t;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!time_queue_pop(&r->arrival, &arrival))
+			arrival = sim_now;
+		if (!i && stamp >= 0)
+			sim_stat_add(&fe.tstamp_err, stamp > arrival ?
+				     stamp - arrival : arrival - stamp);
+		if (midi_parse(&r->got, buf[i], sim_now, &m) != MIDI_MSG)
+			continue;
+		if (midi_match(&r->expect, &m, &fe.rx_missing, &t)) {
+			fe.rx_msgs++;
+			sim_stat_add(&r->lat, sim_now - t);
+			sim_stat_add(&fe.rx_lat, sim_now - t);
+		} else {
+			fe.rx_mismatch++;
+		}
+	}
+}
+
+static void reader_run(int port)
+{
+	struct sim_reader *r = &readers[port];
+	uint8_t buf[SIM_FRAME * 64];
+	uint32_t tv_nsec;
+	uint64_t tv_sec;
+	int i, n;
+
+	while ((n = shim_read(r->sub, buf, sizeof(buf))) > 0) {
+		if (!r->tstamp) {
+			reader_bytes(port, buf, n, -1);
+			continue;
+		}
+		if (n % SIM_FRAME)
+			fe.rx_torn_frames++;
+		for (i = 0; i + SIM_FRAME <= n; i += SIM_FRAME) {
+			memcpy(&tv_nsec, buf + i + 4, 4);
+			memcpy(&tv_sec, buf + i + 8, 8);
+			reader_bytes(port, buf + i + 16,
+				     buf[i + 1] > SIM_FRAME_DATA ?
+				     SIM_FRAME_DATA : buf[i + 1],
+				     (int64_t)tv_sec * SIM_S + tv_nsec);
+		}
+	}
+}
+
+static void readers_run(void)
+{
+	int i;
+
+	for (i = 0; i < SIM_MAX_PORTS; i++)
+		if (readers[i].open)
+			reader_run(i);
+	if (sim_cfg.reader_period_ns)
+		sim_reader_next = sim_now + sim_cfg.reader_period_ns;
+}
+
+void sim_output_acked(void)
+{
+	sim_acked = 1;
+}
+
+/* the script */
+
+enum sim_cmd {
+	CMD_OPEN_OUT, CMD_OPEN_IN, CMD_CLOSE_OUT, CMD_CLOSE_IN, CMD_WRITE,
+	CMD_SYSEX, CMD_SCHED, CMD_RX, CMD_CTS, CMD_SYSFS, CMD_DRAIN,
+	CMD_BIND, CMD_UNBIND,
+};
+
+struct sim_action {
+	int64_t t;
+	int seq;
+	enum sim_cmd cmd;
+	int port;
+	int arg;
+	int64_t due;
+	uint8_t *data;
+	int len;
+	char *attr, *value;
+};
+
+static struct sim_action *actions;
+static size_t nactions, actions_cap, next_action;
+static int64_t sim_end;
+
+struct sim_expect {
+	char metric[48];
+	char op[3];
+	double value;
+	int line;
+};
+
+static struct sim_expect *expects;
+static size_t nexpects, expects_cap;
+
+static int sim_depth;
+static unsigned long sim_bind_errors;
+
+static void sim_close_out(int port);
+static void sim_close_in(int port);
+
+static struct sim_writer *sim_writer(int port)
+{
+	struct sim_writer *w = &writers[port];
+
+	if (!w->open)
+		sim_die("out%d is not open", port);
+	return w;
+}
+
+static void sim_wait_idle(struct sim_writer *w)
+{
+	if (!w->idle)
+		sim_run_until(sim_now + 60 * SIM_S, &w->idle);
+}
+
+static void sim_do(struct sim_action *a)
+{
+	struct snd_rawmidi_substream *sub;
+	struct sim_writer *w;
+	uint8_t frame[SIM_FRAME];
+	uint32_t tv_nsec;
+	uint64_t tv_sec;
+	uint8_t *buf;
+	int err, i;
+
+	switch (a->cmd) {
+	case CMD_OPEN_OUT:
+		sub = shim_substream(fe.uart, 0, 0, a->port);
+		if (!sub)
+			sim_die("no output %d", a->port);
+		err = shim_open(sub);
+		if (err)
+			sim_die("open out %d: %d", a->port, err);
+		w = &writers[a->port];
+		w->sub = sub;
+		w->open = 1;
+		w->idle = 1;
+		break;
+	case CMD_OPEN_IN:
+		/* the rx_tstamp device is the second the UART makes */
+		sub = shim_substream(fe.uart, a->arg, 1, a->port);
+		if (!sub)
+			sim_die("no input %d%s", a->port,
+				a->arg ? " on the tstamp device" : "");
+		err = shim_open(sub);
+		if (err)
+			sim_die("open in %d: %d", a->port, err);
+		readers[a->port].sub = sub;
+		readers[a->port].open = 1;
+		readers[a->port].tstamp = a->arg;
+		break;
+	case CMD_CLOSE_OUT:
+		sim_close_out(a->port);
+		break;
+	case CMD_CLOSE_IN:
+		sim_close_in(a->port);
+		break;
+	case CMD_WRITE:
+		w = sim_writer(a->port);
+		if (w->sched)
+			sim_die("out%d takes frames", a->port);
+		writer_queue(w, a->data, a->len);
+		break;
+	case CMD_SYSEX:
+		w = sim_writer(a->port);
+		buf = malloc(a->arg + 2);
+		buf[0] = 0xf0;
+		for (i = 0; i < a->arg; i++)
+			buf[i + 1] = i & 0x7f;
+		buf[a->arg + 1] = 0xf7;
+		writer_queue(w, buf, a->arg + 2);
+		free(buf);
+		break;
+	case CMD_SCHED:
+		w = sim_writer(a->port);
+		if (!w->sched && (w->len || w->expect.tail))
+			sim_die("out%d takes bytes", a->port);
+		w->sched = 1;
+		memset(frame, 0, sizeof(frame));
+		frame[1] = a->len;
+		tv_sec = a->due / SIM_S;
+		tv_nsec = a->due % SIM_S;
+		memcpy(frame + 4, &tv_nsec, 4);
+		memcpy(frame + 8, &tv_sec, 8);
+		memcpy(frame + 16, a->data, a->len);
+		writer_queue(w, frame, sizeof(frame));
+		sim_tx_written += a->len;
+		break;
+	case CMD_RX:
+		farend_send(a->data, a->len);
+		break;
+	case CMD_CTS:
+		fe.cts = fe.cts_want = a->arg;
+		pl011_set_cts(farend_uart(), sim_now, a->arg);
+		break;
+	case CMD_SYSFS:
+		err = shim_sysfs_store(fe.uart, a->attr, a->value);
+		if (err)
+			fprintf(stderr, "%s: sysfs %s %s: %d\n",
+				sim_script_name, a->attr, a->value, err);
+		break;
+	case CMD_DRAIN:
+		w = sim_writer(a->port);
+		sim_wait_idle(w);
+		shim_drain(w->sub);
+		break;
+	case CMD_BIND:
+		err = shim_bind(a->port);
+		if (err) {
+			sim_bind_errors++;
+			fprintf(stderr, "%s: bind uart %d: %d\n",
+				sim_script_name, a->port, err);
+		}
+		break;
+	case CMD_UNBIND:
+		if (a->port == fe.uart) {
+			for (i = 0; i < SIM_MAX_PORTS; i++)
+				if (writers[i].open || readers[i].open)
+					sim_die("unbind uart %d: port %d is open",
+						a->port, i);
+		}
+		shim_unbind(a->port);
+		break;
+	}
+}
+
+static unsigned long sim_drops;
+
+static void sim_close_out(int port)
+{
+	struct sim_writer *w = sim_writer(port);
+
+	sim_wait_idle(w);
+	sim_drops += harness_port_drops(fe.uart, port);
+	shim_close(w->sub);
+	w->open = 0;
+}
+
+static void sim_close_in(int port)
+{
+	struct sim_reader *r = &readers[port];
+
+	if (!r->open)
+		sim_die("in%d is not open", port);
+	reader_run(port);
+	fe.xruns += shim_xruns(r->sub);
+	shim_close(r->sub);
+	r->open = 0;
+}
+
+/* the event loop */
+
+/* Woken readers, unless they only look now and then */
+static int readers_woken(void)
+{
+	int i;
+
+	if (sim_cfg.reader_period_ns)
+		return 0;
+	for (i = 0; i < SIM_MAX_PORTS; i++)
+		if (readers[i].open && shim_read_woken(readers[i].sub))
+			return 1;
+	return 0;
+}
+
+static int64_t sim_next_event(int64_t end)
+{
+	int64_t t = end, e;
+	int i;
+
+	if (sim_acked || readers_woken())
+		return sim_now;
+	e = shim_next_event();
+	if (e < t)
+		t = e;
+	for (i = 0; i < SIM_MAX_UARTS; i++) {
+		e = pl011_next_event(&sim_uarts[i]);
+		if (e < t)
+			t = e;
+	}
+	e = farend_next_event();
+	if (e < t)
+		t = e;
+	if (sim_reader_next < t)
+		t = sim_reader_next;
+	if (sim_depth == 1 && next_action < nactions &&
+	    actions[next_action].t < t)
+		t = actions[next_action].t;
+	return t;
+}
+
+/* Run until end, or until *stop is set */
+void sim_run_until(int64_t end, int *stop)
+{
+	unsigned long spins = 0;
+	int64_t t;
+
+	sim_depth++;
+	for (;;) {
+		if (stop && *stop)
+			break;
+		shim_run_due();
+		farend_drain();
+		farend_rx_run();
+		if (sim_acked)
+			writers_run();
+		if (readers_woken() || sim_reader_next <= sim_now)
+			readers_run();
+		while (sim_depth == 1 && next_action < nactions &&
+		       actions[next_action].t <= sim_now)
+			sim_do(&actions[next_action++]);
+		if (stop && *stop)
+			break;
+
+		t = sim_next_event(end);
+		if (t > end || (t == end && sim_now >= end))
+			break;
+		if (t > sim_now) {
+			sim_now = t;
+			spins = 0;
+		} else if (++spins > 1000000) {
+			sim_die("no progress at %lld ns", (long long)sim_now);
+		}
+	}
+	if (sim_now < end && !(stop && *stop))
+		sim_now = end;
+	sim_depth--;
+}
+
+/* script parsing */
+
+static int sim_line;
+
+static int64_t parse_us(const char *s)
+{
+	char *end;
+	double v = strtod(s, &end);
+
+	if (end == s || *end || v < 0)
+		sim_die("line %d: bad time '%s'", sim_line, s);
+	return (int64_t)(v * SIM_US + 0.5);
+}
+
+static long parse_int(const char *s)
+{
+	char *end;
+	long v = strtol(s, &end, 0);
+
+	if (end == s || *end)
+		sim_die("line %d: bad number '%s'", sim_line, s);
+	return v;
+}
+
+static int parse_port(const char *s)
+{
+	long v = parse_int(s);
+
+	if (v < 0 || v >= SIM_MAX_PORTS)
+		sim_die("line %d: bad port '%s'", sim_line, s);
+	return v;
+}
+
+static int parse_uart(const char *s)
+{
+	long v = parse_int(s);
+
+	if (v < 0 || v >= SIM_MAX_UARTS)
+		sim_die("line %d: bad uart '%s'", sim_line, s);
+	return v;
+}
+
+static uint8_t *parse_hex(char **tok, int n, int *len)
+{
+	uint8_t *data = malloc(n ? n : 1);
+	char *end;
+	long v;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		v = strtol(tok[i], &end, 16);
+		if (end == tok[i] || *end || v < 0 || v > 0xff)
+			sim_die("line %d: bad byte '%s'", sim_line, tok[i]);
+		data[i] = v;
+	}
+	*len = n;
+	return data;
+}
+
+static void add_action(struct sim_action *a)
+{
+	actions = sim_grow(actions, &actions_cap, nactions + 1,
+			   sizeof(*actions));
+	a->seq = nactions;
+	actions[nactions++] = *a;
+}
+
+/* One command at time t, from tok[0] */
+static void parse_command(int64_t t, char **tok, int n)
+{
+	struct sim_action a = { .t = t };
+
+	if (!n)
+		sim_die("line %d: command missing", sim_line);
+	if (!strcmp(tok[0], "open") || !strcmp(tok[0], "close")) {
+		if (n < 3 || (strcmp(tok[1], "out") && strcmp(tok[1], "in")))
+			sim_die("line %d: %s out|in <port>", sim_line, tok[0]);
+		a.port = parse_port(tok[2]);
+		if (tok[0][0] == 'o') {
+			a.cmd = tok[1][0] == 'o' ? CMD_OPEN_OUT : CMD_OPEN_IN;
+			a.arg = n > 3 && !strcmp(tok[3], "tstamp");
+		} else {
+			a.cmd = tok[1][0] == 'o' ? CMD_CLOSE_OUT : CMD_CLOSE_IN;
+		}
+	} else if (!strcmp(tok[0], "write") && n >= 3) {
+		a.cmd = CMD_WRITE;
+		a.port = parse_port(tok[1]);
+		a.data = parse_hex(tok + 2, n - 2, &a.len);
+	} else if (!strcmp(tok[0], "sysex") && n == 3) {
+		a.cmd = CMD_SYSEX;
+		a.port = parse_port(tok[1]);
+		a.arg = parse_int(tok[2]);
+	} else if (!strcmp(tok[0], "sched") && n >= 4) {
+		a.cmd = CMD_SCHED;
+		a.port = parse_port(tok[1]);
+		/* +us: due that long after it is written */
+		if (tok[2][0] == '+')
+			a.due = t + parse_us(tok[2] + 1);
+		else
+			a.due = parse_us(tok[2]);
+		if (n - 3 > SIM_FRAME_DATA)
+			sim_die("line %d: at most %d bytes a frame", sim_line,
+				SIM_FRAME_DATA);
+		a.data = parse_hex(tok + 3, n - 3, &a.len);
+	} else if (!strcmp(tok[0], "rx") && n >= 2) {
+		a.cmd = CMD_RX;
+		a.data = parse_hex(tok + 1, n - 1, &a.len);
+	} else if (!strcmp(tok[0], "cts") && n == 2) {
+		a.cmd = CMD_CTS;
+		a.arg = !!parse_int(tok[1]);
+	} else if (!strcmp(tok[0], "sysfs") && n == 3) {
+		a.cmd = CMD_SYSFS;
+		a.attr = strdup(tok[1]);
+		a.value = strdup(tok[2]);
+	} else if (!strcmp(tok[0], "drain") && n == 2) {
+		a.cmd = CMD_DRAIN;
+		a.port = parse_port(tok[1]);
+	} else if ((!strcmp(tok[0], "bind") || !strcmp(tok[0], "unbind")) &&
+		   n == 2) {
+		a.cmd = tok[0][0] == 'b' ? CMD_BIND : CMD_UNBIND;
+		a.port = parse_uart(tok[1]);
+	} else {
+		sim_die("line %d: unknown command '%s'", sim_line, tok[0]);
+	}
+	add_action(&a);
+}
+
+static void set_sim(const char *key, const char *value)
+{
+	if (!strcmp(key, "clk"))
+		sim_cfg.clk = parse_int(value);
+	else if (!strcmp(key, "mmio_ns"))
+		sim_cfg.mmio_ns = parse_int(value);
+	else if (!strcmp(key, "irq_latency"))
+		sim_cfg.irq_latency_ns = parse_us(value);
+	else if (!strcmp(key, "thread_latency"))
+		sim_cfg.thread_latency_ns = parse_us(value);
+	else if (!strcmp(key, "timer_latency"))
+		sim_cfg.timer_latency_ns = parse_us(value);
+	else if (!strcmp(key, "out_buffer"))
+		sim_cfg.out_buffer = parse_int(value);
+	else if (!strcmp(key, "in_buffer"))
+		sim_cfg.in_buffer = parse_int(value);
+	else if (!strcmp(key, "reader_period"))
+		sim_cfg.reader_period_ns = parse_us(value);
+	else if (!strcmp(key, "uarts"))
+		sim_cfg.uarts = parse_int(value);
+	else if (!strcmp(key, "writer_irqs_off"))
+		sim_cfg.writer_irqs_off = parse_int(value);
+	else
+		sim_die("line %d: unknown sim setting '%s'", sim_line, key);
+	if (sim_cfg.uarts < 1 || sim_cfg.uarts > SIM_MAX_UARTS)
+		sim_die("line %d: 1 to %d uarts", sim_line, SIM_MAX_UARTS);
+}
+
+static void set_farend(const char *key, const char *value)
+{
+	if (!strcmp(key, "rate"))
+		fe.rate = parse_int(value);
+	else if (!strcmp(key, "buffer"))
+		fe.buffer = parse_int(value);
+	else if (!strcmp(key, "flow"))
+		fe.flow = !!parse_int(value);
+	else if (!strcmp(key, "rtscts"))
+		fe.rtscts = !!parse_int(value);
+	else if (!strcmp(key, "uart"))
+		fe.uart = parse_uart(value);
+	else
+		sim_die("line %d: unknown farend setting '%s'", sim_line, key);
+	if (fe.rate <= 0 || fe.buffer < 0)
+		sim_die("line %d: bad farend %s", sim_line, key);
+}
+
+static int action_cmp(const void *a, const void *b)
+{
+	const struct sim_action *x = a, *y = b;
+
+	if (x->t != y->t)
+		return x->t < y->t ? -1 : 1;
+	return x->seq - y->seq;
+}
+
+#define MAX_TOKENS	256
+
+static void parse_script(FILE *f)
+{
+	char line[4096], *tok[MAX_TOKENS], *p;
+	struct sim_expect *e;
+	int64_t t, every;
+	long count, i;
+	int n;
+
+	while (fgets(line, sizeof(line), f)) {
+		sim_line++;
+		p = strchr(line, '#');
+		if (p)
+			*p = 0;
+		n = 0;
+		for (p = strtok(line, " \t\r\n"); p && n < MAX_TOKENS;
+		     p = strtok(NULL, " \t\r\n"))
+			tok[n++] = p;
+		if (!n)
+			continue;
+
+		if (!strcmp(tok[0], "set") && n == 3) {
+			if (harness_set_param(tok[1], tok[2]))
+				sim_die("line %d: bad parameter %s=%s",
+					sim_line, tok[1], tok[2]);
+		} else if (!strcmp(tok[0], "sim") && n == 3) {
+			set_sim(tok[1], tok[2]);
+		} else if (!strcmp(tok[0], "farend") && n == 3) {
+			set_farend(tok[1], tok[2]);
+		} else if (!strcmp(tok[0], "at") && n >= 3) {
+			parse_command(parse_us(tok[1]), tok + 2, n - 2);
+		} else if (!strcmp(tok[0], "repeat") && n >= 7 &&
+			   !strcmp(tok[2], "every") && !strcmp(tok[4], "at")) {
+			count = parse_int(tok[1]);
+			every = parse_us(tok[3]);
+			t = parse_us(tok[5]);
+			for (i = 0; i < count; i++)
+				parse_command(t + i * every, tok + 6, n - 6);
+		} else if (!strcmp(tok[0], "run") && n == 2) {
+			sim_end = parse_us(tok[1]);
+		} else if (!strcmp(tok[0], "expect") && n == 4) {
+			expects = sim_grow(expects, &expects_cap, nexpects + 1,
+					   sizeof(*expects));
+			e = &expects[nexpects++];
+			snprintf(e->metric, sizeof(e->metric), "%s", tok[1]);
+			snprintf(e->op, sizeof(e->op), "%s", tok[2]);
+			e->value = strtod(tok[3], NULL);
+			e->line = sim_line;
+		} else {
+			/* a command without a time is at 0 */
+			parse_command(0, tok, n);
+		}
+	}
+	qsort(actions, nactions, sizeof(*actions), action_cmp);
+}
+
+/* metrics */
+
+struct sim_metric {
+	char name[48];
+	double value;
+};
+
+static struct sim_metric *metrics;
+static size_t nmetrics, metrics_cap;
+
+static void metric(const char *name, double value)
+{
+	metrics = sim_grow(metrics, &metrics_cap, nmetrics + 1,
+			   sizeof(*metrics));
+	snprintf(metrics[nmetrics].name, sizeof(metrics[nmetrics].name),
+		 "%s", name);
+	metrics[nmetrics++].value = value;
+}
+
+static const struct sim_metric *find_metric(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < nmetrics; i++)
+		if (!strcmp(metrics[i].name, name))
+			return &metrics[i];
+	return NULL;
+}
+
+static void collect_metrics(void)
+{
+	unsigned long tx_missing = fe.tx_missing, rx_missing = fe.rx_missing;
+	unsigned long rt_missing = 0, stray = 0;
+	double bytes = fe.tx_wire + fe.rx_wire;
+	char name[48];
+	int i;
+
+	for (i = 0; i < SIM_MAX_PORTS; i++) {
+		tx_missing += midi_queue_len(&writers[i].expect);
+		rx_missing += midi_queue_len(&readers[i].expect);
+		if (writers[i].rt_expect > writers[i].rt_wire)
+			rt_missing += writers[i].rt_expect -
+				      writers[i].rt_wire;
+		stray += fe.parser[i].stray + readers[i].got.stray;
+	}
+
+	metric("sim_ms", sim_now / (double)SIM_MS);
+	metric("irqs", shim_stats.irqs);
+	metric("irqs_unhandled", shim_stats.irqs_unhandled);
+	metric("irq_threads", shim_stats.irq_threads);
+	metric("timer_fires", shim_stats.timer_fires);
+	metric("tasklets", shim_stats.tasklets);
+	metric("mmio", shim_stats.mmio);
+	metric("cpu_us", shim_stats.cpu_ns / (double)SIM_US);
+	metric("cpu_load_pct", sim_now ?
+	       100.0 * shim_stats.cpu_ns / sim_now : 0);
+	metric("irqs_per_byte", bytes ? shim_stats.irqs / bytes : 0);
+
+	metric("tx_written", sim_tx_written);
+	metric("tx_wire", fe.tx_wire);
+	metric("tx_wire_per_byte", sim_tx_written ?
+	       (double)fe.tx_wire / sim_tx_written : 0);
+	metric("tx_line_util_pct", fe.tx_last > fe.tx_first ?
+	       100.0 * farend_uart()->tx_busy_ns /
+	       (fe.tx_last - fe.tx_first + pl011_char_ns(farend_uart())) : 0);
+	metric("tx_fifo_avg", farend_uart()->tx_chars ?
+	       (double)farend_uart()->tx_fifo_sum / farend_uart()->tx_chars : 0);
+	metric("tx_fifo_overwrites", farend_uart()->tx_overwrites);
+	metric("tx_msgs", fe.tx_msgs);
+	metric("tx_mismatch", fe.tx_mismatch);
+	metric("tx_missing", tx_missing);
+	metric("tx_split", fe.tx_split);
+	metric("tx_bad_port", fe.tx_bad_port);
+	metric("tx_rt_missing", rt_missing);
+	metric("tx_lat_mean_us", sim_stat_mean(&fe.tx_lat) / SIM_US);
+	metric("tx_lat_max_us", fe.tx_lat.max / (double)SIM_US);
+	for (i = 0; i < SIM_MAX_PORTS; i++) {
+		if (!writers[i].sub)
+			continue;
+		snprintf(name, sizeof(name), "out%d_lat_mean_us", i);
+		metric(name, sim_stat_mean(&writers[i].lat) / SIM_US);
+		snprintf(name, sizeof(name), "out%d_lat_max_us", i);
+		metric(name, writers[i].lat.max / (double)SIM_US);
+	}
+	metric("drops", sim_drops);
+	metric("farend_overflows", fe.overflows);
+	metric("cts_stalls", farend_uart()->tx_cts_stalls);
+
+	metric("rx_wire", fe.rx_wire);
+	metric("rx_overruns", farend_uart()->rx_overruns);
+	metric("rx_xruns", fe.xruns);
+	metric("rx_unread", fe.rx_unread);
+	metric("rts_waits", fe.rts_waits);
+	metric("rx_msgs", fe.rx_msgs);
+	metric("rx_mismatch", fe.rx_mismatch);
+	metric("rx_missing", rx_missing);
+	metric("rx_lat_mean_us", sim_stat_mean(&fe.rx_lat) / SIM_US);
+	metric("rx_lat_max_us", fe.rx_lat.max / (double)SIM_US);
+	metric("rx_tstamp_err_mean_us", sim_stat_mean(&fe.tstamp_err) / SIM_US);
+	metric("rx_tstamp_err_max_us", fe.tstamp_err.max / (double)SIM_US);
+	metric("rx_torn_frames", fe.rx_torn_frames);
+	for (i = 0; i < SIM_MAX_PORTS; i++) {
+		if (!readers[i].sub)
+			continue;
+		snprintf(name, sizeof(name), "in%d_lat_mean_us", i);
+		metric(name, sim_stat_mean(&readers[i].lat) / SIM_US);
+		snprintf(name, sizeof(name), "in%d_lat_max_us", i);
+		metric(name, readers[i].lat.max / (double)SIM_US);
+	}
+
+	metric("stray_bytes", stray);
+	metric("kernel_warnings", shim_stats.warnings);
+	metric("bh_irqs_off", shim_stats.bh_irqs_off);
+	metric("irqs_off_us", shim_stats.irqs_off_ns / (double)SIM_US);
+	metric("irqs_off_max_us", shim_stats.irqs_off_max_ns / (double)SIM_US);
+	metric("bind_errors", sim_bind_errors);
+	metric("seq_devices", shim_stats.seq_devices);
+}
+
+static int check_expects(void)
+{
+	const struct sim_metric *m;
+	struct sim_expect *e;
+	int failed = 0, ok;
+	size_t i;
+
+	for (i = 0; i < nexpects; i++) {
+		e = &expects[i];
+		m = find_metric(e->metric);
+		if (!m) {
+			fprintf(stderr, "%s:%d: no metric '%s'\n",
+				sim_script_name, e->line, e->metric);
+			failed++;
+			continue;
+		}
+		if (!strcmp(e->op, "=="))
+			ok = m->value == e->value;
+		else if (!strcmp(e->op, "!="))
+			ok = m->value != e->value;
+		else if (!strcmp(e->op, "<"))
+			ok = m->value < e->value;
+		else if (!strcmp(e->op, "<="))
+			ok = m->value <= e->value;
+		else if (!strcmp(e->op, ">"))
+			ok = m->value > e->value;
+		else if (!strcmp(e->op, ">="))
+			ok = m->value >= e->value;
+		else
+			sim_die("line %d: bad operator '%s'", e->line, e->op);
+		if (!ok) {
+			fprintf(stderr, "%s:%d: expected %s %s %g, got %g\n",
+				sim_script_name, e->line, e->metric, e->op,
+				e->value, m->value);
+			failed++;
+		}
+	}
+	return failed;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: pl011sim [-v] [-s] [-p] [-D param=value]... script\n"
+		"  -v  kernel messages and far end errors on stderr\n"
+		"  -s  one summary line instead of all metrics\n"
+		"  -p  print the driver's proc file at the end\n"
+		"  -D  set a module parameter, over the script's own\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *defines[32];
+	int ndefines = 0, summary = 0, proc = 0;
+	const struct sim_metric *m;
+	char *eq;
+	FILE *f;
+	size_t i;
+	int err, failed;
+
+	for (i = 1; i < (size_t)argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-v"))
+			sim_cfg.verbose = 1;
+		else if (!strcmp(argv[i], "-s"))
+			summary = 1;
+		else if (!strcmp(argv[i], "-p"))
+			proc = 1;
+		else if (!strcmp(argv[i], "-D") && i + 1 < (size_t)argc &&
+			 ndefines < 32)
+			defines[ndefines++] = argv[++i];
+		else
+			usage();
+	}
+	if (i + 1 != (size_t)argc)
+		usage();
+	sim_script_name = argv[i];
+
+	f = fopen(sim_script_name, "r");
+	if (!f)
+		sim_die("%s", strerror(errno));
+	parse_script(f);
+	fclose(f);
+	if (!sim_end)
+		sim_die("no run");
+
+	for (i = 0; i < (size_t)ndefines; i++) {
+		eq = strchr(defines[i], '=');
+		if (!eq)
+			usage();
+		*eq = 0;
+		if (harness_set_param(defines[i], eq + 1))
+			sim_die("bad parameter %s=%s", defines[i], eq + 1);
+	}
+
+	for (i = 0; i < SIM_MAX_UARTS; i++)
+		pl011_init(&sim_uarts[i], sim_cfg.clk,
+			   i == fe.uart ? farend_tx : NULL, NULL);
+	err = harness_init();
+	if (err)
+		sim_die("probe failed: %d", err);
+
+	sim_run_until(sim_end, NULL);
+
+	/* Close what is left, as the processes exit, then let the wire
+	 * settle */
+	sim_depth++;
+	for (i = 0; i < SIM_MAX_PORTS; i++)
+		if (writers[i].open)
+			sim_close_out(i);
+	for (i = 0; i < SIM_MAX_PORTS; i++)
+		if (readers[i].open)
+			sim_close_in(i);
+	sim_depth--;
+	next_action = nactions;
+	sim_run_until(sim_now + 10 * SIM_MS, NULL);
+
+	collect_metrics();
+	if (proc)
+		shim_proc_dump(stdout, "");
+	harness_exit();
+
+	failed = check_expects();
+	if (summary) {
+		printf("%-28s", sim_script_name);
+		for (i = 0; i < 7; i++) {
+			static const char *const cols[] = {
+				"irqs_per_byte", "tx_fifo_avg",
+				"tx_line_util_pct", "tx_lat_mean_us",
+				"tx_lat_max_us", "cpu_load_pct", "drops",
+			};
+			m = find_metric(cols[i]);
+			printf(" %10.3f", m ? m->value : 0);
+		}
+		printf("%s\n", failed ? "  FAILED" : "");
+	} else {
+		for (i = 0; i < nmetrics; i++)
+			printf("%-24s %g\n", metrics[i].name, metrics[i].value);
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * Glue between the simulation (sim.c), the kernel shim (shim.c), the
+ * PL011 model and the driver (harness.c).
+ */
+#ifndef _SIM_H
+#define _SIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "pl011_model.h"
+
+#define SIM_NEVER	PL011_NEVER
+#define SIM_US		1000LL
+#define SIM_MS		1000000LL
+#define SIM_S		1000000000LL
+
+#define SIM_MAX_UARTS	2
+
+/* Costs of the host, in simulated nanoseconds */
+struct sim_config {
+	unsigned long clk;		/* UARTCLK */
+	int64_t mmio_ns;		/* one register access */
+	int64_t irq_latency_ns;		/* IRQ line to handler */
+	int64_t thread_latency_ns;	/* wakeup to IRQ thread running */
+	int64_t timer_latency_ns;	/* hrtimer expiry to callback */
+	int out_buffer;			/* rawmidi buffer sizes */
+	int in_buffer;
+	int64_t reader_period_ns;	/* 0: the reader is always waiting */
+	int uarts;			/* bound at the start */
+	int writer_irqs_off;		/* writes trigger with interrupts off */
+	int verbose;
+};
+
+extern struct sim_config sim_cfg;
+extern struct pl011_model sim_uarts[SIM_MAX_UARTS];
+extern int64_t sim_now;
+
+/* sim.c */
+void sim_run_until(int64_t end, int *stop);
+void sim_output_acked(void);
+
+/* shim.c: the kernel side of the simulation */
+struct shim_stats {
+	unsigned long irqs;		/* hard handler calls */
+	unsigned long irqs_unhandled;
+	unsigned long irq_threads;
+	unsigned long timer_fires;	/* hrtimer callbacks */
+	unsigned long tasklets;
+	unsigned long mmio;
+	int64_t cpu_ns;			/* in handlers, timers, tasklets */
+	unsigned long warnings;		/* KERN_WARNING and worse */
+	unsigned long bh_irqs_off;	/* spin_unlock_bh, interrupts off */
+	unsigned long seq_devices;	/* rawmidi devices the sequencer gets */
+	int64_t irqs_off_ns;		/* with interrupts off, in all */
+	int64_t irqs_off_max_ns;	/* the longest stretch */
+};
+extern struct shim_stats shim_stats;
+
+struct snd_rawmidi_substream;
+
+int64_t shim_next_event(void);
+void shim_run_due(void);
+int shim_bind(int n);
+void shim_unbind(int n);
+void *shim_drvdata(int n);
+struct snd_rawmidi_substream *shim_substream(int n, int dev, int stream,
+					     int number);
+int shim_open(struct snd_rawmidi_substream *substream);
+void shim_close(struct snd_rawmidi_substream *substream);
+int shim_write(struct snd_rawmidi_substream *substream,
+	       const unsigned char *buf, int count);
+int shim_write_room(struct snd_rawmidi_substream *substream);
+int shim_read(struct snd_rawmidi_substream *substream, unsigned char *buf,
+	      int count);
+int shim_read_woken(struct snd_rawmidi_substream *substream);
+void shim_drain(struct snd_rawmidi_substream *substream);
+size_t shim_xruns(struct snd_rawmidi_substream *substream);
+int shim_sysfs_store(int n, const char *attr, const char *value);
+void shim_proc_dump(FILE *f, const char *indent);
+
+/* harness.c: what the simulation needs to know of the driver */
+enum harness_wire {
+	HARNESS_WIRE_PLAIN,	/* one port, no addressing */
+	HARNESS_WIRE_F5,	/* F5 nn selects the port */
+	HARNESS_WIRE_MB,	/* an address byte before every byte */
+};
+
+int harness_set_param(const char *name, const char *value);
+int harness_init(void);
+void harness_exit(void);
+enum harness_wire harness_wire(int n);
+int harness_in_wire_f5(int n);
+unsigned long harness_port_drops(int n, int port);
+
+#endif /* _SIM_H */